@@ -487,7 +487,7 @@ int docmd_delr(arg_struct *arg) {
         int4 newsize = (rows - 1) * columns;
         if (m->type == TYPE_REALMATRIX) {
             realmatrix_data *array = (realmatrix_data *)
-                                malloc(sizeof(realmatrix_data));
+                                slab_alloc(sizeof(realmatrix_data));
             if (array == NULL) {
                 if (interactive)
                     free_vartype(newx);
@@ -497,7 +497,7 @@ int docmd_delr(arg_struct *arg) {
             if (array->data == NULL) {
                 if (interactive)
                     free_vartype(newx);
-                free(array);
+                slab_free(array, sizeof(realmatrix_data));
                 return ERR_INSUFFICIENT_MEMORY;
             }
             array->is_string = (char *) malloc(newsize);
@@ -505,7 +505,7 @@ int docmd_delr(arg_struct *arg) {
                 if (interactive)
                     free_vartype(newx);
                 free(array->data);
-                free(array);
+                slab_free(array, sizeof(realmatrix_data));
                 return ERR_INSUFFICIENT_MEMORY;
             }
             for (i = 0; i < matedit_i * columns; i++) {
@@ -525,7 +525,7 @@ int docmd_delr(arg_struct *arg) {
             rm->rows--;
         } else {
             complexmatrix_data *array = (complexmatrix_data *)
-                                malloc(sizeof(complexmatrix_data));
+                                slab_alloc(sizeof(complexmatrix_data));
             if (array == NULL) {
                 if (interactive)
                     free_vartype(newx);
@@ -535,7 +535,7 @@ int docmd_delr(arg_struct *arg) {
             if (array->data == NULL) {
                 if (interactive)
                     free_vartype(newx);
-                free(array);
+                slab_free(array, sizeof(complexmatrix_data));
                 return ERR_INSUFFICIENT_MEMORY;
             }
             for (i = 0; i < 2 * matedit_i * columns; i++)
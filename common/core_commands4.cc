@@ -131,7 +131,7 @@ int docmd_insr(arg_struct *arg) {
         int4 newsize = (rows + 1) * columns;
         if (m->type == TYPE_REALMATRIX) {
             realmatrix_data *array = (realmatrix_data *)
-                                malloc(sizeof(realmatrix_data));
+                                slab_alloc(sizeof(realmatrix_data));
             if (array == NULL) {
                 if (interactive)
                     free_vartype(newx);
@@ -141,7 +141,7 @@ int docmd_insr(arg_struct *arg) {
             if (array->data == NULL) {
                 if (interactive)
                     free_vartype(newx);
-                free(array);
+                slab_free(array, sizeof(realmatrix_data));
                 return ERR_INSUFFICIENT_MEMORY;
             }
             array->is_string = (char *) malloc(newsize);
@@ -149,7 +149,7 @@ int docmd_insr(arg_struct *arg) {
                 if (interactive)
                     free_vartype(newx);
                 free(array->data);
-                free(array);
+                slab_free(array, sizeof(realmatrix_data));
                 return ERR_INSUFFICIENT_MEMORY;
             }
             for (i = 0; i < matedit_i * columns; i++) {
@@ -170,7 +170,7 @@ int docmd_insr(arg_struct *arg) {
             rm->rows++;
         } else {
             complexmatrix_data *array = (complexmatrix_data *)
-                                malloc(sizeof(complexmatrix_data));
+                                slab_alloc(sizeof(complexmatrix_data));
             if (array == NULL) {
                 if (interactive)
                     free_vartype(newx);
@@ -180,7 +180,7 @@ int docmd_insr(arg_struct *arg) {
             if (array->data == NULL) {
                 if (interactive)
                     free_vartype(newx);
-                free(array);
+                slab_free(array, sizeof(complexmatrix_data));
                 return ERR_INSUFFICIENT_MEMORY;
             }
             for (i = 0; i < 2 * matedit_i * columns; i++)
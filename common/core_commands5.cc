@@ -1143,6 +1143,34 @@ int docmd_vmsolve(arg_struct *arg) {
     return start_solve(0, arg->val.text, arg->length, v1, v2);
 }
 
+static int vsweep(int kind, arg_struct *arg) {
+    int err;
+    if (arg->type == ARGTYPE_IND_NUM
+            || arg->type == ARGTYPE_IND_STK
+            || arg->type == ARGTYPE_IND_STR) {
+        err = resolve_ind_arg(arg);
+        if (err != ERR_NONE)
+            return err;
+    }
+    if (arg->type != ARGTYPE_STR)
+        return ERR_INVALID_TYPE;
+    if (!program_running())
+        clear_all_rtns();
+    return start_sweep(kind, arg->val.text, arg->length);
+}
+
+int docmd_vsolve(arg_struct *arg) {
+    return vsweep(SWEEP_SOLVE, arg);
+}
+
+int docmd_vinteg(arg_struct *arg) {
+    return vsweep(SWEEP_INTEG, arg);
+}
+
+int docmd_roots(arg_struct *arg) {
+    return vsweep(SWEEP_ROOTS, arg);
+}
+
 int docmd_xor(arg_struct *arg) {
     int8 x, y;
     int err;
@@ -64,6 +64,9 @@ int docmd_eqninti(arg_struct *arg);
 int docmd_rotxy(arg_struct *arg);
 int docmd_solve(arg_struct *arg);
 int docmd_vmsolve(arg_struct *arg);
+int docmd_vsolve(arg_struct *arg);
+int docmd_vinteg(arg_struct *arg);
+int docmd_roots(arg_struct *arg);
 int docmd_xor(arg_struct *arg);
 int docmd_to_dec(arg_struct *arg);
 int docmd_to_oct(arg_struct *arg);
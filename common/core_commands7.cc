@@ -742,6 +742,7 @@ int docmd_fptest(arg_struct *arg) {
     tests_lineno = 0;
     char *argv[] = { (char *) "readtest", NULL };
     int result = readtest_main(1, argv);
+    result += phloat_conversion_test();
     vartype *v = new_real(result);
     if (v == NULL)
         return ERR_INSUFFICIENT_MEMORY;
@@ -1596,8 +1597,8 @@ static int concat(bool extend) {
                 // We're doing it manually rather than through free_vartype(), so
                 // we don't have to zero out the data array first.
                 free(list2->array->data);
-                free(list2->array);
-                free(list2);
+                slab_free(list2->array, sizeof(list_data));
+                slab_free(list2, sizeof(vartype_list));
             } else {
                 // Joining an empty list to the list in Y. This is not quite a
                 // no-op, since the binary_result() causes T duplication, which
@@ -2101,7 +2102,7 @@ int docmd_from_list(arg_struct *arg) {
         stack[3] = size;
     }
     free(list->array->data);
-    free(list->array);
-    free(list);
+    slab_free(list->array, sizeof(list_data));
+    slab_free(list, sizeof(vartype_list));
     return ERR_NONE;
 }
@@ -775,26 +775,70 @@ const unitdef units[] = {
     { NULL, NULL, 0, 0, 0 }
 };
 
-static const unitdef *find_unit(std::string s, int *exponent, vartype **user, std::string *un) {
+/* Open-addressing hash table over the names in units[], built on first use.
+ * The entries hold indexes into units[] plus one, so zero means empty.
+ */
+#define UNIT_HASH_SIZE 512
+
+static short unit_hash[UNIT_HASH_SIZE];
+static bool unit_hash_built = false;
+
+static int unit_hash_slot(const char *name, int length) {
+    int mask = UNIT_HASH_SIZE - 1;
+    int i = (int) (fnv1a(name, length) & mask);
+    while (unit_hash[i] != 0) {
+        const char *us = units[unit_hash[i] - 1].name;
+        if (strncmp(us, name, length) == 0 && us[length] == 0)
+            break;
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+static const unitdef *find_builtin_unit(const std::string &s) {
+    if (!unit_hash_built) {
+        for (int i = 0; units[i].name != NULL; i++) {
+            int slot = unit_hash_slot(units[i].name, strlen(units[i].name));
+            if (unit_hash[slot] == 0)
+                unit_hash[slot] = i + 1;
+        }
+        unit_hash_built = true;
+    }
+    int idx = unit_hash[unit_hash_slot(s.c_str(), s.length())];
+    return idx == 0 ? NULL : units + idx - 1;
+}
+
+/* What the result of UnitProduct::toBase() depends on, besides units[]:
+ * the names that were looked up as user-defined units and not found, and
+ * whether any user-defined unit was used.
+ */
+struct unit_deps {
+    std::vector<std::string> absent;
+    bool user;
+    unit_deps() : user(false) {}
+};
+
+static bool is_user_unit(vartype *v) {
+    return v != NULL && (v->type == TYPE_REAL || v->type == TYPE_UNIT);
+}
+
+static const unitdef *find_unit(std::string s, int *exponent, vartype **user, std::string *un, unit_deps *deps) {
     *exponent = 0;
     while (true) {
-        int idx = 0;
-        const char *cs = s.c_str();
-        while (true) {
-            const char *us = units[idx].name;
-            if (us == NULL)
-                break;
-            if (strcmp(us, cs) == 0)
-                return units + idx;
-            idx++;
-        }
+        const unitdef *ud = find_builtin_unit(s);
+        if (ud != NULL)
+            return ud;
         // Not in units table; look for user-defined unit...
         vartype *v = recall_var(s.c_str(), s.length());
-        if (v != NULL && (v->type == TYPE_REAL || v->type == TYPE_UNIT)) {
+        if (is_user_unit(v)) {
             *user = v;
             *un = s;
+            if (deps != NULL)
+                deps->user = true;
             return NULL;
         }
+        if (deps != NULL)
+            deps->absent.push_back(s);
         if (*exponent == -1 && s.length() > 1) {
             // Starts with a 'd' and still has 2 characters or more left;
             // try the 'da' prefix...
@@ -907,7 +951,7 @@ struct UnitProduct {
         }
     }
 
-    bool toBase(phloat *f, std::string *s);
+    bool toBase(phloat *f, std::string *s, unit_deps *deps = NULL);
 };
 
 class UnitLexer {
@@ -1151,7 +1195,7 @@ class UnitParser {
     }
 };
 
-bool UnitProduct::toBase(phloat *f, std::string *s) {
+bool UnitProduct::toBase(phloat *f, std::string *s, unit_deps *deps) {
     phloat v = 1;
     int exp = 0;
     std::string us = "";
@@ -1159,7 +1203,7 @@ bool UnitProduct::toBase(phloat *f, std::string *s) {
         int e;
         vartype *user;
         std::string userName;
-        const unitdef *ud = find_unit(iter->first, &e, &user, &userName);
+        const unitdef *ud = find_unit(iter->first, &e, &user, &userName, deps);
         int p = iter->second;
         if (ud == NULL) {
             if (user == NULL)
@@ -1233,16 +1277,93 @@ bool normalize_unit(std::string s, std::string *r) {
     return true;
 }
 
-bool is_unit(const char *text, int length) {
+/* Base unit cache
+ * Evaluating an equation with units, for example while SOLVE is running,
+ * converts the same few unit strings to base units over and over, and each
+ * conversion means parsing the string and looking up every unit in it. This
+ * is a small set-associative LRU in front of that, mapping unit strings to
+ * their base units and conversion factors. Only conversions that used built-in
+ * units alone are cached. Those can still be changed by user-defined units
+ * that did not exist when the entry was made, e.g. a variable named Mm would
+ * take precedence over the M prefix applied to m, so each entry remembers the
+ * names that were looked up and not found, and is discarded when one of them
+ * has been created since.
+ */
+
+#define UNIT_CACHE_SETS 8
+#define UNIT_CACHE_WAYS 4
+
+struct unit_cache_entry {
+    std::string text;
+    std::string base;
+    phloat factor;
+    std::vector<std::string> absent;
+    unsigned int last_used;
+    unit_cache_entry() : last_used(0) {}
+};
+
+static unit_cache_entry unit_cache[UNIT_CACHE_SETS][UNIT_CACHE_WAYS];
+static unsigned int unit_cache_clock = 0;
+
+static void unit_cache_clear() {
+    for (int i = 0; i < UNIT_CACHE_SETS; i++)
+        for (int j = 0; j < UNIT_CACHE_WAYS; j++)
+            unit_cache[i][j].last_used = 0;
+    unit_cache_clock = 0;
+}
+
+static bool unit_to_base(const char *text, int length, phloat *factor, std::string *base) {
+    unit_cache_entry *set = unit_cache[fnv1a(text, length) % UNIT_CACHE_SETS];
+
+    unit_cache_entry *victim = set;
+    for (int i = 0; i < UNIT_CACHE_WAYS; i++) {
+        unit_cache_entry *e = set + i;
+        if (e->last_used != 0
+                && e->text.length() == length
+                && memcmp(e->text.c_str(), text, length) == 0) {
+            bool valid = true;
+            for (size_t j = 0; j < e->absent.size(); j++)
+                if (is_user_unit(recall_var(e->absent[j].c_str(), e->absent[j].length()))) {
+                    valid = false;
+                    break;
+                }
+            if (valid) {
+                e->last_used = ++unit_cache_clock;
+                *factor = e->factor;
+                *base = e->base;
+                return true;
+            }
+            e->last_used = 0;
+            victim = e;
+            break;
+        }
+        if (e->last_used < victim->last_used)
+            victim = e;
+    }
+
     int errpos;
     UnitProduct *up = UnitParser::parse(std::string(text, length), &errpos);
     if (up == NULL)
         return false;
+    unit_deps deps;
+    bool success = up->toBase(factor, base, &deps);
+    delete up;
+    if (!success || deps.user)
+        return success;
+    if (unit_cache_clock == 0xffffffffu)
+        unit_cache_clear();
+    victim->text.assign(text, length);
+    victim->base = *base;
+    victim->factor = *factor;
+    victim->absent.swap(deps.absent);
+    victim->last_used = ++unit_cache_clock;
+    return true;
+}
+
+bool is_unit(const char *text, int length) {
     phloat f = 1;
     std::string s;
-    int success = up->toBase(&f, &s);
-    delete up;
-    return success;
+    return unit_to_base(text, length, &f, &s);
 }
 
 static int get_value_and_base(const vartype *v, phloat *value, std::string *baseUnit, phloat *factor) {
@@ -1253,14 +1374,10 @@ static int get_value_and_base(const vartype *v, phloat *value, std::string *base
         return true;
     }
     vartype_unit *u = (vartype_unit *) v;
-    int errpos;
-    UnitProduct *up = UnitParser::parse(std::string(u->text, u->length), &errpos);
-    if (up == NULL)
+    if (!unit_to_base(u->text, u->length, factor, baseUnit))
         return false;
-    bool success = up->toBase(factor, baseUnit);
-    delete up;
     *value = u->x;
-    return success;
+    return true;
 }
 
 static bool equiv_units(const std::string &x, const std::string &y) {
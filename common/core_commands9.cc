@@ -77,6 +77,7 @@ int docmd_crdir(arg_struct *arg) {
     string_copy(cwd->children[0].name, &cwd->children[0].length, arg->val.text, arg->length);
     cwd->children[0].dir = d;
     cwd->children_count++;
+    cwd->dirty |= DIR_DIRTY_DIRS;
     return ERR_NONE;
 }
 
@@ -101,6 +102,7 @@ int docmd_pgdir(arg_struct *arg) {
     delete cwd->children[pos].dir;
     memmove(cwd->children + pos, cwd->children + pos + 1, (cwd->children_count - pos - 1) * sizeof(subdir_struct));
     cwd->children_count--;
+    cwd->dirty |= DIR_DIRTY_DIRS;
     if (running_before && !program_running())
         return ERR_INTERRUPTED;
     else
@@ -209,6 +211,7 @@ int docmd_rename(arg_struct *arg) {
     if (pos2 != -1)
         return ERR_DIRECTORY_EXISTS;
     string_copy(cwd->children[pos].name, &cwd->children[pos].length, reg_alpha, reg_alpha_length);
+    cwd->dirty |= DIR_DIRTY_DIRS;
     return ERR_NONE;
 }
 
@@ -507,6 +510,7 @@ static int ref_move_copy(bool copy) {
                         memmove(parent->children + j, parent->children + j + 1,
                                 (parent->children_count - j - 1) * sizeof(subdir_struct));
                         parent->children_count--;
+                        parent->dirty |= DIR_DIRTY_DIRS;
                         dir->parent = cwd;
                         found = true;
                         break;
@@ -525,6 +529,7 @@ static int ref_move_copy(bool copy) {
         cwd->children = new_children;
         cwd->children_count = new_children_count;
         cwd->children_capacity = new_children_capacity;
+        cwd->dirty |= DIR_DIRTY_DIRS;
 
         // Directories done!
 
@@ -583,6 +588,7 @@ static int ref_move_copy(bool copy) {
                     continue;
                 int c = dir->prgms_count;
                 dir->prgms_count = 0;
+                dir->dirty |= DIR_DIRTY_PRGMS;
                 for (int j = 0; j < c; j++)
                     if (dir->prgms[j].capacity != -1)
                         dir->prgms[dir->prgms_count++] = dir->prgms[j];
@@ -602,6 +608,7 @@ static int ref_move_copy(bool copy) {
         cwd->prgms = new_prgms;
         cwd->prgms_count = new_prgms_count;
         cwd->prgms_capacity = new_prgms_capacity;
+        cwd->dirty |= DIR_DIRTY_PRGMS;
         if (!copy) {
             pgm_index saved_prgm = current_prgm;
             directory *saved_cwd = cwd;
@@ -637,12 +644,14 @@ static int ref_move_copy(bool copy) {
                     if (string_equals(new_vars[i].name, new_vars[i].length, dir->vars[j].name, dir->vars[j].length)) {
                         memmove(dir->vars + j, dir->vars + j + 1, (dir->vars_count - j - 1) * sizeof(var_struct));
                         dir->vars_count--;
+                        dir->dirty |= DIR_DIRTY_VARS;
                         break;
                     }
             }
             string_copy(real_new_vars[i].name, &real_new_vars[i].length,
                         new_vars[i].name, new_vars[i].length);
-            real_new_vars[i].level = real_new_vars[i].flags = 0;
+            real_new_vars[i].level = 0;
+            real_new_vars[i].flags = VAR_DIRTY;
             real_new_vars[i].value = new_vars[i].value;
         }
 
@@ -658,7 +667,8 @@ static int ref_move_copy(bool copy) {
             string_copy(real_new_vars[new_vars_count].name, &real_new_vars[new_vars_count].length,
                         cwd->vars[i].name, cwd->vars[i].length);
             real_new_vars[new_vars_count].value = cwd->vars[i].value;
-            real_new_vars[new_vars_count].level = real_new_vars[new_vars_count].flags = 0;
+            real_new_vars[new_vars_count].level = 0;
+            real_new_vars[new_vars_count].flags = cwd->vars[i].flags;
             new_vars_count++;
             skip4:;
         }
@@ -674,6 +684,7 @@ static int ref_move_copy(bool copy) {
         cwd->vars = real_new_vars;
         cwd->vars_count = new_vars_count;
         cwd->vars_capacity = new_vars_capacity;
+        cwd->dirty |= DIR_DIRTY_VARS;
 
     }
 
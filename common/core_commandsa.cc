@@ -26,6 +26,7 @@
 #include "core_helpers.h"
 #include "core_main.h"
 #include "core_math1.h"
+#include "core_parser.h"
 
 #define PLOT_STATE_IDLE 0
 #define PLOT_STATE_SCANNING 1
@@ -80,7 +81,13 @@ struct PlotData {
     phloat mark[4];
     phloat result;
     int result_type;
+    bool live;
+    int dirty_units;
     PlotData() {
+        /* Any plot that's in progress must write its state back first */
+        flush_plot_state();
+        live = false;
+        dirty_units = 0;
         vartype *v = recall_var("PPAR", 4);
         err = ERR_NONEXISTENT;
         if (v == NULL) {
@@ -207,6 +214,8 @@ struct PlotData {
         }
     }
     bool set_int(int index, int val) {
+        if (live)
+            return true;
         if (ppar->array->data[index] != NULL && ppar->array->data[index]->type == TYPE_REAL) {
             ((vartype_real *) ppar->array->data[index])->x = val;
             return true;
@@ -229,6 +238,8 @@ struct PlotData {
         return true;
     }
     bool set_phloat(int index, phloat val) {
+        if (live)
+            return true;
         if (ppar->array->data[index] != NULL && ppar->array->data[index]->type == TYPE_REAL) {
             ((vartype_real *) ppar->array->data[index])->x = val;
             return true;
@@ -241,6 +252,16 @@ struct PlotData {
         return true;
     }
     bool set_unit(int index, vartype *v) {
+        if (live) {
+            // The live copy owns its units; the caller has already stored
+            // the new one in axes[], and we take it over.
+            int a = index == PLOT_X_UNIT ? 0 : 1;
+            if (owned_unit[a] != v)
+                free_vartype(owned_unit[a]);
+            owned_unit[a] = v;
+            dirty_units |= 1 << a;
+            return true;
+        }
         if (v == NULL)
             v = new_real(0);
         else
@@ -260,6 +281,7 @@ struct PlotData {
         ppar->array->data[index] = v;
         return true;
     }
+    vartype *owned_unit[2];
     int conv_x(phloat x) {
         return to_int((x - axes[0].min) / (axes[0].max - axes[0].min) * (disp_w - 1) + 0.5);
     }
@@ -268,6 +290,66 @@ struct PlotData {
     }
 };
 
+/* While a plot is being drawn, return_to_plot() works on a decoded copy of
+ * PPAR, instead of decoding the list again for every sample; changes to the
+ * plot state are written back to PPAR when the plot is finished, when the
+ * program stops, or when anything else needs PPAR.
+ */
+static PlotData *live_plot = NULL;
+
+static PlotData *plot_go_live(PlotData *data) {
+    if (data->live)
+        return data;
+    flush_plot_state();
+    PlotData *p = new (std::nothrow) PlotData(*data);
+    if (p == NULL)
+        return data;
+    p->fun = p->fun == NULL ? NULL : dup_vartype(p->fun);
+    p->owned_unit[0] = p->axes[0].unit = dup_vartype(p->axes[0].unit);
+    p->owned_unit[1] = p->axes[1].unit = dup_vartype(p->axes[1].unit);
+    if (data->fun != NULL && p->fun == NULL
+            || p->axes[0].unit == NULL || p->axes[1].unit == NULL) {
+        free_vartype(p->fun);
+        free_vartype(p->axes[0].unit);
+        free_vartype(p->axes[1].unit);
+        delete p;
+        return data;
+    }
+    p->ppar = NULL;
+    p->live = true;
+    p->dirty_units = 0;
+    live_plot = p;
+    return p;
+}
+
+void flush_plot_state() {
+    PlotData *p = live_plot;
+    if (p == NULL)
+        return;
+    live_plot = NULL;
+    PlotData data;
+    if (data.err == ERR_NONE) {
+        for (int i = 0; i < 2; i++) {
+            int base = i == 0 ? PLOT_X_UNIT : PLOT_Y_UNIT;
+            if ((p->dirty_units & (1 << i)) != 0)
+                data.set_unit(base, p->axes[i].unit);
+            data.set_phloat(base + 1, p->axes[i].min);
+            data.set_phloat(base + 2, p->axes[i].max);
+        }
+        data.set_int(PLOT_STATE, p->state);
+        data.set_int(PLOT_X_PIXEL, p->x_pixel);
+        data.set_phloat(PLOT_LAST_Y, p->last_y);
+        for (int i = 0; i < 4; i++)
+            data.set_phloat(PLOT_MARK1_X + i, p->mark[i]);
+        data.set_phloat(PLOT_RESULT, p->result);
+        data.set_int(PLOT_RESULT_TYPE, p->result_type);
+    }
+    free_vartype(p->fun);
+    free_vartype(p->owned_unit[0]);
+    free_vartype(p->owned_unit[1]);
+    delete p;
+}
+
 int docmd_pgmplot(arg_struct *arg) {
     int err;
     if (arg->type == ARGTYPE_IND_NUM
@@ -672,12 +754,171 @@ static int call_plot_function(PlotData *data, phloat x) {
     }
 }
 
-static int do_it(PlotData *data) {
+static phloat pixel_x(PlotData *data, int pixel) {
     phloat xmin = data->axes[0].min;
     phloat xmax = data->axes[0].max;
-    int pixel = data->x_pixel;
-    phloat x = xmin + (xmax - xmin) * ((phloat) pixel) / (disp_w - 1);
-    return call_plot_function(data, x);
+    return xmin + (xmax - xmin) * ((phloat) pixel) / (disp_w - 1);
+}
+
+static void plot_point(PlotData *data, int pixel, phloat y);
+
+static int do_it(PlotData *data) {
+    return call_plot_function(data, pixel_x(data, data->x_pixel));
+}
+
+/* Plot sample cache
+ *
+ * The samples computed while plotting are kept, sorted by x, so that
+ * panning and zooming in the plot viewer, and redrawing the plot after
+ * EVAL, SOLVE, or INTEG, only evaluate the function at pixel columns that
+ * haven't been sampled before. The samples belong to the function, the
+ * axis variables, and the axis units they were computed with; PLOT and
+ * SCAN start with an empty cache, since the function may depend on other
+ * variables that have changed since the plot viewer was last active.
+ * Columns where the function could not be evaluated are cached as NaN.
+ */
+
+struct plot_sample {
+    phloat x, y;
+};
+
+#define PLOT_CACHE_MAX 4096
+
+static std::vector<plot_sample> plot_cache;
+static std::string plot_cache_context;
+
+static std::string plot_context(PlotData *data) {
+    std::string c;
+    if (data->fun == NULL) {
+        c = "-";
+    } else if (data->fun->type == TYPE_STRING) {
+        vartype_string *s = (vartype_string *) data->fun;
+        c = "P" + std::string(s->txt(), s->length);
+    } else {
+        equation_data *eqd = ((vartype_equation *) data->fun)->data;
+        c = (eqd->compatMode ? "C" : "E") + std::string(eqd->text, eqd->length);
+    }
+    for (int i = 0; i < 2; i++) {
+        c += '\0';
+        c += std::string(data->axes[i].name, data->axes[i].len);
+        c += '\0';
+        if (data->axes[i].unit->type == TYPE_UNIT) {
+            vartype_unit *u = (vartype_unit *) data->axes[i].unit;
+            c += std::string(u->text, u->length);
+        }
+    }
+    return c;
+}
+
+static void plot_cache_clear() {
+    plot_cache.clear();
+    plot_cache_context.clear();
+}
+
+static void plot_cache_check(PlotData *data) {
+    std::string c = plot_context(data);
+    if (c != plot_cache_context) {
+        plot_cache.clear();
+        plot_cache_context = c;
+    }
+}
+
+/* Finds the sample at x, allowing for rounding errors: pixel columns of
+ * different views that coincide won't have exactly the same x. Returns the
+ * index of the matching sample, or -1 and the insertion position.
+ */
+static int plot_cache_find(PlotData *data, phloat x, int *pos) {
+    phloat tol = (data->axes[0].max - data->axes[0].min) / (disp_w - 1) / 1024;
+    int lo = 0, hi = (int) plot_cache.size();
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (plot_cache[mid].x < x)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    *pos = lo;
+    if (lo < (int) plot_cache.size() && plot_cache[lo].x - x <= tol)
+        return lo;
+    if (lo > 0 && x - plot_cache[lo - 1].x <= tol)
+        return lo - 1;
+    return -1;
+}
+
+static void plot_cache_store(PlotData *data, phloat x, phloat y) {
+    int pos;
+    int i = plot_cache_find(data, x, &pos);
+    if (i != -1) {
+        plot_cache[i].y = y;
+        return;
+    }
+    if (plot_cache.size() >= PLOT_CACHE_MAX) {
+        // Keep only the samples that are near the current view
+        phloat w = data->axes[0].max - data->axes[0].min;
+        phloat lo = data->axes[0].min - w;
+        phloat hi = data->axes[0].max + w;
+        size_t n = 0;
+        for (size_t j = 0; j < plot_cache.size(); j++)
+            if (plot_cache[j].x >= lo && plot_cache[j].x <= hi)
+                plot_cache[n++] = plot_cache[j];
+        if (n >= PLOT_CACHE_MAX)
+            n = 0;
+        plot_cache.resize(n);
+        plot_cache_find(data, x, &pos);
+    }
+    plot_sample s;
+    s.x = x;
+    s.y = y;
+    plot_cache.insert(plot_cache.begin() + pos, s);
+}
+
+static bool plot_cache_lookup(PlotData *data, phloat x, phloat *y) {
+    int pos;
+    int i = plot_cache_find(data, x, &pos);
+    if (i == -1)
+        return false;
+    *y = plot_cache[i].y;
+    return true;
+}
+
+/* Looks for a sign change between adjacent cached samples in [x1, x2],
+ * the one closest to x1, for use as starting guesses for the solver.
+ */
+static bool plot_cache_bracket(PlotData *data, phloat x1, phloat x2, phloat *g1, phloat *g2) {
+    if (plot_context(data) != plot_cache_context)
+        return false;
+    bool found = false;
+    phloat best = 0;
+    const plot_sample *prev = NULL;
+    for (size_t i = 0; i < plot_cache.size(); i++) {
+        const plot_sample *s = &plot_cache[i];
+        if (s->x < x1 && s->x < x2 || s->x > x1 && s->x > x2 || p_isnan(s->y)) {
+            prev = NULL;
+            continue;
+        }
+        if (prev != NULL && (prev->y == 0 || s->y == 0 || (prev->y < 0) != (s->y < 0))) {
+            phloat d = fabs(prev->x - x1);
+            phloat d2 = fabs(s->x - x1);
+            if (d2 < d)
+                d = d2;
+            if (!found || d < best) {
+                found = true;
+                best = d;
+                *g1 = prev->x;
+                *g2 = s->x;
+            }
+        }
+        prev = s;
+    }
+    return found;
+}
+
+static int plot_cached_points(PlotData *data, int pixel) {
+    phloat y;
+    while (pixel <= disp_w && plot_cache_lookup(data, pixel_x(data, pixel), &y))
+        plot_point(data, pixel++, y);
+    data->set_int(PLOT_X_PIXEL, data->x_pixel = pixel);
+    return pixel;
 }
 
 static int prepare_plot(PlotData *data) {
@@ -770,6 +1011,9 @@ static int prepare_plot(PlotData *data) {
     return ERR_NONE;
 }
 
+static bool plot_batch_start(PlotData *data);
+static int plot_batch_worker(bool interrupted);
+
 int docmd_scan(arg_struct *arg) {
     PlotData data;
     if (data.err != ERR_NONE)
@@ -782,11 +1026,18 @@ int docmd_scan(arg_struct *arg) {
     data.set_phloat(PLOT_MARK2_Y, data.mark[3] = data.axes[1].max);
     data.set_phloat(PLOT_Y_MIN, data.axes[1].min = NAN_PHLOAT);
     data.set_phloat(PLOT_Y_MAX, data.axes[1].max = NAN_PHLOAT);
+    plot_cache_clear();
 
     int err = prepare_plot(&data);
     if (err != ERR_NONE)
         return err;
-    return do_it(&data);
+    PlotData *live = plot_go_live(&data);
+    if (plot_batch_start(live)) {
+        mode_interruptible = plot_batch_worker;
+        mode_stoppable = true;
+        return ERR_INTERRUPTIBLE;
+    }
+    return do_it(live);
 }
 
 void display_view_param(int key) {
@@ -951,29 +1202,110 @@ static int phloat2string_four_digits(phloat p, char *buf, int buflen) {
     return phloat2string(p, buf, buflen, 0, digits, dispmode, 0, 4);
 }
 
+/* Draw the plot line from the previous pixel column to this one, plus the
+ * marks and the INTEG shading that belong to this column. A NaN y means the
+ * function could not be evaluated here, and just breaks the line.
+ */
+static void plot_point(PlotData *data, int pixel, phloat y) {
+    if (p_isnan(y)) {
+        data->set_phloat(PLOT_LAST_Y, data->last_y = NAN_PHLOAT);
+        return;
+    }
+    phloat ymin = data->axes[1].min;
+    phloat ymax = data->axes[1].max;
+    int v = to_int(floor((ymax - y) / (ymax - ymin) * (disp_h - 1) + 0.5));
+    phloat lasty = data->last_y;
+    data->set_phloat(PLOT_LAST_Y, data->last_y = y);
+    if (p_isnan(lasty)) {
+        if (v >= 0 && v < disp_h && pixel >= 0) {
+            draw_pixel(to_int(pixel), v);
+            flush_display();
+        }
+    } else {
+        int lv = to_int(floor((ymax - lasty) / (ymax - ymin) * (disp_h - 1) + 0.5));
+        /* Don't draw lines if both endpoints are off-screen */
+        if (lv >= 0 && lv < disp_h || v >= 0 && v < disp_h) {
+            int x = to_int(pixel);
+            draw_line(x - 1, lv, x, v);
+            flush_display();
+        }
+    }
+    int mark = 0;
+    phloat x, xm1, xm2;
+    if (!p_isnan(data->mark[0]) && data->conv_x(data->mark[0]) == pixel) {
+        mark = 1;
+        goto draw_dotted_line;
+    } else if (!p_isnan(data->mark[2]) && data->conv_x(data->mark[2]) == pixel) {
+        mark = 2;
+        goto draw_dotted_line;
+    }
+    if (data->result_type == PLOT_RESULT_INTEG) {
+        x = data->axes[0].min + ((phloat) pixel) / (disp_w - 1) * (data->axes[0].max - data->axes[0].min);
+        xm1 = data->mark[0];
+        xm2 = data->mark[2];
+        if (xm1 > xm2) {
+            phloat t = xm1;
+            xm1 = xm2;
+            xm2 = t;
+        }
+        if (x >= xm1 && x <= xm2) {
+            draw_dotted_line:
+            int vz = data->conv_y(0);
+            if (v > vz) {
+                int t = vz;
+                vz = v;
+                v = t;
+            }
+            if (v < 0)
+                v = 0;
+            if (vz >= disp_h)
+                vz = disp_h - 1;
+            if (mark != 0) {
+                int vm = data->conv_y(data->mark[(mark - 1) * 2 + 1]);
+                for (int Y = vm - 1; Y <= vm + 1; Y++)
+                    for (int X = pixel - 1; X <= pixel + 1; X++)
+                        draw_pixel(X, Y);
+            }
+            bool solid = mark != 0 && data->result_type == PLOT_RESULT_INTEG;
+            for (int j = v; j <= vz; j++)
+                if (solid || ((pixel + j) & 1) != 0)
+                    draw_pixel(pixel, j);
+        }
+    }
+}
+
+static int plot_continue(PlotData *data, bool stop, vartype *result, bool replot);
+static int plot_result(PlotData *data, bool failure, bool stop);
+
 int return_to_plot(bool failure, bool stop) {
+    if (live_plot != NULL)
+        return plot_result(live_plot, failure, stop);
     PlotData data;
     if (data.err != ERR_NONE)
         return data.err;
+    return plot_result(plot_go_live(&data), failure, stop);
+}
+
+static int plot_result(PlotData *data, bool failure, bool stop) {
 
-    int pixel = data.x_pixel;
-    int state = data.state;
+    int pixel = data->x_pixel;
+    int state = data->state;
     vartype *result = NULL;
     bool replot = false;
     // In case we were interrupted...
     mode_message_lines = ALL_LINES;
 
     vartype *res = stack[sp];
-    phloat ymin = data.axes[1].min;
-    phloat ymax = data.axes[1].max;
+    phloat ymin = data->axes[1].min;
+    phloat ymax = data->axes[1].max;
 
     if (!failure && sp != -1 && (res->type == TYPE_REAL || res->type == TYPE_UNIT)) {
-        if ((state == PLOT_STATE_SOLVE || state != PLOT_STATE_INTEG && data.axes[1].len > 0) && stack[sp - 1]->type != TYPE_STRING && ((vartype_real *) stack[sp - 3])->x != 0) {
+        if ((state == PLOT_STATE_SOLVE || state != PLOT_STATE_INTEG && data->axes[1].len > 0) && stack[sp - 1]->type != TYPE_STRING && ((vartype_real *) stack[sp - 3])->x != 0) {
             // Not an error, but the solver didn't find a root
             if (state == PLOT_STATE_SOLVE) {
                 replot = true;
-                data.set_phloat(PLOT_RESULT, data.result = ((vartype_real *) stack[sp - 3])->x);
-                data.set_int(PLOT_RESULT_TYPE, data.result_type = PLOT_RESULT_SOLVE_FAIL);
+                data->set_phloat(PLOT_RESULT, data->result = ((vartype_real *) stack[sp - 3])->x);
+                data->set_int(PLOT_RESULT_TYPE, data->result_type = PLOT_RESULT_SOLVE_FAIL);
             }
             goto fail;
         }
@@ -981,7 +1313,7 @@ int return_to_plot(bool failure, bool stop) {
         if (state == PLOT_STATE_INTEG) {
             // Special case: this returns a result whose unit is the product
             // of the X and Y axis units
-            vartype *u = integ_result_unit(&data);
+            vartype *u = integ_result_unit(data);
             if (u == NULL)
                 return ERR_INVALID_UNIT;
             int err = convert_helper(u, res, &y);
@@ -990,151 +1322,107 @@ int return_to_plot(bool failure, bool stop) {
                 return err;
         } else if (state == PLOT_STATE_SOLVE) {
             // And, of course, in the case of SOLVE, the result will have X axis units
-            int err = convert_helper(data.axes[0].unit, res, &y);
+            int err = convert_helper(data->axes[0].unit, res, &y);
             if (err != ERR_NONE)
                 return err;
         } else if (state == PLOT_STATE_SCANNING) {
-            if (data.axes[1].len != 0 && stack[sp - 1]->type != TYPE_STRING) {
+            if (data->axes[1].len != 0 && stack[sp - 1]->type != TYPE_STRING) {
                 // Result from the numerical solver; this means the unit must
                 // already be determined, and we just use the converted result
-                if (data.axes[1].unit->type == TYPE_REAL) {
+                if (data->axes[1].unit->type == TYPE_REAL) {
                     y = ((vartype_real *) res)->x;
                 } else {
-                    int err = convert_helper(data.axes[1].unit, res, &y);
+                    int err = convert_helper(data->axes[1].unit, res, &y);
                     if (err != ERR_NONE)
                         return err;
                 }
                 if (p_isnan(ymin) || y < ymin)
-                    data.set_phloat(PLOT_Y_MIN, data.axes[1].min = y);
+                    data->set_phloat(PLOT_Y_MIN, data->axes[1].min = y);
                 if (p_isnan(ymax) || y > ymax)
-                    data.set_phloat(PLOT_Y_MAX, data.axes[1].max = y);
+                    data->set_phloat(PLOT_Y_MAX, data->axes[1].max = y);
             } else {
                 // If the solver isn't used, or if we're getting a result from
                 // the direct solver (which you can tell by there being a string
                 // in the Y register), then we can just take the unit of the
                 // result.
-                int err = convert_helper(data.axes[1].unit, res, &y);
+                int err = convert_helper(data->axes[1].unit, res, &y);
                 if (err == ERR_NONE) {
                     if (p_isnan(ymin) || y < ymin)
-                        data.set_phloat(PLOT_Y_MIN, data.axes[1].min = y);
+                        data->set_phloat(PLOT_Y_MIN, data->axes[1].min = y);
                     if (p_isnan(ymax) || y > ymax)
-                        data.set_phloat(PLOT_Y_MAX, data.axes[1].max = y);
+                        data->set_phloat(PLOT_Y_MAX, data->axes[1].max = y);
                 } else {
                     vartype *u = dup_vartype(res);
                     y = ((vartype_real *) u)->x;
                     ((vartype_real *) u)->x = 0;
-                    data.set_unit(PLOT_Y_UNIT, data.axes[1].unit = u);
-                    data.set_phloat(PLOT_Y_MIN, data.axes[1].min = y);
-                    data.set_phloat(PLOT_Y_MAX, data.axes[1].max = y);
+                    data->set_unit(PLOT_Y_UNIT, data->axes[1].unit = u);
+                    data->set_phloat(PLOT_Y_MIN, data->axes[1].min = y);
+                    data->set_phloat(PLOT_Y_MAX, data->axes[1].max = y);
                 }
             }
-        } else if (data.axes[1].unit->type == TYPE_REAL) {
+        } else if (data->axes[1].unit->type == TYPE_REAL) {
             if (res->type == TYPE_UNIT) {
                 vartype *u = dup_vartype(res);
                 if (u == NULL)
                     return ERR_INSUFFICIENT_MEMORY;
                 ((vartype_unit *) u)->x = 0;
-                data.set_unit(PLOT_Y_UNIT, data.axes[1].unit = u);
+                data->set_unit(PLOT_Y_UNIT, data->axes[1].unit = u);
+                plot_cache_check(data);
             }
             y = ((vartype_real *) res)->x;
         } else {
-            int err = convert_helper(data.axes[1].unit, res, &y);
+            int err = convert_helper(data->axes[1].unit, res, &y);
             if (err != ERR_NONE)
                 return err;
         }
 
         if (state == PLOT_STATE_PLOTTING) {
-            int v = to_int(floor((ymax - y) / (ymax - ymin) * (disp_h - 1) + 0.5));
-            phloat lasty = data.last_y;
-            data.set_phloat(PLOT_LAST_Y, data.last_y = y);
-            if (p_isnan(lasty)) {
-                if (v >= 0 && v < disp_h && pixel >= 0) {
-                    draw_pixel(to_int(pixel), v);
-                    flush_display();
-                }
-            } else {
-                int lv = to_int(floor((ymax - lasty) / (ymax - ymin) * (disp_h - 1) + 0.5));
-                /* Don't draw lines if both endpoints are off-screen */
-                if (lv >= 0 && lv < disp_h || v >= 0 && v < disp_h) {
-                    int x = to_int(pixel);
-                    draw_line(x - 1, lv, x, v);
-                    flush_display();
-                }
-            }
-            int mark = 0;
-            phloat x, xm1, xm2;
-            if (!p_isnan(data.mark[0]) && data.conv_x(data.mark[0]) == pixel) {
-                mark = 1;
-                goto draw_dotted_line;
-            } else if (!p_isnan(data.mark[2]) && data.conv_x(data.mark[2]) == pixel) {
-                mark = 2;
-                goto draw_dotted_line;
-            }
-            if (data.result_type == PLOT_RESULT_INTEG) {
-                x = data.axes[0].min + ((phloat) pixel) / (disp_w - 1) * (data.axes[0].max - data.axes[0].min);
-                xm1 = data.mark[0];
-                xm2 = data.mark[2];
-                if (xm1 > xm2) {
-                    phloat t = xm1;
-                    xm1 = xm2;
-                    xm2 = t;
-                }
-                if (x >= xm1 && x <= xm2) {
-                    draw_dotted_line:
-                    int vz = data.conv_y(0);
-                    if (v > vz) {
-                        int t = vz;
-                        vz = v;
-                        v = t;
-                    }
-                    if (v < 0)
-                        v = 0;
-                    if (vz >= disp_h)
-                        vz = disp_h - 1;
-                    if (mark != 0) {
-                        int vm = data.conv_y(data.mark[(mark - 1) * 2 + 1]);
-                        for (int Y = vm - 1; Y <= vm + 1; Y++)
-                            for (int X = pixel - 1; X <= pixel + 1; X++)
-                                draw_pixel(X, Y);
-                    }
-                    bool solid = mark != 0 && data.result_type == PLOT_RESULT_INTEG;
-                    for (int j = v; j <= vz; j++)
-                        if (solid || ((pixel + j) & 1) != 0)
-                            draw_pixel(pixel, j);
-                }
-            }
+            plot_cache_store(data, pixel_x(data, pixel), y);
+            plot_point(data, pixel, y);
         } else if (state == PLOT_STATE_EVAL_MARK1 || state == PLOT_STATE_EVAL_MARK2) {
             int k = 2 * (state - PLOT_STATE_EVAL_MARK1);
             replot = true;
-            data.set_phloat(PLOT_RESULT, data.result = y);
-            data.set_int(PLOT_RESULT_TYPE, data.result_type = PLOT_RESULT_EVAL);
-            result = new_complex(data.mark[k], y);
+            data->set_phloat(PLOT_RESULT, data->result = y);
+            data->set_int(PLOT_RESULT_TYPE, data->result_type = PLOT_RESULT_EVAL);
+            result = new_complex(data->mark[k], y);
         } else if (state == PLOT_STATE_SOLVE) {
             replot = true;
-            data.set_phloat(PLOT_RESULT, data.result = y);
-            data.set_int(PLOT_RESULT_TYPE, data.result_type = PLOT_RESULT_SOLVE);
+            data->set_phloat(PLOT_RESULT, data->result = y);
+            data->set_int(PLOT_RESULT_TYPE, data->result_type = PLOT_RESULT_SOLVE);
             result = new_real(y);
         } else if (state == PLOT_STATE_INTEG) {
             replot = true;
-            data.set_phloat(PLOT_RESULT, data.result = y);
-            data.set_int(PLOT_RESULT_TYPE, data.result_type = PLOT_RESULT_INTEG);
+            data->set_phloat(PLOT_RESULT, data->result = y);
+            data->set_int(PLOT_RESULT_TYPE, data->result_type = PLOT_RESULT_INTEG);
             result = new_real(y);
         }
     } else {
         fail:
         if (state == PLOT_STATE_PLOTTING) {
-            data.set_phloat(PLOT_LAST_Y, data.last_y = NAN_PHLOAT);
+            plot_cache_store(data, pixel_x(data, pixel), NAN_PHLOAT);
+            data->set_phloat(PLOT_LAST_Y, data->last_y = NAN_PHLOAT);
         }
     }
     clean_stack(mode_plot_sp);
     pixel += state == PLOT_STATE_SCANNING ? 10 : 1;
-    data.set_int(PLOT_X_PIXEL, data.x_pixel = pixel);
+    data->set_int(PLOT_X_PIXEL, data->x_pixel = pixel);
+    return plot_continue(data, stop, result, replot);
+}
+
+/* Move on to the next sample, or, if there are none left, finish up: print
+ * the result of EVAL, SOLVE, or INTEG, if any, and return to the caller.
+ * While plotting, pixel columns that are in the sample cache are drawn
+ * right away, without calling the function.
+ */
+static int plot_continue(PlotData *data, bool stop, vartype *result, bool replot) {
+    int state = data->state;
+    int pixel = data->x_pixel;
     int err;
     switch (state) {
         case PLOT_STATE_SCANNING:
             if (pixel >= disp_w) {
-                phloat ymin = data.axes[1].min;
-                phloat ymax = data.axes[1].max;
+                phloat ymin = data->axes[1].min;
+                phloat ymax = data->axes[1].max;
                 if (p_isnan(ymin)) {
                     ymin = -1;
                     ymax = 1;
@@ -1146,67 +1434,68 @@ int return_to_plot(bool failure, bool stop) {
                     ymax += h;
                     ymin -= h;
                 }
-                data.set_phloat(PLOT_Y_MIN, data.axes[1].min = ymin);
-                data.set_phloat(PLOT_Y_MAX, data.axes[1].max = ymax);
+                data->set_phloat(PLOT_Y_MIN, data->axes[1].min = ymin);
+                data->set_phloat(PLOT_Y_MAX, data->axes[1].max = ymax);
                 display_view();
                 break;
             } else {
-                err = do_it(&data);
+                err = do_it(data);
                 if (err == ERR_NONE && stop)
                     err = ERR_STOP;
                 return err;
             }
         case PLOT_STATE_PLOTTING:
+            pixel = plot_cached_points(data, pixel);
             if (pixel > disp_w) {
-                if (state == PLOT_STATE_PLOTTING && data.result_type != PLOT_RESULT_NONE) {
+                if (state == PLOT_STATE_PLOTTING && data->result_type != PLOT_RESULT_NONE) {
                     char buf[100];
                     int pos = 0;
                     vartype *result_unit = NULL;
-                    switch (data.result_type) {
+                    switch (data->result_type) {
                         case PLOT_RESULT_EVAL: {
-                            if (data.axes[1].len == 0)
+                            if (data->axes[1].len == 0)
                                 string2buf(buf, 100, &pos, "<Y>", 3);
                             else
-                                string2buf(buf, 100, &pos, data.axes[1].name, data.axes[1].len);
+                                string2buf(buf, 100, &pos, data->axes[1].name, data->axes[1].len);
                             char2buf(buf, 100, &pos, '=');
-                            result_unit = data.axes[1].unit;
+                            result_unit = data->axes[1].unit;
                             break;
                         }
                         case PLOT_RESULT_SOLVE: {
-                            if (data.axes[0].len == 0)
+                            if (data->axes[0].len == 0)
                                 string2buf(buf, 100, &pos, "<X>", 3);
                             else
-                                string2buf(buf, 100, &pos, data.axes[0].name, data.axes[0].len);
+                                string2buf(buf, 100, &pos, data->axes[0].name, data->axes[0].len);
                             char2buf(buf, 100, &pos, '=');
-                            int x = data.conv_x(data.result);
-                            int y = data.conv_y(0);
+                            int x = data->conv_x(data->result);
+                            int y = data->conv_y(0);
                             for (int i = 2; i <= 4; i++) {
                                 draw_pixel(x + i, y + i);
                                 draw_pixel(x + i, y - i);
                                 draw_pixel(x - i, y - i);
                                 draw_pixel(x - i, y + i);
                             }
-                            result_unit = data.axes[0].unit;
+                            result_unit = data->axes[0].unit;
                             break;
                         }
                         case PLOT_RESULT_SOLVE_FAIL: {
-                            int m = to_int(data.result);
+                            int m = to_int(data->result);
                             string2buf(buf, 100, &pos, solve_message[m].text, solve_message[m].length);
                             break;
                         }
                         case PLOT_RESULT_INTEG: {
                             string2buf(buf, 100, &pos, "\3=", 2);
-                            result_unit = integ_result_unit(&data);
+                            result_unit = integ_result_unit(data);
                             break;
                         }
                     }
-                    if (data.result_type != PLOT_RESULT_SOLVE_FAIL) {
-                        pos += phloat2string_four_digits(data.result, buf + pos, 100 - pos);
+                    if (data->result_type != PLOT_RESULT_SOLVE_FAIL) {
+                        pos += phloat2string_four_digits(data->result, buf + pos, 100 - pos);
                         if (result_unit != NULL && result_unit->type == TYPE_UNIT) {
                             vartype_unit *u = (vartype_unit *) result_unit;
                             char2buf(buf, 100, &pos, '_');
                             string2buf(buf, 100, &pos, u->text, u->length);
-                            if (data.result_type == PLOT_RESULT_INTEG)
+                            if (data->result_type == PLOT_RESULT_INTEG)
                                 free_vartype(result_unit);
                         }
                     }
@@ -1218,13 +1507,15 @@ int return_to_plot(bool failure, bool stop) {
                     draw_small_string(0, -2, buf, pos, disp_w);
                 }
             } else {
-                err = do_it(&data);
+                err = do_it(data);
                 if (err == ERR_NONE && stop)
                     err = ERR_STOP;
                 return err;
             }
     }
 
+    // Done; data may be the live plot state, which is released here
+    flush_plot_state();
     free_vartype(mode_plot_inv);
     mode_plot_inv = NULL;
     err = docmd_rtn(NULL);
@@ -1334,6 +1625,139 @@ static void axis_ticks(bool hor, int c, phloat min, phloat max, int *t1pos, int
     make_tick_label(a2, m, t2text, t2len);
 }
 
+/* Native plotting
+ *
+ * When the function is an equation for which generateNumericCode() works,
+ * the X axis is a named real variable, the Y axis is real, and every other
+ * variable in the equation is real, the columns that aren't in the sample
+ * cache are evaluated as one batch, without going through the interpreter,
+ * and on several threads where the build allows it. The results are drawn
+ * by an interruptible worker as they come in, so the display fills in
+ * progressively and EXIT or R/S stop the plot, like they do when plotting
+ * through the interpreter. SCAN uses the same batches for its samples,
+ * which only widen the Y range instead of being drawn.
+ */
+
+static NumericCode *plot_code = NULL;
+static numeric_batch *plot_batch = NULL;
+static std::vector<int> plot_batch_pixels;
+static int plot_batch_next;
+
+static void plot_batch_end(PlotData *data) {
+    if (data != NULL && plot_batch_next > 0) {
+        // Leave the X variable the way evaluating the equation would
+        int pixel = plot_batch_pixels[plot_batch_next - 1];
+        vartype *v = new_real(pixel_x(data, pixel));
+        if (v != NULL && store_var(data->axes[0].name, data->axes[0].len, v) != ERR_NONE)
+            free_vartype(v);
+    }
+    numeric_batch_finish(plot_batch);
+    plot_batch = NULL;
+    delete plot_code;
+    plot_code = NULL;
+    plot_batch_pixels.clear();
+}
+
+static bool plot_batch_start(PlotData *data) {
+    if (!data->live
+            || data->state != PLOT_STATE_PLOTTING && data->state != PLOT_STATE_SCANNING
+            || data->fun == NULL || data->fun->type != TYPE_EQUATION
+            || data->axes[0].len == 0 || data->axes[1].len != 0
+            || data->axes[0].unit->type != TYPE_REAL
+            || data->axes[1].unit->type != TYPE_REAL)
+        return false;
+
+    std::vector<phloat> xs;
+    if (data->state == PLOT_STATE_SCANNING) {
+        for (int pixel = data->x_pixel; pixel < disp_w; pixel += 10) {
+            plot_batch_pixels.push_back(pixel);
+            xs.push_back(pixel_x(data, pixel));
+        }
+    } else {
+        for (int pixel = -1; pixel <= disp_w; pixel++) {
+            phloat y;
+            phloat x = pixel_x(data, pixel);
+            if (!plot_cache_lookup(data, x, &y)) {
+                plot_batch_pixels.push_back(pixel);
+                xs.push_back(x);
+            }
+        }
+    }
+    if (xs.empty())
+        return false;
+
+    equation_data *eqd = ((vartype_equation *) data->fun)->data;
+    plot_code = new (std::nothrow) NumericCode;
+    if (plot_code == NULL || !eqd->ev->generateNumericCode(plot_code))
+        goto fail;
+    int slot;
+    slot = plot_code->slot(std::string(data->axes[0].name, data->axes[0].len));
+    if (slot == -1)
+        goto fail;
+    {
+        std::vector<phloat> vals(plot_code->vars.size());
+        for (int i = 0; i < (int) vals.size(); i++) {
+            if (i == slot)
+                continue;
+            const std::string &name = plot_code->vars[i];
+            vartype *v = recall_var(name.c_str(), (int) name.length());
+            if (v == NULL || v->type != TYPE_REAL)
+                goto fail;
+            vals[i] = ((vartype_real *) v)->x;
+        }
+        plot_batch = numeric_batch_start(plot_code, vals.data(), slot, xs.data(), (int) xs.size());
+    }
+    if (plot_batch == NULL)
+        goto fail;
+    plot_batch_next = 0;
+    return true;
+
+    fail:
+    plot_batch_end(NULL);
+    return false;
+}
+
+static int plot_batch_worker(bool interrupted) {
+    PlotData *data = live_plot;
+    if (interrupted || data == NULL) {
+        plot_batch_end(data);
+        flush_plot_state();
+        free_vartype(mode_plot_inv);
+        mode_plot_inv = NULL;
+        docmd_rtn(NULL);
+        return ERR_STOP;
+    }
+
+    int n = numeric_batch_poll(plot_batch);
+    while (plot_batch_next < n) {
+        int pixel = plot_batch_pixels[plot_batch_next];
+        phloat y;
+        bool ok = numeric_batch_result(plot_batch, plot_batch_next, &y);
+        if (data->state == PLOT_STATE_SCANNING) {
+            if (ok) {
+                if (p_isnan(data->axes[1].min) || y < data->axes[1].min)
+                    data->set_phloat(PLOT_Y_MIN, data->axes[1].min = y);
+                if (p_isnan(data->axes[1].max) || y > data->axes[1].max)
+                    data->set_phloat(PLOT_Y_MAX, data->axes[1].max = y);
+            }
+            data->set_int(PLOT_X_PIXEL, data->x_pixel = pixel + 10);
+        } else {
+            plot_cached_points(data, data->x_pixel);
+            if (!ok)
+                y = NAN_PHLOAT;
+            plot_cache_store(data, pixel_x(data, pixel), y);
+            plot_point(data, pixel, y);
+            data->set_int(PLOT_X_PIXEL, data->x_pixel = pixel + 1);
+        }
+        plot_batch_next++;
+    }
+    if (plot_batch_next < (int) plot_batch_pixels.size())
+        return ERR_INTERRUPTIBLE;
+
+    plot_batch_end(data);
+    return plot_continue(data, false, NULL, false);
+}
+
 static int plot_helper(bool reset) {
     PlotData data;
     if (data.err != ERR_NONE)
@@ -1363,6 +1787,7 @@ static int plot_helper(bool reset) {
     int err = prepare_plot(&data);
     if (err != ERR_NONE)
         return err;
+    plot_cache_check(&data);
 
     clear_display();
     mode_message_lines = ALL_LINES;
@@ -1451,17 +1876,33 @@ static int plot_helper(bool reset) {
     free(yt1s);
     free(yt2s);
 
-    return do_it(&data);
+    PlotData *live = plot_go_live(&data);
+    if (plot_batch_start(live)) {
+        mode_interruptible = plot_batch_worker;
+        mode_stoppable = true;
+        return ERR_INTERRUPTIBLE;
+    }
+    return plot_continue(live, false, NULL, false);
 }
 
 int docmd_plot(arg_struct *arg) {
     move_crosshairs(disp_w / 2, disp_h / 2, false);
+    plot_cache_clear();
     return plot_helper(true);
 }
 
 static bool run_plot(bool reset) {
     mode_plot_viewer = false;
     int err = plot_helper(reset);
+    if (err == ERR_STOP) {
+        // All samples were in the cache, and the plot is already done
+        set_running(false);
+        flush_display();
+        return false;
+    }
+    if (err == ERR_INTERRUPTIBLE)
+        // Drawn natively by plot_batch_worker()
+        return true;
     if (err != ERR_NONE && err != ERR_RUN) {
         display_error(err, false);
         flush_display();
@@ -1566,7 +2007,9 @@ static int plot_move(int key, bool repeating) {
                     return 0;
                 }
                 if (x < 0 || x >= disp_w) {
-                    phloat pw = (data.axes[0].max - data.axes[0].min) / 4;
+                    // Shift by a whole number of pixels, the same as the
+                    // crosshairs, so the sample cache can be reused
+                    phloat pw = (data.axes[0].max - data.axes[0].min) * (disp_w / 4) / (disp_w - 1);
                     if (x < 0) {
                         x += disp_w / 4;
                         pw = -pw;
@@ -1632,6 +2075,12 @@ static bool plot_solve() {
     }
     x1.x = data.mark[0];
     x2.x = data.mark[2];
+    // If the plot shows a sign change between the marks, start there
+    phloat g1, g2;
+    if (plot_cache_bracket(&data, x1.x, x2.x, &g1, &g2)) {
+        x1.x = g1;
+        x2.x = g2;
+    }
 
     clear_all_rtns();
     return_here_after_last_rtn();
@@ -1745,9 +2194,18 @@ static bool plot_zoom(bool in) {
         squeak();
         return false;
     }
-    phloat dw = (data.axes[0].max - data.axes[0].min) / (in ? 4 : -2);
-    data.set_phloat(PLOT_X_MIN, data.axes[0].min += dw);
-    data.set_phloat(PLOT_X_MAX, data.axes[0].max -= dw);
+    // Keep every other pixel column (zoom in) or every pixel column (zoom
+    // out) aligned with a column of the current view, so the sample cache
+    // can be reused
+    int n = disp_w - 1;
+    phloat w = data.axes[0].max - data.axes[0].min;
+    if (in) {
+        data.set_phloat(PLOT_X_MIN, data.axes[0].min += w * (n / 4) / n);
+        data.set_phloat(PLOT_X_MAX, data.axes[0].max = data.axes[0].min + w / 2);
+    } else {
+        data.set_phloat(PLOT_X_MIN, data.axes[0].min -= w * (n / 2) / n);
+        data.set_phloat(PLOT_X_MAX, data.axes[0].max = data.axes[0].min + w * 2);
+    }
     phloat dh = (data.axes[1].max - data.axes[1].min) / (in ? 4 : -2);
     data.set_phloat(PLOT_Y_MIN, data.axes[1].min += dh);
     data.set_phloat(PLOT_Y_MAX, data.axes[1].max -= dh);
@@ -1826,7 +2284,7 @@ bool plot_keydown(int key, int *repeat) {
             int err = prepare_plot(&data);
             if (err != ERR_NONE)
                 goto mark_fail;
-            if (call_plot_function(&data, xx) != ERR_RUN)
+            if (call_plot_function(plot_go_live(&data), xx) != ERR_RUN)
                 goto mark_fail;
             mode_plot_viewer = false;
             return true;
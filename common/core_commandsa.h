@@ -38,6 +38,7 @@ int start_graph_varmenu(int role, int exit_cb);
 void display_view_param(int key);
 void display_plot_params(int key);
 int return_to_plot(bool failure, bool stop);
+void flush_plot_state();
 bool plot_keydown(int key, int *repeat);
 int plot_repeat();
 int docmd_plot(arg_struct *arg);
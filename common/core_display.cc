@@ -608,6 +608,27 @@ int requested_disp_r, requested_disp_c;
 static bool is_dirty = false;
 static int dirty_top, dirty_left, dirty_bottom, dirty_right;
 
+/* The display as the shell last received it, so flush_display() can skip
+ * rows and columns that were redrawn without changing.
+ */
+static char *blitted = NULL;
+static bool blitted_valid = false;
+
+/* Formatted value of the stack level last shown on each row, so levels whose
+ * value and display settings haven't changed don't need to be formatted again.
+ */
+struct level_text {
+    int type;
+    phloat re, im;
+    flags_struct fl;
+    int wsize;
+    int buflen;
+    int result;
+    std::string text;
+    level_text() : type(TYPE_NULL) {}
+};
+static std::vector<level_text> level_texts;
+
 static std::vector<std::string> messages;
 
 static int catalogmenu_section[6];
@@ -645,6 +666,63 @@ static bool crosshair_visible;
 static void mark_dirty(int top, int left, int bottom, int right);
 static int get_cat_index();
 
+/* The big font, transposed to one byte per pixel row, with the leftmost
+ * pixel in bit 0, matching the layout of the display bitmap.
+ */
+static unsigned char bigchar_rows[133][8];
+static bool bigchar_rows_ready = false;
+
+static void init_bigchar_rows() {
+    for (int c = 0; c < 133; c++)
+        for (int v = 0; v < 8; v++) {
+            unsigned char r = 0;
+            for (int h = 0; h < 5; h++)
+                if (bigchars[c][h] & (1 << v))
+                    r |= 1 << h;
+            bigchar_rows[c][v] = r;
+        }
+    bigchar_rows_ready = true;
+}
+
+/* Replace 'width' pixels (at most 25) in a display row, starting at x, with
+ * the low bits of 'bits'.
+ */
+static void put_row_bits(char *row, int x, int width, uint4 bits) {
+    int shift = x & 7;
+    uint4 mask = ((1U << width) - 1) << shift;
+    bits = (bits << shift) & mask;
+    unsigned char *p = (unsigned char *) row + (x >> 3);
+    int n = (shift + width + 7) >> 3;
+    for (int i = 0; i < n; i++) {
+        p[i] = (unsigned char) ((p[i] & ~mask) | bits);
+        mask >>= 8;
+        bits >>= 8;
+    }
+}
+
+/* Set or clear 'width' pixels in a display row, starting at x */
+static void fill_row_bits(char *row, int x, int width, int color) {
+    int end = x + width - 1;
+    unsigned char *first = (unsigned char *) row + (x >> 3);
+    unsigned char *last = (unsigned char *) row + (end >> 3);
+    unsigned char lmask = (unsigned char) (0xff << (x & 7));
+    unsigned char rmask = (unsigned char) (0xff >> (7 - (end & 7)));
+    if (first == last)
+        lmask &= rmask;
+    if (color)
+        *first |= lmask;
+    else
+        *first &= ~lmask;
+    if (first == last)
+        return;
+    if (last - first > 1)
+        memset(first + 1, color ? 0xff : 0, last - first - 1);
+    if (color)
+        *last |= rmask;
+    else
+        *last &= ~rmask;
+}
+
 bool display_alloc(int rows, int cols) {
     if (display != NULL && disp_r == rows && disp_c == cols)
         return false;
@@ -659,6 +737,12 @@ bool display_alloc(int rows, int cols) {
     disp_bpl = (disp_w + 7) / 8;
     free(display);
     display = (char *) malloc(disp_h * disp_bpl);
+    free(blitted);
+    blitted = (char *) malloc(disp_h * disp_bpl);
+    blitted_valid = false;
+    level_texts.assign(rows, level_text());
+    if (!bigchar_rows_ready)
+        init_bigchar_rows();
     if (mode_message_lines == ALL_LINES)
         mode_message_lines = 0;
     return true;
@@ -842,16 +926,87 @@ void clear_display() {
     crosshair_visible = false;
 }
 
+/* Copy the pixels in the given rectangle from the display to 'blitted' */
+static void update_blitted(int x, int y, int width, int height) {
+    int first = x >> 3;
+    int last = (x + width - 1) >> 3;
+    unsigned char lmask = (unsigned char) (0xff << (x & 7));
+    unsigned char rmask = (unsigned char) (0xff >> (7 - ((x + width - 1) & 7)));
+    if (first == last)
+        lmask &= rmask;
+    for (int v = y; v < y + height; v++) {
+        const unsigned char *src = (const unsigned char *) display + v * disp_bpl;
+        unsigned char *dst = (unsigned char *) blitted + v * disp_bpl;
+        dst[first] = (dst[first] & ~lmask) | (src[first] & lmask);
+        if (first == last)
+            continue;
+        if (last - first > 1)
+            memcpy(dst + first + 1, src + first + 1, last - first - 1);
+        dst[last] = (dst[last] & ~rmask) | (src[last] & rmask);
+    }
+}
+
 void flush_display() {
     if (!is_dirty)
         return;
-    shell_blitter(display, disp_bpl, dirty_left, dirty_top,
-                    dirty_right - dirty_left, dirty_bottom - dirty_top);
     is_dirty = false;
+    if (!blitted_valid) {
+        repaint_display();
+        return;
+    }
+
+    // Shrink the dirty rectangle to the rows and bytes that differ from
+    // what the shell already has.
+    int l = dirty_left >> 3;
+    int r = (dirty_right + 7) >> 3;
+    if (r > disp_bpl)
+        r = disp_bpl;
+    int top = -1, bottom = -1;
+    int minbyte = r, maxbyte = l - 1;
+    for (int v = dirty_top; v < dirty_bottom; v++) {
+        const char *d = display + v * disp_bpl;
+        const char *b = blitted + v * disp_bpl;
+        int i = l;
+        while (i < r && d[i] == b[i])
+            i++;
+        if (i == r)
+            continue;
+        int j = r - 1;
+        while (d[j] == b[j])
+            j--;
+        if (top == -1)
+            top = v;
+        bottom = v + 1;
+        if (i < minbyte)
+            minbyte = i;
+        if (j > maxbyte)
+            maxbyte = j;
+    }
+    if (top == -1)
+        return;
+    int left = minbyte * 8;
+    if (left < dirty_left)
+        left = dirty_left;
+    int right = (maxbyte + 1) * 8;
+    if (right > dirty_right)
+        right = dirty_right;
+    if (right <= left)
+        return;
+    shell_blitter(display, disp_bpl, left, top, right - left, bottom - top);
+    update_blitted(left, top, right - left, bottom - top);
 }
 
 void repaint_display() {
     shell_blitter(display, disp_bpl, 0, 0, disp_w, disp_h);
+    memcpy(blitted, display, disp_h * disp_bpl);
+    blitted_valid = true;
+}
+
+/* The shell's copy of the display can't be trusted (for example, after a
+ * skin change), so the next flush_display() sends all of it.
+ */
+void forget_shell_display() {
+    blitted_valid = false;
 }
 
 void draw_pixel(int x, int y) {
@@ -1159,7 +1314,7 @@ static void mark_dirty(int top, int left, int bottom, int right) {
 }
 
 void draw_char(int x, int y, char c) {
-    int X, Y, h, v;
+    int X, Y, v;
     unsigned char uc = (unsigned char) c;
     if (x < 0 || x >= disp_c || y < 0 || y >= disp_r)
         return;
@@ -1169,36 +1324,25 @@ void draw_char(int x, int y, char c) {
         uc -= 128;
     X = x * 6;
     Y = y * 8;
+    const unsigned char *rows = bigchar_rows[uc];
+    char *row = display + Y * disp_bpl;
     for (v = 0; v < 8; v++) {
-        int YY = Y + v;
-        for (h = 0; h < 5; h++) {
-            int XX = X + h;
-            char mask = 1 << (XX & 7);
-            if (bigchars[uc][h] & (1 << v))
-                display[YY * disp_bpl + (XX >> 3)] |= mask;
-            else
-                display[YY * disp_bpl + (XX >> 3)] &= ~mask;
-        }
+        put_row_bits(row, X, 5, rows[v]);
+        row += disp_bpl;
     }
     mark_dirty(Y, X, Y + 8, X + 5);
 }
 
 void draw_block(int x, int y) {
-    int X, Y, h, v;
+    int X, Y, v;
     if (x < 0 || x >= disp_c || y < 0 || y >= disp_r)
         return;
     X = x * 6;
     Y = y * 8;
+    char *row = display + Y * disp_bpl;
     for (v = 0; v < 8; v++) {
-        int YY = Y + v;
-        for (h = 0; h < 5; h++) {
-            int XX = X + h;
-            char mask = 1 << (XX & 7);
-            if (v < 7)
-                display[YY * disp_bpl + (XX >> 3)] |= mask;
-            else
-                display[YY * disp_bpl + (XX >> 3)] &= ~mask;
-        }
+        put_row_bits(row, X, 5, v < 7 ? 0x1f : 0);
+        row += disp_bpl;
     }
     mark_dirty(Y, X, Y + 8, X + 5);
 }
@@ -1334,13 +1478,9 @@ void fill_rect(int x, int y, int width, int height, int color) {
         width = disp_w - x;
     if (y + height > disp_h)
         height = disp_h - y;
-    int h, v;
-    for (v = y; v < y + height; v++)
-        for (h = x; h < x + width; h++)
-            if (color)
-                display[v * disp_bpl + (h >> 3)] |= 1 << (h & 7);
-            else
-                display[v * disp_bpl + (h >> 3)] &= ~(1 << (h & 7));
+    if (width > 0)
+        for (int v = y; v < y + height; v++)
+            fill_row_bits(display + v * disp_bpl, x, width, color);
     mark_dirty(y, x, y + height, x + width);
 }
 
@@ -1919,6 +2059,38 @@ static int display_prgm_line(int offset, int headers = 0, int footers = 0) {
     }
 }
 
+static int level2string(int row, const vartype *v, char *buf, int buflen) {
+    if ((v->type != TYPE_REAL && v->type != TYPE_COMPLEX) || row >= (int) level_texts.size())
+        return vartype2string(v, buf, buflen);
+    phloat re, im = 0;
+    if (v->type == TYPE_REAL) {
+        re = ((vartype_real *) v)->x;
+    } else {
+        re = ((vartype_complex *) v)->re;
+        im = ((vartype_complex *) v)->im;
+    }
+    level_text *lt = &level_texts[row];
+    if (lt->type == v->type
+            && lt->buflen == buflen
+            && lt->wsize == mode_wsize
+            && memcmp(&lt->re, &re, sizeof(phloat)) == 0
+            && memcmp(&lt->im, &im, sizeof(phloat)) == 0
+            && memcmp(&lt->fl, &flags, sizeof(flags_struct)) == 0) {
+        memcpy(buf, lt->text.data(), lt->text.length());
+        return lt->result;
+    }
+    int n = vartype2string(v, buf, buflen);
+    lt->type = v->type;
+    lt->re = re;
+    lt->im = im;
+    lt->fl = flags;
+    lt->wsize = mode_wsize;
+    lt->buflen = buflen;
+    lt->result = n;
+    lt->text.assign(buf, n < buflen ? n : buflen);
+    return n;
+}
+
 static void display_level(int level, int row) {
     clear_row(row);
     if (!flags.f.big_stack && level > 3)
@@ -1947,7 +2119,7 @@ static void display_level(int level, int row) {
         char2buf(buf, len, &bufptr, '\200');
     }
     if (level <= sp)
-        bufptr += vartype2string(stack[sp - level], buf + bufptr, len - bufptr);
+        bufptr += level2string(row, stack[sp - level], buf + bufptr, len - bufptr);
     if (bufptr > disp_c) {
         buf[disp_c - 1] = 26;
         bufptr = disp_c;
@@ -2518,9 +2690,9 @@ static int ext_stk_cat[] = {
 };
 
 static int ext_eqn_cat[] = {
-    CMD_COMP,   CMD_DIRECT,  CMD_EQN_T, CMD_EQNINT, CMD_EQNMENU, CMD_EQNMNU1,
-    CMD_EQNSLV, CMD_EQNVAR,  CMD_EVAL,  CMD_EVALN,  CMD_NUMERIC, CMD_PARSE,
-    CMD_STD,    CMD_UNPARSE, CMD_NULL,  CMD_NULL,   CMD_NULL,    CMD_NULL
+    CMD_COMP,   CMD_DIRECT, CMD_EQN_T,   CMD_EQNINT, CMD_EQNMENU, CMD_EQNMNU1,
+    CMD_EQNSLV, CMD_EQNVAR, CMD_EVAL,    CMD_EVALN,  CMD_NUMERIC, CMD_PARSE,
+    CMD_ROOTS,  CMD_STD,    CMD_UNPARSE, CMD_VINTEG, CMD_VSOLVE,  CMD_NULL
 };
 
 static int ext_unit_cat[] = {
@@ -32,6 +32,7 @@ bool unpersist_display(int ver);
 void clear_display();
 void flush_display();
 void repaint_display();
+void forget_shell_display();
 void draw_pixel(int x, int y);
 void draw_line(int x1, int y1, int x2, int y2);
 void draw_pattern(phloat dx, phloat dy, const char *pattern, int pattern_width);
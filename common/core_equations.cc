@@ -987,7 +987,7 @@ void eqn_paste(const char *buf) {
                 if (eqns == NULL) {
                     nomem:
                     show_error(ERR_INSUFFICIENT_MEMORY);
-                    free(v);
+                    free_vartype(v);
                     free(hpbuf);
                     return;
                 }
@@ -612,7 +612,7 @@ const menu_spec menus[] = {
                       { { 0,                 4, "LLIM" },
                         { 0,                 4, "ULIM" },
                         { 0,                 3, "ACC"  },
-                        { 0x1000 + CMD_NULL, 0, ""     },
+                        { 0,                 4, "METH" },
                         { 0x1000 + CMD_NULL, 0, ""     },
                         { 0,                 1, "\003" } } },
     { /* MENU_DIR_FCN1 */ MENU_NONE, MENU_DIR_FCN2, MENU_DIR_FCN2,
@@ -760,6 +760,7 @@ directory::directory(int id) {
     children_count = 0;
     children = NULL;
     parent = NULL;
+    dirty = DIR_DIRTY_NEW;
 }
 
 directory::~directory() {
@@ -1053,8 +1054,32 @@ bool no_keystrokes_yet;
  * Version 22: 1.0    UNITS skip-top in equation editor
  * Version 23: 1.0    Interactive XSTR max length raised to 50
  * Version 24: 1.0.3  SOLVE secant impatience
+ * Version 25: 1.0.3  Section table; aligned numeric matrix data
+ * Version 26: 1.0.3  INTEG methods
+ * Version 27: 1.0.3  VSOLVE and VINTEG
+ * Version 28: 1.0.3  ROOTS
+ */
+#define PLUS42_VERSION 28
+
+/* Starting with version 25, the state file header is followed by a section
+ * table, giving the ID, file offset, and length of each section. Sections are
+ * still written and read in order, because the shared data indexes used by
+ * persist_vartype() span sections, but a reader can find any section without
+ * parsing what precedes it, and skip sections it does not know about.
+ */
+#define STATE_SECTION_MODES     1
+#define STATE_SECTION_DISPLAY   2
+#define STATE_SECTION_GLOBALS   3
+#define STATE_SECTION_EQUATIONS 4
+#define STATE_SECTION_MATH      5
+#define STATE_SECTION_JOURNAL   6
+#define STATE_SECTION_COUNT     6
+
+/* Generation of the state file most recently loaded or saved as the base of
+ * the checkpoint journal; 0 means there is no such file, and no journal
+ * may be written until the state has been saved in full.
  */
-#define PLUS42_VERSION 24
+int8 state_generation = 0;
 
 
 /*******************/
@@ -1128,10 +1153,20 @@ struct matrix_persister {
 static int shared_data_count;
 static int shared_data_capacity;
 static void **shared_data;
+// While saving, shared payloads are looked up through this open-addressing
+// hash table, keyed by pointer. The slots hold shared_data indexes plus one,
+// so zero means empty. While loading, it is not used; the data indexes in the
+// state file refer to shared_data directly.
+static int *shared_data_hash;
+static int shared_data_hash_size;
 
 
+static void shared_data_reset();
 static bool shared_data_grow();
+static bool shared_data_add(void *data);
 static int shared_data_search(void *data);
+static bool read_phloat_block(phloat *data, int4 n);
+static bool write_phloat_block(const phloat *data, int4 n);
 static void update_label_table(pgm_index prgm, int4 pc, int inserted);
 static void invalidate_lclbls(pgm_index idx, bool force);
 static int pc_line_convert(int4 loc, int loc_is_pc);
@@ -1156,23 +1191,65 @@ void vartype_string::trim1() {
     }
 }
 
+static void shared_data_reset() {
+    free(shared_data);
+    free(shared_data_hash);
+    shared_data = NULL;
+    shared_data_count = 0;
+    shared_data_capacity = 0;
+    shared_data_hash = NULL;
+    shared_data_hash_size = 0;
+}
+
 static bool shared_data_grow() {
     if (shared_data_count < shared_data_capacity)
         return true;
-    shared_data_capacity += 10;
-    void **p = (void **) realloc(shared_data,
-                                 shared_data_capacity * sizeof(void *));
+    int newcapacity = shared_data_capacity == 0 ? 16 : shared_data_capacity * 2;
+    void **p = (void **) realloc(shared_data, newcapacity * sizeof(void *));
     if (p == NULL)
         return false;
     shared_data = p;
+    shared_data_capacity = newcapacity;
+    return true;
+}
+
+static int shared_data_hash_slot(void *data) {
+    uint8 h = (uint8) (uintptr_t) data;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    int mask = shared_data_hash_size - 1;
+    int i = (int) (h & mask);
+    while (shared_data_hash[i] != 0 && shared_data[shared_data_hash[i] - 1] != data)
+        i = (i + 1) & mask;
+    return i;
+}
+
+static bool shared_data_add(void *data) {
+    if (!shared_data_grow())
+        return false;
+    if (2 * (shared_data_count + 1) > shared_data_hash_size) {
+        // Keep the load factor at or below 50%
+        int newsize = shared_data_hash_size == 0 ? 64 : 2 * shared_data_hash_size;
+        int *h = (int *) malloc(newsize * sizeof(int));
+        if (h == NULL)
+            return false;
+        memset(h, 0, newsize * sizeof(int));
+        free(shared_data_hash);
+        shared_data_hash = h;
+        shared_data_hash_size = newsize;
+        for (int i = 0; i < shared_data_count; i++)
+            shared_data_hash[shared_data_hash_slot(shared_data[i])] = i + 1;
+    }
+    shared_data[shared_data_count++] = data;
+    shared_data_hash[shared_data_hash_slot(data)] = shared_data_count;
     return true;
 }
 
 static int shared_data_search(void *data) {
-    for (int i = 0; i < shared_data_count; i++)
-        if (shared_data[i] == data)
-            return i;
-    return -1;
+    if (shared_data_hash_size == 0)
+        return -1;
+    return shared_data_hash[shared_data_hash_slot(data)] - 1;
 }
 
 bool persist_vartype(vartype *v) {
@@ -1204,9 +1281,8 @@ bool persist_vartype(vartype *v) {
                 if (n == -1) {
                     // A negative row count signals a new shared matrix
                     rows = -rows;
-                    if (!shared_data_grow())
+                    if (!shared_data_add(rm->array))
                         return false;
-                    shared_data[shared_data_count++] = rm->array;
                 } else {
                     // A zero row count means this matrix shares its data
                     // with a previously written matrix
@@ -1221,6 +1297,8 @@ bool persist_vartype(vartype *v) {
                 int size = rm->rows * rm->columns;
                 if (fwrite(rm->array->is_string, 1, size, gfile) != size)
                     return false;
+                if (!contains_strings(rm))
+                    return write_phloat_block(rm->array->data, size);
                 for (int i = 0; i < size; i++) {
                     if (rm->array->is_string[i] == 0) {
                         if (!write_phloat(rm->array->data[i]))
@@ -1248,9 +1326,8 @@ bool persist_vartype(vartype *v) {
                 if (n == -1) {
                     // A negative row count signals a new shared matrix
                     rows = -rows;
-                    if (!shared_data_grow())
+                    if (!shared_data_add(cm->array))
                         return false;
-                    shared_data[shared_data_count++] = cm->array;
                 } else {
                     // A zero row count means this matrix shares its data
                     // with a previously written matrix
@@ -1261,12 +1338,8 @@ bool persist_vartype(vartype *v) {
             }
             write_int4(rows);
             write_int4(columns);
-            if (must_write) {
-                int size = 2 * cm->rows * cm->columns;
-                for (int i = 0; i < size; i++)
-                    if (!write_phloat(cm->array->data[i]))
-                        return false;
-            }
+            if (must_write)
+                return write_phloat_block(cm->array->data, 2 * cm->rows * cm->columns);
             return true;
         }
         case TYPE_LIST: {
@@ -1279,9 +1352,8 @@ bool persist_vartype(vartype *v) {
                 if (n == -1) {
                     // data_index == -2 indicates a new shared list
                     data_index = -2;
-                    if (!shared_data_grow())
+                    if (!shared_data_add(list->array))
                         return false;
-                    shared_data[shared_data_count++] = list->array;
                 } else {
                     // data_index >= 0 refers to a previously shared list
                     data_index = n;
@@ -1306,9 +1378,8 @@ bool persist_vartype(vartype *v) {
                 if (n == -1) {
                     // data_index == -2 indicates a new shared equation
                     data_index = -2;
-                    if (!shared_data_grow())
+                    if (!shared_data_add(eq->data))
                         return false;
-                    shared_data[shared_data_count++] = eq->data;
                 } else {
                     // data_index >= 0 refers to a previously shared equation
                     data_index = n;
@@ -1444,43 +1515,50 @@ bool unpersist_vartype(vartype **v) {
                 free_vartype((vartype *) rm);
                 return false;
             }
-            bool success = true;
-            int4 i;
-            for (i = 0; i < size; i++) {
-                success = false;
-                if (rm->array->is_string[i] == 0) {
-                    if (!read_phloat(&rm->array->data[i]))
-                        break;
-                } else {
-                    rm->array->is_string[i] = 1;
-                    // 4-byte length followed by n bytes of text
-                    int4 len;
-                    if (!read_int4(&len))
-                        break;
-                    if (len > SSLENM) {
-                        int4 *p = (int4 *) malloc(len + 4);
-                        if (p == NULL)
-                            break;
-                        if (fread(p + 1, 1, len, gfile) != len) {
-                            free(p);
+            if (!contains_strings(rm)) {
+                if (!read_phloat_block(rm->array->data, size)) {
+                    free_vartype((vartype *) rm);
+                    return false;
+                }
+            } else {
+                bool success = true;
+                int4 i;
+                for (i = 0; i < size; i++) {
+                    success = false;
+                    if (rm->array->is_string[i] == 0) {
+                        if (!read_phloat(&rm->array->data[i]))
                             break;
-                        }
-                        *p = len;
-                        *(int4 **) &rm->array->data[i] = p;
-                        rm->array->is_string[i] = 2;
                     } else {
-                        char *t = (char *) &rm->array->data[i];
-                        *t = len;
-                        if (fread(t + 1, 1, len, gfile) != len)
+                        rm->array->is_string[i] = 1;
+                        // 4-byte length followed by n bytes of text
+                        int4 len;
+                        if (!read_int4(&len))
                             break;
+                        if (len > SSLENM) {
+                            int4 *p = (int4 *) malloc(len + 4);
+                            if (p == NULL)
+                                break;
+                            if (fread(p + 1, 1, len, gfile) != len) {
+                                free(p);
+                                break;
+                            }
+                            *p = len;
+                            *(int4 **) &rm->array->data[i] = p;
+                            rm->array->is_string[i] = 2;
+                        } else {
+                            char *t = (char *) &rm->array->data[i];
+                            *t = len;
+                            if (fread(t + 1, 1, len, gfile) != len)
+                                break;
+                        }
                     }
+                    success = true;
+                }
+                if (!success) {
+                    memset(rm->array->is_string + i, 0, size - i);
+                    free_vartype((vartype *) rm);
+                    return false;
                 }
-                success = true;
-            }
-            if (!success) {
-                memset(rm->array->is_string + i, 0, size - i);
-                free_vartype((vartype *) rm);
-                return false;
             }
             if (shared) {
                 if (!shared_data_grow()) {
@@ -1512,12 +1590,9 @@ bool unpersist_vartype(vartype **v) {
             vartype_complexmatrix *cm = (vartype_complexmatrix *) new_complexmatrix(rows, columns);
             if (cm == NULL)
                 return false;
-            int4 size = 2 * rows * columns;
-            for (int4 i = 0; i < size; i++) {
-                if (!read_phloat(&cm->array->data[i])) {
-                    free_vartype((vartype *) cm);
-                    return false;
-                }
+            if (!read_phloat_block(cm->array->data, 2 * rows * columns)) {
+                free_vartype((vartype *) cm);
+                return false;
             }
             if (shared) {
                 if (!shared_data_grow()) {
@@ -1621,13 +1696,13 @@ bool unpersist_vartype(vartype **v) {
                 lprgm->text = NULL;
                 lprgm->eq_data = NULL;
             }
-            vartype_equation *eq = (vartype_equation *) malloc(sizeof(vartype_equation));
+            vartype_equation *eq = (vartype_equation *) slab_alloc(sizeof(vartype_equation));
             if (eq == NULL)
                 return false;
             eq->type = TYPE_EQUATION;
             equation_data *eqd = new (std::nothrow) equation_data;
             if (eqd == NULL) {
-                free(eq);
+                slab_free(eq, sizeof(vartype_equation));
                 return false;
             }
             eq->data = eqd;
@@ -1702,9 +1777,11 @@ bool unpersist_vartype(vartype **v) {
             return true;
         }
         case TYPE_UNIT: {
-            vartype_unit *u = (vartype_unit *) malloc(sizeof(vartype_unit));
+            vartype_unit *u = (vartype_unit *) slab_alloc(sizeof(vartype_unit));
             if (u == NULL)
                 return false;
+            u->type = TYPE_UNIT;
+            u->text = NULL;
             if (!read_phloat(&u->x)) {
                 unit_fail:
                 free_vartype((vartype *) u);
@@ -1716,11 +1793,8 @@ bool unpersist_vartype(vartype **v) {
             u->text = (char *) malloc(len);
             if (u->text == NULL && len != 0)
                 goto unit_fail;
-            if (fread(u->text, 1, len, gfile) != len) {
-                free(u->text);
+            if (fread(u->text, 1, len, gfile) != len)
                 goto unit_fail;
-            }
-            u->type = TYPE_UNIT;
             u->length = len;
             *v = (vartype *) u;
             return true;
@@ -2443,6 +2517,7 @@ int clear_prgm_by_index(pgm_index prgm) {
     else if (current_prgm.dir == prgm.dir && current_prgm.idx > prgm.idx)
         current_prgm.set(current_prgm.dir, current_prgm.idx - 1);
     directory *dir = dir_list[prgm.dir];
+    dir->dirty |= DIR_DIRTY_PRGMS;
     free(dir->prgms[prgm.idx].text);
     for (i = prgm.idx; i < dir->prgms_count - 1; i++)
         dir->prgms[i] = dir->prgms[i + 1];
@@ -2495,6 +2570,7 @@ void clear_prgm_lines(int4 count) {
     deleted = pc - frompc;
 
     int4 idx = current_prgm.idx;
+    cwd->dirty |= DIR_DIRTY_PRGMS;
     for (i = pc; i < cwd->prgms[idx].size; i++)
         cwd->prgms[idx].text[i - deleted] = cwd->prgms[idx].text[i];
     cwd->prgms[idx].size -= deleted;
@@ -2908,6 +2984,7 @@ void delete_command(int4 pc) {
 
     command |= (argtype & 112) << 4;
     argtype &= 15;
+    dir->dirty |= DIR_DIRTY_PRGMS;
 
     if (command == CMD_END) {
         int4 newsize;
@@ -2968,6 +3045,7 @@ bool store_command(int4 pc, int command, arg_struct *arg, const char *num_str) {
         display_error(ERR_RESTRICTED_OPERATION, false);
         return false;
     }
+    dir->dirty |= DIR_DIRTY_PRGMS;
 
     /* We should never be called with pc = -1, but just to be safe... */
     if (pc == -1)
@@ -4504,6 +4582,49 @@ bool write_phloat(phloat d) {
     #endif
 }
 
+/* Numeric matrix data is written as one contiguous block of phloats.
+ * Starting with version 25, these blocks are aligned to 16-byte boundaries
+ * within the state file, so they can be used in place in a mapped file.
+ */
+static bool write_phloat_block(const phloat *data, int4 n) {
+    long pos = ftell(gfile);
+    if (pos == -1)
+        return false;
+    int pad = (int) ((16 - (pos & 15)) & 15);
+    for (int i = 0; i < pad; i++)
+        if (!write_char(0))
+            return false;
+    #ifdef F42_BIG_ENDIAN
+        for (int4 i = 0; i < n; i++)
+            if (!write_phloat(data[i]))
+                return false;
+        return true;
+    #else
+        return fwrite(data, sizeof(phloat), n, gfile) == n;
+    #endif
+}
+
+static bool read_phloat_block(phloat *data, int4 n) {
+    if (ver >= 25) {
+        long pos = ftell(gfile);
+        if (pos == -1)
+            return false;
+        int pad = (int) ((16 - (pos & 15)) & 15);
+        char dummy;
+        for (int i = 0; i < pad; i++)
+            if (!read_char(&dummy))
+                return false;
+    }
+    #ifndef F42_BIG_ENDIAN
+        if (!bin_dec_mode_switch())
+            return fread(data, sizeof(phloat), n, gfile) == n;
+    #endif
+    for (int4 i = 0; i < n; i++)
+        if (!read_phloat(data + i))
+            return false;
+    return true;
+}
+
 struct fake_bcd {
     char data[16];
 };
@@ -4612,54 +4733,7 @@ bool write_arg(const arg_struct *arg) {
     }
 }
 
-static bool load_state2(bool *clear, bool *too_new) {
-    int4 magic;
-    int4 version;
-    *clear = false;
-    *too_new = false;
-
-    /* The shell has verified the initial magic and version numbers,
-     * and loaded the shell state, before we got called.
-     */
-
-    if (!read_int4(&magic))
-        return false;
-    if (magic != PLUS42_MAGIC)
-        return false;
-    if (!read_int4(&ver)) {
-        // A state file containing nothing after the magic number
-        // is considered empty, and results in a hard reset. This
-        // is *not* an error condition; such state files are used
-        // when creating a new state in the States window.
-        *clear = true;
-        return false;
-    }
-
-    if (ver < 7)
-        return false;
-    if (ver > PLUS42_VERSION) {
-        *too_new = true;
-        return false;
-    }
-
-    // Embedded version information. No need to read this; it's just
-    // there for troubleshooting purposes. All we need to do here is
-    // skip it.
-    while (true) {
-        char c;
-        if (!read_char(&c))
-            return false;
-        if (c == 0)
-            break;
-    }
-
-    bool state_is_decimal;
-    if (!read_bool(&state_is_decimal)) return false;
-    if (!state_is_decimal)
-        state_file_number_format = NUMBER_FORMAT_BINARY;
-    else
-        state_file_number_format = NUMBER_FORMAT_BID128;
-
+static bool unpersist_modes() {
     bool bdummy;
     if (!read_bool(&bdummy)) return false;
     if (!read_bool(&bdummy)) return false;
@@ -4762,15 +4836,109 @@ static bool load_state2(bool *clear, bool *too_new) {
     for (int i = 0; i < 16; i++)
         if (!read_int(&keybuf[i]))
             return false;
+    return true;
+}
 
-    if (!unpersist_display(ver))
+static bool load_state2(bool *clear, bool *too_new) {
+    int4 magic;
+    int4 version;
+    *clear = false;
+    *too_new = false;
+
+    /* The shell has verified the initial magic and version numbers,
+     * and loaded the shell state, before we got called.
+     */
+
+    if (!read_int4(&magic))
+        return false;
+    if (magic != PLUS42_MAGIC)
         return false;
-    if (!unpersist_globals())
+    if (!read_int4(&ver)) {
+        // A state file containing nothing after the magic number
+        // is considered empty, and results in a hard reset. This
+        // is *not* an error condition; such state files are used
+        // when creating a new state in the States window.
+        *clear = true;
         return false;
-    if (!unpersist_eqn(ver))
+    }
+
+    if (ver < 7)
         return false;
-    if (!unpersist_math(ver))
+    if (ver > PLUS42_VERSION) {
+        *too_new = true;
         return false;
+    }
+
+    // Embedded version information. No need to read this; it's just
+    // there for troubleshooting purposes. All we need to do here is
+    // skip it.
+    while (true) {
+        char c;
+        if (!read_char(&c))
+            return false;
+        if (c == 0)
+            break;
+    }
+
+    bool state_is_decimal;
+    if (!read_bool(&state_is_decimal)) return false;
+    if (!state_is_decimal)
+        state_file_number_format = NUMBER_FORMAT_BINARY;
+    else
+        state_file_number_format = NUMBER_FORMAT_BID128;
+
+    if (ver < 25) {
+        if (!unpersist_modes())
+            return false;
+        if (!unpersist_display(ver))
+            return false;
+        if (!unpersist_globals())
+            return false;
+        if (!unpersist_eqn(ver))
+            return false;
+        if (!unpersist_math(ver))
+            return false;
+    } else {
+        int4 count;
+        if (!read_int4(&count) || count < 0 || count > 1000)
+            return false;
+        int4 *table = (int4 *) malloc(3 * count * sizeof(int4) + 1);
+        if (table == NULL)
+            return false;
+        for (int i = 0; i < 3 * count; i++)
+            if (!read_int4(table + i)) {
+                free(table);
+                return false;
+            }
+        long end_pos = ftell(gfile);
+        bool success = true;
+        for (int i = 0; success && i < count; i++) {
+            int4 id = table[3 * i];
+            int4 offset = table[3 * i + 1];
+            int4 length = table[3 * i + 2];
+            if (fseek(gfile, offset, SEEK_SET) != 0) {
+                success = false;
+                break;
+            }
+            switch (id) {
+                case STATE_SECTION_MODES: success = unpersist_modes(); break;
+                case STATE_SECTION_DISPLAY: success = unpersist_display(ver); break;
+                case STATE_SECTION_GLOBALS: success = unpersist_globals(); break;
+                case STATE_SECTION_EQUATIONS: success = unpersist_eqn(ver); break;
+                case STATE_SECTION_MATH: success = unpersist_math(ver); break;
+                case STATE_SECTION_JOURNAL: success = read_int8(&state_generation); break;
+                default: /* Unknown section; skip it */ break;
+            }
+            if (success && ftell(gfile) != offset + length
+                    && id >= STATE_SECTION_MODES && id <= STATE_SECTION_JOURNAL)
+                success = false;
+            if (offset + length > end_pos)
+                end_pos = offset + length;
+        }
+        free(table);
+        if (!success || fseek(gfile, end_pos, SEEK_SET) != 0)
+            return false;
+    }
 
     // It would be better to also prevent all the useless rebuild_label_table()
     // calls that have happened during state file loading until this point.
@@ -4788,18 +4956,94 @@ static bool load_state2(bool *clear, bool *too_new) {
 }
 
 bool load_state(bool *clear, bool *too_new) {
-    shared_data_count = 0;
-    shared_data_capacity = 0;
-    shared_data = NULL;
+    shared_data_reset();
+    state_generation = 0;
 
     loading_state = true;
     bool ret = load_state2(clear, too_new);
     loading_state = false;
 
-    free(shared_data);
+    shared_data_reset();
     return ret;
 }
 
+static bool persist_modes() {
+    if (!write_bool(core_settings.matrix_singularmatrix)) return false;
+    if (!write_bool(core_settings.matrix_outofrange)) return false;
+    if (!write_bool(core_settings.auto_repeat)) return false;
+    if (!write_bool(mode_clall)) return false;
+    if (!write_bool(mode_command_entry)) return false;
+    if (!write_char(mode_number_entry)) return false;
+    if (!write_bool(mode_alpha_entry)) return false;
+    if (!write_bool(mode_shift)) return false;
+    if (!write_int(mode_appmenu)) return false;
+    if (!write_int(mode_auxmenu)) return false;
+    if (!write_int(mode_plainmenu)) return false;
+    if (!write_bool(mode_plainmenu_sticky)) return false;
+    if (!write_int(mode_transientmenu)) return false;
+    if (!write_int(mode_alphamenu)) return false;
+    if (!write_int(mode_commandmenu)) return false;
+    if (!write_bool(mode_running)) return false;
+    if (!write_bool(mode_varmenu)) return false;
+    if (!write_int(mode_varmenu_whence)) return false;
+    if (!write_bool(mode_updown)) return false;
+    if (!write_bool(mode_getkey)) return false;
+
+    if (!write_phloat(entered_number)) return false;
+    if (!write_int(entered_string_length)) return false;
+    if (fwrite(entered_string, 1, 15, gfile) != 15) return false;
+
+    if (!write_int(pending_command)) return false;
+    if (!write_arg(&pending_command_arg)) return false;
+    if (!write_int(xeq_invisible)) return false;
+
+    if (!write_int(incomplete_command)) return false;
+    if (!write_bool(incomplete_ind)) return false;
+    if (!write_bool(incomplete_alpha)) return false;
+    if (!write_int(incomplete_length)) return false;
+    if (!write_int(incomplete_maxdigits)) return false;
+    if (!write_int(incomplete_argtype)) return false;
+    if (!write_int(incomplete_num)) return false;
+    if (fwrite(incomplete_str, 1, incomplete_length, gfile) != incomplete_length) return false;
+    if (!write_int4(pc2line(incomplete_saved_pc))) return false;
+    if (!write_int4(incomplete_saved_highlight_row)) return false;
+
+    if (fwrite(cmdline, 1, 100, gfile) != 100) return false;
+    if (!write_int(cmdline_length)) return false;
+    if (!write_int(cmdline_unit)) return false;
+
+    if (!write_int(matedit_mode)) return false;
+    if (!write_int4(matedit_dir)) return false;
+    if (fwrite(matedit_name, 1, 7, gfile) != 7) return false;
+    if (!write_int(matedit_length)) return false;
+    if (!persist_vartype(matedit_x)) return false;
+    if (!write_int4(matedit_i)) return false;
+    if (!write_int4(matedit_j)) return false;
+    if (!write_int(matedit_prev_appmenu)) return false;
+
+    if (fwrite(input_name, 1, 11, gfile) != 11) return false;
+    if (!write_int(input_length)) return false;
+    if (!write_arg(&input_arg)) return false;
+
+    if (!write_int(lasterr)) return false;
+    if (!write_int(lasterr_length)) return false;
+    if (fwrite(lasterr_text, 1, 22, gfile) != 22) return false;
+
+    if (!write_int(baseapp)) return false;
+
+    if (!write_int8(random_number_low)) return false;
+    if (!write_int8(random_number_high)) return false;
+
+    if (!write_int(deferred_print)) return false;
+
+    if (!write_int(keybuf_head)) return false;
+    if (!write_int(keybuf_tail)) return false;
+    for (int i = 0; i < 16; i++)
+        if (!write_int(keybuf[i]))
+            return false;
+    return true;
+}
+
 static void save_state2(bool *success) {
     *success = false;
     if (!write_int4(PLUS42_MAGIC) || !write_int4(PLUS42_VERSION))
@@ -4818,87 +5062,40 @@ static void save_state2(bool *success) {
     #else
         if (!write_bool(false)) return;
     #endif
-    if (!write_bool(core_settings.matrix_singularmatrix)) return;
-    if (!write_bool(core_settings.matrix_outofrange)) return;
-    if (!write_bool(core_settings.auto_repeat)) return;
-    if (!write_bool(mode_clall)) return;
-    if (!write_bool(mode_command_entry)) return;
-    if (!write_char(mode_number_entry)) return;
-    if (!write_bool(mode_alpha_entry)) return;
-    if (!write_bool(mode_shift)) return;
-    if (!write_int(mode_appmenu)) return;
-    if (!write_int(mode_auxmenu)) return;
-    if (!write_int(mode_plainmenu)) return;
-    if (!write_bool(mode_plainmenu_sticky)) return;
-    if (!write_int(mode_transientmenu)) return;
-    if (!write_int(mode_alphamenu)) return;
-    if (!write_int(mode_commandmenu)) return;
-    if (!write_bool(mode_running)) return;
-    if (!write_bool(mode_varmenu)) return;
-    if (!write_int(mode_varmenu_whence)) return;
-    if (!write_bool(mode_updown)) return;
-    if (!write_bool(mode_getkey)) return;
-
-    if (!write_phloat(entered_number)) return;
-    if (!write_int(entered_string_length)) return;
-    if (fwrite(entered_string, 1, 15, gfile) != 15) return;
-
-    if (!write_int(pending_command)) return;
-    if (!write_arg(&pending_command_arg)) return;
-    if (!write_int(xeq_invisible)) return;
-
-    if (!write_int(incomplete_command)) return;
-    if (!write_bool(incomplete_ind)) return;
-    if (!write_bool(incomplete_alpha)) return;
-    if (!write_int(incomplete_length)) return;
-    if (!write_int(incomplete_maxdigits)) return;
-    if (!write_int(incomplete_argtype)) return;
-    if (!write_int(incomplete_num)) return;
-    if (fwrite(incomplete_str, 1, incomplete_length, gfile) != incomplete_length) return;
-    if (!write_int4(pc2line(incomplete_saved_pc))) return;
-    if (!write_int4(incomplete_saved_highlight_row)) return;
-
-    if (fwrite(cmdline, 1, 100, gfile) != 100) return;
-    if (!write_int(cmdline_length)) return;
-    if (!write_int(cmdline_unit)) return;
-
-    if (!write_int(matedit_mode)) return;
-    if (!write_int4(matedit_dir)) return;
-    if (fwrite(matedit_name, 1, 7, gfile) != 7) return;
-    if (!write_int(matedit_length)) return;
-    if (!persist_vartype(matedit_x)) return;
-    if (!write_int4(matedit_i)) return;
-    if (!write_int4(matedit_j)) return;
-    if (!write_int(matedit_prev_appmenu)) return;
-
-    if (fwrite(input_name, 1, 11, gfile) != 11) return;
-    if (!write_int(input_length)) return;
-    if (!write_arg(&input_arg)) return;
-
-    if (!write_int(lasterr)) return;
-    if (!write_int(lasterr_length)) return;
-    if (fwrite(lasterr_text, 1, 22, gfile) != 22) return;
-
-    if (!write_int(baseapp)) return;
-
-    if (!write_int8(random_number_low)) return;
-    if (!write_int8(random_number_high)) return;
-
-    if (!write_int(deferred_print)) return;
-
-    if (!write_int(keybuf_head)) return;
-    if (!write_int(keybuf_tail)) return;
-    for (int i = 0; i < 16; i++)
-        if (!write_int(keybuf[i]))
-            return;
-
-    if (!persist_display())
+    // Section table; the offsets and lengths are filled in once all the
+    // sections have been written.
+    long table_pos = ftell(gfile);
+    if (table_pos == -1)
         return;
-    if (!persist_globals())
-        return;
-    if (!persist_eqn())
+    if (!write_int4(STATE_SECTION_COUNT)) return;
+    for (int i = 0; i < 3 * STATE_SECTION_COUNT; i++)
+        if (!write_int4(0))
+            return;
+    int4 offset[STATE_SECTION_COUNT], length[STATE_SECTION_COUNT];
+    for (int i = 0; i < STATE_SECTION_COUNT; i++) {
+        long pos = ftell(gfile);
+        bool ok = false;
+        switch (i + 1) {
+            case STATE_SECTION_MODES: ok = persist_modes(); break;
+            case STATE_SECTION_DISPLAY: ok = persist_display(); break;
+            case STATE_SECTION_GLOBALS: ok = persist_globals(); break;
+            case STATE_SECTION_EQUATIONS: ok = persist_eqn(); break;
+            case STATE_SECTION_MATH: ok = persist_math(); break;
+            case STATE_SECTION_JOURNAL: ok = write_int8(state_generation); break;
+        }
+        long end = ftell(gfile);
+        if (!ok || pos == -1 || end == -1)
+            return;
+        offset[i] = (int4) pos;
+        length[i] = (int4) (end - pos);
+    }
+    long end_pos = ftell(gfile);
+    if (fseek(gfile, table_pos + 4, SEEK_SET) != 0)
         return;
-    if (!persist_math())
+    for (int i = 0; i < STATE_SECTION_COUNT; i++)
+        if (!write_int4(i + 1) || !write_int4(offset[i]) || !write_int4(length[i]))
+            return;
+    if (fseek(gfile, end_pos, SEEK_SET) != 0)
         return;
 
     if (!write_int4(PLUS42_MAGIC)) return;
@@ -4907,17 +5104,759 @@ static void save_state2(bool *success) {
 }
 
 bool save_state() {
-    shared_data_count = 0;
-    shared_data_capacity = 0;
-    shared_data = NULL;
-
     bool success;
     save_state2(&success);
+    shared_data_reset();
+    return success;
+}
 
-    free(shared_data);
+/* Checkpoint journal
+ *
+ * Between full saves, journal_write() appends the changes made since the
+ * previous checkpoint to a journal kept alongside the state file, so stored
+ * variables, programs, and directories can be made durable without rewriting
+ * the whole state. Changes are found by comparing fingerprints: a hash of
+ * each global variable, of each directory's programs, and of each directory's
+ * list of subdirectories. Everything else (stack, modes, display) is restored
+ * as of the base state.
+ *
+ * Only fingerprints of things that may have changed are computed again. The
+ * code that changes programs or subdirectories sets DIR_DIRTY_PRGMS or
+ * DIR_DIRTY_DIRS in the directory, and lookup_var() flags every global it
+ * finds as VAR_DIRTY, since the caller may change it in place.
+ *
+ * The journal starts with a header containing the generation of the base
+ * state file, and is ignored if it doesn't match the state that was loaded.
+ * Each record is framed as {type, length, payload, JOURNAL_MAGIC}, so that a
+ * record that was only partially written is recognized and not applied.
+ */
+
+#define JOURNAL_MAGIC 0x4a524e4c /* "JRNL" */
+
+#define JOURNAL_DIR   1 /* Subdirectory list, with any new subdirectories */
+#define JOURNAL_PRGMS 2 /* All programs in a directory */
+#define JOURNAL_STO   3 /* Global variable stored */
+#define JOURNAL_PURGE 4 /* Global variable purged */
+
+struct journal_print {
+    int4 dir;
+    int4 parent;
+    char kind; /* JOURNAL_DIR, JOURNAL_PRGMS, or JOURNAL_STO */
+    unsigned char length;
+    char name[7];
+    uint8 hash;
+};
+
+static journal_print *journal_prints = NULL;
+static int journal_prints_count = 0;
+
+static uint8 hash_vartype(uint8 h, const vartype *v) {
+    if (v == NULL)
+        return fnv1a64("", 1, h);
+    h = fnv1a64(&v->type, sizeof(int), h);
+    switch (v->type) {
+        case TYPE_REAL: {
+            vartype_real *r = (vartype_real *) v;
+            return fnv1a64(&r->x, sizeof(phloat), h);
+        }
+        case TYPE_COMPLEX: {
+            vartype_complex *c = (vartype_complex *) v;
+            h = fnv1a64(&c->re, sizeof(phloat), h);
+            return fnv1a64(&c->im, sizeof(phloat), h);
+        }
+        case TYPE_STRING: {
+            vartype_string *s = (vartype_string *) v;
+            h = fnv1a64(&s->length, sizeof(int4), h);
+            return fnv1a64(s->txt(), s->length, h);
+        }
+        case TYPE_REALMATRIX: {
+            vartype_realmatrix *rm = (vartype_realmatrix *) v;
+            int4 size = rm->rows * rm->columns;
+            h = fnv1a64(&rm->rows, sizeof(int4), h);
+            h = fnv1a64(&rm->columns, sizeof(int4), h);
+            if (!contains_strings(rm))
+                return fnv1a64(rm->array->data, size * sizeof(phloat), h);
+            for (int4 i = 0; i < size; i++) {
+                if (rm->array->is_string[i] == 0) {
+                    h = fnv1a64(rm->array->data + i, sizeof(phloat), h);
+                } else {
+                    const char *text;
+                    int4 len;
+                    get_matrix_string(rm, i, &text, &len);
+                    h = fnv1a64(&len, sizeof(int4), h);
+                    h = fnv1a64(text, len, h);
+                }
+            }
+            return h;
+        }
+        case TYPE_COMPLEXMATRIX: {
+            vartype_complexmatrix *cm = (vartype_complexmatrix *) v;
+            h = fnv1a64(&cm->rows, sizeof(int4), h);
+            h = fnv1a64(&cm->columns, sizeof(int4), h);
+            return fnv1a64(cm->array->data, 2 * cm->rows * cm->columns * sizeof(phloat), h);
+        }
+        case TYPE_LIST: {
+            vartype_list *list = (vartype_list *) v;
+            h = fnv1a64(&list->size, sizeof(int4), h);
+            for (int4 i = 0; i < list->size; i++)
+                h = hash_vartype(h, list->array->data[i]);
+            return h;
+        }
+        case TYPE_EQUATION: {
+            equation_data *eqd = ((vartype_equation *) v)->data;
+            h = fnv1a64(&eqd->compatMode, sizeof(bool), h);
+            h = fnv1a64(&eqd->length, sizeof(int4), h);
+            return fnv1a64(eqd->text, eqd->length, h);
+        }
+        case TYPE_UNIT: {
+            vartype_unit *u = (vartype_unit *) v;
+            h = fnv1a64(&u->x, sizeof(phloat), h);
+            h = fnv1a64(&u->length, sizeof(int4), h);
+            return fnv1a64(u->text, u->length, h);
+        }
+        case TYPE_DIR_REF: {
+            vartype_dir_ref *r = (vartype_dir_ref *) v;
+            return fnv1a64(&r->dir, sizeof(int4), h);
+        }
+        case TYPE_PGM_REF: {
+            vartype_pgm_ref *r = (vartype_pgm_ref *) v;
+            h = fnv1a64(&r->dir, sizeof(int4), h);
+            return fnv1a64(&r->pgm, sizeof(int4), h);
+        }
+        case TYPE_VAR_REF: {
+            vartype_var_ref *r = (vartype_var_ref *) v;
+            h = fnv1a64(&r->dir, sizeof(int4), h);
+            return fnv1a64(r->name, r->length, h);
+        }
+        default:
+            return h;
+    }
+}
+
+static journal_print *journal_add_print(journal_print **prints, int *count, int *capacity) {
+    if (*count == *capacity) {
+        int newcapacity = *capacity == 0 ? 64 : *capacity * 2;
+        journal_print *p = (journal_print *) realloc(*prints, newcapacity * sizeof(journal_print));
+        if (p == NULL)
+            return NULL;
+        *prints = p;
+        *capacity = newcapacity;
+    }
+    journal_print *p = *prints + (*count)++;
+    p->dir = 0;
+    p->parent = -1;
+    p->length = 0;
+    p->hash = FNV1A64_BASIS;
+    return p;
+}
+
+static int journal_print_compare(const void *a, const void *b) {
+    const journal_print *p = (const journal_print *) a;
+    const journal_print *q = (const journal_print *) b;
+    if (p->dir != q->dir)
+        return p->dir < q->dir ? -1 : 1;
+    if (p->kind != q->kind)
+        return p->kind < q->kind ? -1 : 1;
+    if (p->length != q->length)
+        return p->length < q->length ? -1 : 1;
+    return memcmp(p->name, q->name, p->length);
+}
+
+static const journal_print *journal_find_print(const journal_print *prints, int count, const journal_print *key) {
+    return (const journal_print *) bsearch(key, prints, count, sizeof(journal_print), journal_print_compare);
+}
+
+/* Returns the fingerprint of the previous checkpoint matching 'p', if it can
+ * be reused for 'p', that is, if the directory hasn't been replaced since.
+ */
+static const journal_print *journal_old_print(directory *dir, bool all, const journal_print *p) {
+    if (all || (dir->dirty & DIR_DIRTY_NEW) != 0)
+        return NULL;
+    return journal_find_print(journal_prints, journal_prints_count, p);
+}
+
+/* Finds the variable fingerprints of the previous checkpoint for directory
+ * 'dir'. These are consecutive, since they are sorted by directory first.
+ */
+static const journal_print *journal_old_vars(int4 dir, int *n) {
+    int lo = 0, hi = journal_prints_count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        const journal_print *p = journal_prints + mid;
+        if (p->dir < dir || p->dir == dir && p->kind < JOURNAL_STO)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    int end = lo;
+    while (end < journal_prints_count && journal_prints[end].dir == dir
+            && journal_prints[end].kind == JOURNAL_STO)
+        end++;
+    *n = end - lo;
+    return journal_prints + lo;
+}
+
+/* Collects the fingerprints of 'dir' and everything below it. If 'all' is
+ * false, fingerprints of things not marked as changed are copied from the
+ * previous checkpoint instead of being computed again. Either way, the
+ * directories are marked as unchanged afterwards, so if these fingerprints
+ * are not used, the state must be saved in full, and rebased.
+ */
+static bool journal_collect(directory *dir, bool all, journal_print **prints, int *count, int *capacity) {
+    const journal_print *old;
+    journal_print *p = journal_add_print(prints, count, capacity);
+    if (p == NULL)
+        return false;
+    p->dir = dir->id;
+    p->parent = dir->parent == NULL ? -1 : dir->parent->id;
+    p->kind = JOURNAL_DIR;
+    if ((dir->dirty & DIR_DIRTY_DIRS) == 0
+            && (old = journal_old_print(dir, all, p)) != NULL) {
+        p->hash = old->hash;
+    } else {
+        for (int i = 0; i < dir->children_count; i++) {
+            subdir_struct *sd = dir->children + i;
+            p->hash = fnv1a64(&sd->dir->id, sizeof(int), p->hash);
+            p->hash = fnv1a64(&sd->length, 1, p->hash);
+            p->hash = fnv1a64(sd->name, sd->length, p->hash);
+        }
+    }
+
+    p = journal_add_print(prints, count, capacity);
+    if (p == NULL)
+        return false;
+    p->dir = dir->id;
+    p->kind = JOURNAL_PRGMS;
+    if ((dir->dirty & DIR_DIRTY_PRGMS) == 0
+            && (old = journal_old_print(dir, all, p)) != NULL) {
+        p->hash = old->hash;
+    } else {
+        for (int i = 0; i < dir->prgms_count; i++) {
+            prgm_struct *prgm = dir->prgms + i;
+            p->hash = fnv1a64(&prgm->size, sizeof(int4), p->hash);
+            p->hash = fnv1a64(prgm->text, prgm->size, p->hash);
+        }
+    }
+
+    if (!all && (dir->dirty & (DIR_DIRTY_VARS | DIR_DIRTY_NEW)) == 0) {
+        int n;
+        old = journal_old_vars(dir->id, &n);
+        for (int i = 0; i < n; i++) {
+            p = journal_add_print(prints, count, capacity);
+            if (p == NULL)
+                return false;
+            *p = old[i];
+        }
+    } else {
+        for (int i = 0; i < dir->vars_count; i++) {
+            p = journal_add_print(prints, count, capacity);
+            if (p == NULL)
+                return false;
+            var_struct *vs = dir->vars + i;
+            p->dir = dir->id;
+            p->kind = JOURNAL_STO;
+            p->length = vs->length;
+            memcpy(p->name, vs->name, vs->length);
+            if ((vs->flags & VAR_DIRTY) == 0
+                    && (old = journal_old_print(dir, all, p)) != NULL)
+                p->hash = old->hash;
+            else
+                p->hash = hash_vartype(p->hash, vs->value);
+            vs->flags &= ~VAR_DIRTY;
+        }
+    }
+    dir->dirty = 0;
+
+    for (int i = 0; i < dir->children_count; i++)
+        if (!journal_collect(dir->children[i].dir, all, prints, count, capacity))
+            return false;
+    return true;
+}
+
+static bool journal_fingerprint(bool all, journal_print **prints, int *count) {
+    int capacity = 0;
+    *prints = NULL;
+    *count = 0;
+    if (!journal_collect(root, all, prints, count, &capacity)) {
+        free(*prints);
+        *prints = NULL;
+        return false;
+    }
+    qsort(*prints, *count, sizeof(journal_print), journal_print_compare);
+    return true;
+}
+
+/* Take the current state as the starting point for the next journal_write().
+ * Called after the state has been saved in full, or loaded.
+ */
+void journal_rebase() {
+    free(journal_prints);
+    journal_prints = NULL;
+    journal_prints_count = 0;
+    if (!journal_fingerprint(true, &journal_prints, &journal_prints_count))
+        // Without fingerprints, the next checkpoint can only save in full
+        state_generation = 0;
+}
+
+static bool journal_contains(const int4 *ids, int n, int4 id) {
+    for (int i = 0; i < n; i++)
+        if (ids[i] == id)
+            return true;
+    return false;
+}
+
+static bool journal_add_subtree(directory *dir, int4 **ids, int *n, int *capacity) {
+    if (*n == *capacity) {
+        int newcapacity = *capacity == 0 ? 16 : *capacity * 2;
+        int4 *p = (int4 *) realloc(*ids, newcapacity * sizeof(int4));
+        if (p == NULL)
+            return false;
+        *ids = p;
+        *capacity = newcapacity;
+    }
+    (*ids)[(*n)++] = dir->id;
+    for (int i = 0; i < dir->children_count; i++)
+        if (!journal_add_subtree(dir->children[i].dir, ids, n, capacity))
+            return false;
+    return true;
+}
+
+static long journal_begin_record(int type) {
+    if (!write_int4(type))
+        return -1;
+    long pos = ftell(gfile);
+    if (pos == -1 || !write_int4(0))
+        return -1;
+    return pos;
+}
+
+static bool journal_end_record(long pos) {
+    if (pos == -1)
+        return false;
+    long end = ftell(gfile);
+    if (end == -1)
+        return false;
+    if (fseek(gfile, pos, SEEK_SET) != 0
+            || !write_int4((int4) (end - pos - 4))
+            || fseek(gfile, end, SEEK_SET) != 0)
+        return false;
+    shared_data_reset();
+    return write_int4(JOURNAL_MAGIC);
+}
+
+static bool journal_write_dir(directory *dir, int4 **covered, int *ncovered, int *covered_capacity) {
+    long pos = journal_begin_record(JOURNAL_DIR);
+    if (pos == -1)
+        return false;
+    if (!write_int4(dir->id) || !write_int(dir->children_count))
+        return false;
+    for (int i = 0; i < dir->children_count; i++) {
+        subdir_struct *sd = dir->children + i;
+        // A subdirectory that was already there is referenced by ID; one
+        // that is new here is written out in full, along with everything
+        // in it, and doesn't need any further records of its own.
+        journal_print key;
+        key.dir = sd->dir->id;
+        key.kind = JOURNAL_DIR;
+        key.length = 0;
+        const journal_print *old = journal_find_print(journal_prints, journal_prints_count, &key);
+        bool is_new = old == NULL || old->parent != dir->id;
+        if (!write_char(sd->length)
+                || fwrite(sd->name, 1, sd->length, gfile) != sd->length
+                || !write_int4(sd->dir->id)
+                || !write_bool(is_new))
+            return false;
+        if (is_new) {
+            if (!persist_directory(sd->dir))
+                return false;
+            if (!journal_add_subtree(sd->dir, covered, ncovered, covered_capacity))
+                return false;
+        }
+    }
+    return journal_end_record(pos);
+}
+
+static bool journal_write_prgms(directory *dir) {
+    long pos = journal_begin_record(JOURNAL_PRGMS);
+    if (pos == -1)
+        return false;
+    if (!write_int4(dir->id) || !write_int(dir->prgms_count))
+        return false;
+    directory *saved_cwd = cwd;
+    cwd = dir;
+    for (int i = 0; i < dir->prgms_count; i++)
+        core_export_programs(1, &i, NULL);
+    cwd = saved_cwd;
+    return journal_end_record(pos);
+}
+
+static bool journal_write_var(int type, int4 dir, const journal_print *p) {
+    long pos = journal_begin_record(type);
+    if (pos == -1)
+        return false;
+    if (!write_int4(dir)
+            || !write_char(p->length)
+            || fwrite(p->name, 1, p->length, gfile) != p->length)
+        return false;
+    if (type == JOURNAL_STO) {
+        directory *d = get_dir(dir);
+        vartype *v = NULL;
+        for (int i = 0; i < d->vars_count; i++)
+            if (string_equals(d->vars[i].name, d->vars[i].length, p->name, p->length)) {
+                v = d->vars[i].value;
+                break;
+            }
+        if (!persist_vartype(v))
+            return false;
+    }
+    return journal_end_record(pos);
+}
+
+static bool journal_write_dirs(directory *dir, const journal_print *prints, int count,
+                               int4 **covered, int *ncovered, int *covered_capacity) {
+    if (journal_contains(*covered, *ncovered, dir->id))
+        return true;
+    journal_print key;
+    key.dir = dir->id;
+    key.kind = JOURNAL_DIR;
+    key.length = 0;
+    const journal_print *o = journal_find_print(journal_prints, journal_prints_count, &key);
+    const journal_print *n = journal_find_print(prints, count, &key);
+    if ((o == NULL || o->hash != n->hash || o->parent != n->parent)
+            && !journal_write_dir(dir, covered, ncovered, covered_capacity))
+        return false;
+    for (int i = 0; i < dir->children_count; i++)
+        if (!journal_write_dirs(dir->children[i].dir, prints, count, covered, ncovered, covered_capacity))
+            return false;
+    return true;
+}
+
+/* Append the changes since the last checkpoint, or since the last full save
+ * or load, to the journal open in gfile. If 'start' is true, the journal is
+ * new, and its header is written first.
+ */
+bool journal_write(bool start) {
+    if (start) {
+        if (!write_int4(JOURNAL_MAGIC) || !write_int4(PLUS42_VERSION)
+                || !write_int8(state_generation))
+            return false;
+        #ifdef BCD_MATH
+            if (!write_bool(true)) return false;
+        #else
+            if (!write_bool(false)) return false;
+        #endif
+    }
+
+    journal_print *prints;
+    int count;
+    if (!journal_fingerprint(false, &prints, &count))
+        return false;
+
+    // Directories inside new subtrees are written in full as part of
+    // their parent's JOURNAL_DIR record.
+    int4 *covered = NULL;
+    int ncovered = 0, covered_capacity = 0;
+    int i, j;
+    bool success = false;
+    shared_data_reset();
+
+    // Subdirectory lists first, so that new directories exist by the time
+    // records that refer to them are replayed. These are written top-down,
+    // so that directories that are new, and therefore covered by their
+    // parent's record, are known before they are visited.
+    if (!journal_write_dirs(root, prints, count, &covered, &ncovered, &covered_capacity))
+        goto done;
+
+    // Then programs and variables
+    i = 0;
+    j = 0;
+    while (i < journal_prints_count || j < count) {
+        const journal_print *o = i < journal_prints_count ? journal_prints + i : NULL;
+        const journal_print *n = j < count ? prints + j : NULL;
+        int c = o == NULL ? 1 : n == NULL ? -1 : journal_print_compare(o, n);
+        if (c < 0) {
+            // Gone. Removed directories are taken care of by their
+            // parent's JOURNAL_DIR record; only variables need a record.
+            if (o->kind == JOURNAL_STO
+                    && get_dir(o->dir) != NULL
+                    && !journal_contains(covered, ncovered, o->dir)
+                    && !journal_write_var(JOURNAL_PURGE, o->dir, o))
+                goto done;
+            i++;
+            continue;
+        }
+        if (c == 0 && o->hash == n->hash) {
+            i++;
+            j++;
+            continue;
+        }
+        // New or changed
+        if (!journal_contains(covered, ncovered, n->dir)) {
+            if (n->kind == JOURNAL_PRGMS) {
+                if (!journal_write_prgms(get_dir(n->dir)))
+                    goto done;
+            } else if (n->kind == JOURNAL_STO) {
+                if (!journal_write_var(JOURNAL_STO, n->dir, n))
+                    goto done;
+            }
+        }
+        if (c == 0)
+            i++;
+        j++;
+    }
+    success = true;
+
+    done:
+    shared_data_reset();
+    free(covered);
+    if (success) {
+        free(journal_prints);
+        journal_prints = prints;
+        journal_prints_count = count;
+    } else
+        free(prints);
     return success;
 }
 
+static void map_dir_tree(directory *dir) {
+    map_dir(dir->id, dir);
+    for (int i = 0; i < dir->children_count; i++)
+        map_dir_tree(dir->children[i].dir);
+}
+
+static bool journal_replay_dir() {
+    int4 id;
+    int nc;
+    if (!read_int4(&id) || !read_int(&nc) || nc < 0)
+        return false;
+    directory *dir = get_dir(id);
+    if (dir == NULL)
+        return true;
+    subdir_struct *children = (subdir_struct *) malloc(nc * sizeof(subdir_struct));
+    if (children == NULL && nc != 0)
+        return false;
+    bool *is_new = (bool *) malloc(nc * sizeof(bool) + 1);
+    if (is_new == NULL) {
+        free(children);
+        return false;
+    }
+    int n;
+    for (n = 0; n < nc; n++) {
+        subdir_struct *sd = children + n;
+        int4 child_id;
+        if (!read_char((char *) &sd->length) || sd->length > 7
+                || fread(sd->name, 1, sd->length, gfile) != sd->length
+                || !read_int4(&child_id) || !read_bool(is_new + n))
+            break;
+        if (is_new[n]) {
+            if (!unpersist_directory(&sd->dir))
+                break;
+        } else {
+            sd->dir = get_dir(child_id);
+            if (sd->dir == NULL || sd->dir->parent != dir)
+                break;
+        }
+        sd->dir->parent = dir;
+    }
+    if (n < nc) {
+        for (int i = 0; i < n; i++)
+            if (is_new[i])
+                delete children[i].dir;
+        free(children);
+        free(is_new);
+        map_dir_tree(root);
+        return false;
+    }
+    free(is_new);
+
+    // Delete subdirectories that are no longer there
+    for (int i = 0; i < dir->children_count; i++) {
+        directory *old = dir->children[i].dir;
+        bool kept = false;
+        for (int j = 0; j < nc; j++)
+            if (children[j].dir == old) {
+                kept = true;
+                break;
+            }
+        if (!kept)
+            delete old;
+    }
+    free(dir->children);
+    dir->children = children;
+    dir->children_count = nc;
+    dir->children_capacity = nc;
+    // Deleting directories unmaps their IDs, which may have been reused
+    // by new ones, so restore the mapping from the tree itself.
+    map_dir_tree(root);
+    return true;
+}
+
+static bool journal_replay_prgms() {
+    int4 id;
+    int nprogs;
+    if (!read_int4(&id) || !read_int(&nprogs) || nprogs < 0)
+        return false;
+    directory *dir = get_dir(id);
+    if (dir == NULL)
+        return true;
+    for (int i = 0; i < dir->prgms_count; i++) {
+        delete dir->prgms[i].eq_data;
+        dir->prgms[i].eq_data = NULL;
+        free(dir->prgms[i].text);
+        dir->prgms[i].text = NULL;
+    }
+    dir->prgms_count = 0;
+    directory *saved_cwd = cwd;
+    cwd = dir;
+    core_import_programs(nprogs, NULL);
+    rebuild_label_table();
+    cwd = saved_cwd;
+    return true;
+}
+
+static bool journal_replay_var(int type) {
+    int4 id;
+    unsigned char length;
+    char name[7];
+    if (!read_int4(&id) || !read_char((char *) &length) || length > 7
+            || fread(name, 1, length, gfile) != length)
+        return false;
+    vartype *v = NULL;
+    if (type == JOURNAL_STO && (!unpersist_vartype(&v) || v == NULL))
+        return false;
+    directory *dir = get_dir(id);
+    if (dir == NULL) {
+        free_vartype(v);
+        return true;
+    }
+    for (int i = 0; i < dir->vars_count; i++) {
+        var_struct *vs = dir->vars + i;
+        if (string_equals(vs->name, vs->length, name, length)) {
+            free_vartype(vs->value);
+            if (type == JOURNAL_STO) {
+                vs->value = v;
+            } else {
+                for (int j = i; j < dir->vars_count - 1; j++)
+                    dir->vars[j] = dir->vars[j + 1];
+                dir->vars_count--;
+            }
+            return true;
+        }
+    }
+    if (type == JOURNAL_PURGE)
+        return true;
+    if (dir->vars_count == dir->vars_capacity) {
+        int nc = dir->vars_capacity + 25;
+        var_struct *nv = (var_struct *) realloc(dir->vars, nc * sizeof(var_struct));
+        if (nv == NULL) {
+            free_vartype(v);
+            return false;
+        }
+        dir->vars_capacity = nc;
+        dir->vars = nv;
+    }
+    var_struct *vs = dir->vars + dir->vars_count++;
+    string_copy(vs->name, &vs->length, name, length);
+    vs->flags = 0;
+    vs->value = v;
+    return true;
+}
+
+/* Apply the journal open in gfile to the state that has just been loaded.
+ * Returns false if the journal does not belong to the loaded state, and
+ * should be discarded. '*compact' is set if the journal can't simply be
+ * appended to, because it ends in an incomplete record or was written by a
+ * different version or number format; the state should then be saved in
+ * full at the next checkpoint.
+ */
+bool journal_replay(bool *compact) {
+    *compact = false;
+    int4 magic, version;
+    int8 generation;
+    bool decimal;
+    if (state_generation == 0
+            || !read_int4(&magic) || magic != JOURNAL_MAGIC
+            || !read_int4(&version) || version < 25 || version > PLUS42_VERSION
+            || !read_int8(&generation) || generation != state_generation
+            || !read_bool(&decimal))
+        return false;
+
+    int4 saved_ver = ver;
+    int saved_format = state_file_number_format;
+    ver = version;
+    state_file_number_format = decimal ? NUMBER_FORMAT_BID128 : NUMBER_FORMAT_BINARY;
+    if (version != PLUS42_VERSION || bin_dec_mode_switch())
+        *compact = true;
+    int4 cwd_id = cwd->id;
+    pgm_index saved_prgm = current_prgm;
+    int4 saved_pc = pc;
+    bool prgms_changed = false;
+    loading_state = true;
+
+    while (true) {
+        long start = ftell(gfile);
+        int4 type, length;
+        if (!read_int4(&type)) {
+            // Clean end of the journal, unless there's a partial header
+            if (start == -1 || ftell(gfile) != start)
+                *compact = true;
+            break;
+        }
+        long pos = ftell(gfile);
+        int4 commit;
+        if (!read_int4(&length) || length < 0 || pos == -1
+                || fseek(gfile, pos + 4 + length, SEEK_SET) != 0
+                || !read_int4(&commit) || commit != JOURNAL_MAGIC
+                || fseek(gfile, pos + 4, SEEK_SET) != 0) {
+            *compact = true;
+            break;
+        }
+        bool success;
+        switch (type) {
+            case JOURNAL_DIR:
+                success = journal_replay_dir();
+                prgms_changed = true;
+                break;
+            case JOURNAL_PRGMS:
+                success = journal_replay_prgms();
+                prgms_changed = true;
+                break;
+            case JOURNAL_STO:
+            case JOURNAL_PURGE:
+                success = journal_replay_var(type);
+                break;
+            default:
+                success = true;
+                break;
+        }
+        shared_data_reset();
+        if (!success || fseek(gfile, pos + 8 + length, SEEK_SET) != 0) {
+            *compact = true;
+            break;
+        }
+    }
+
+    loading_state = false;
+    ver = saved_ver;
+    state_file_number_format = saved_format;
+    directory *dir = get_dir(cwd_id);
+    cwd = dir == NULL ? root : dir;
+    current_prgm = saved_prgm;
+    pc = saved_pc;
+    if (prgms_changed) {
+        // Return addresses and the program pointer may refer to programs
+        // that have since changed.
+        clear_all_rtns();
+        dir = get_dir(current_prgm.dir);
+        if (dir == NULL || current_prgm.idx >= dir->prgms_count) {
+            current_prgm.set(cwd->id, 0);
+            pc = -1;
+        } else if (pc >= dir->prgms[current_prgm.idx].size)
+            pc = -1;
+    }
+    return true;
+}
+
 // Reason:
 // 0 = Memory Clear
 // 1 = State File Corrupt
@@ -5091,6 +6030,9 @@ void hard_reset(int reason) {
     reset_math();
     eqn_end();
 
+    // Nothing to journal against until the new state has been saved
+    state_generation = 0;
+
     clear_display();
     clear_custom_menu();
     clear_prgm_menu();
@@ -363,6 +363,7 @@ extern const char *virtual_flags;
 #define VAR_HIDDEN  1
 #define VAR_HIDING  2
 #define VAR_PRIVATE 4
+#define VAR_DIRTY   8 /* Global changed since the last checkpoint */
 
 /* Variables */
 struct var_struct {
@@ -417,11 +418,18 @@ struct directory {
     int children_count;
     subdir_struct *children;
     directory *parent;
+    int dirty; /* DIR_DIRTY_* flags; see journal_write() */
     directory(int id);
     ~directory();
     directory *clone();
 };
 
+/* For directory.dirty */
+#define DIR_DIRTY_VARS  1 /* Variables flagged VAR_DIRTY were changed */
+#define DIR_DIRTY_PRGMS 2 /* Programs were changed */
+#define DIR_DIRTY_DIRS  4 /* Subdirectories were added, removed, or renamed */
+#define DIR_DIRTY_NEW   8 /* New directory; possibly reusing an old ID */
+
 extern directory *root;
 extern directory *cwd;
 extern directory *eq_dir;
@@ -688,6 +696,10 @@ bool write_arg(const arg_struct *arg);
 
 bool load_state(bool *clear, bool *too_new);
 bool save_state();
+extern int8 state_generation;
+void journal_rebase();
+bool journal_write(bool start);
+bool journal_replay(bool *compact);
 // Reason:
 // 0 = Memory Clear
 // 1 = State File Corrupt
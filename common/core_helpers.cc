@@ -464,6 +464,29 @@ bool string_equals(const char *s1, int s1len, const char *s2, int s2len) {
     return true;
 }
 
+/* FNV-1a hash of 'length' bytes; pass the result of a previous call as 'h'
+ * to continue hashing where it left off.
+ */
+uint4 fnv1a(const char *data, int length, uint4 h) {
+    for (int i = 0; i < length; i++) {
+        h ^= (unsigned char) data[i];
+        h *= 16777619U;
+    }
+    return h;
+}
+
+/* The 64-bit version, for fingerprints that are compared instead of
+ * looked up, where a collision would go unnoticed.
+ */
+uint8 fnv1a64(const void *data, size_t length, uint8 h) {
+    const unsigned char *p = (const unsigned char *) data;
+    for (size_t i = 0; i < length; i++) {
+        h ^= p[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
 int string_pos(const char *ntext, int nlen, const vartype *hs, int startpos) {
     int pos = -1;
     if (hs->type == TYPE_REAL) {
@@ -1556,19 +1579,19 @@ int dimension_array_ref(vartype *matrix, int4 rows, int4 columns) {
              */
             realmatrix_data *new_array;
             int4 i, s, oldsize;
-            new_array = (realmatrix_data *) malloc(sizeof(realmatrix_data));
+            new_array = (realmatrix_data *) slab_alloc(sizeof(realmatrix_data));
             if (new_array == NULL)
                 return ERR_INSUFFICIENT_MEMORY;
             new_array->data = (phloat *) malloc(size * sizeof(phloat));
             if (new_array->data == NULL) {
-                free(new_array);
+                slab_free(new_array, sizeof(realmatrix_data));
                 return ERR_INSUFFICIENT_MEMORY;
             }
             new_array->is_string = (char *) malloc(size);
             if (new_array->is_string == NULL) {
                 nomem:
                 free(new_array->data);
-                free(new_array);
+                slab_free(new_array, sizeof(realmatrix_data));
                 return ERR_INSUFFICIENT_MEMORY;
             }
             oldsize = oldmatrix->rows * oldmatrix->columns;
@@ -1630,12 +1653,12 @@ int dimension_array_ref(vartype *matrix, int4 rows, int4 columns) {
             complexmatrix_data *new_array;
             int4 i, s, oldsize;
             new_array = (complexmatrix_data *)
-                                        malloc(sizeof(complexmatrix_data));
+                                        slab_alloc(sizeof(complexmatrix_data));
             if (new_array == NULL)
                 return ERR_INSUFFICIENT_MEMORY;
             new_array->data = (phloat *) malloc(2 * size * sizeof(phloat));
             if (new_array->data == NULL) {
-                free(new_array);
+                slab_free(new_array, sizeof(complexmatrix_data));
                 return ERR_INSUFFICIENT_MEMORY;
             }
             oldsize = oldmatrix->rows * oldmatrix->columns;
@@ -2170,6 +2193,9 @@ vartype *matedit_get() {
             var_struct *gv = dir->vars + i;
             if (string_equals(matedit_name, matedit_length, gv->name, gv->length)) {
                 m = gv->value;
+                // The matrix editor changes it in place
+                gv->flags |= VAR_DIRTY;
+                dir->dirty |= DIR_DIRTY_VARS;
                 break;
             }
         }
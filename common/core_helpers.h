@@ -54,6 +54,9 @@ void string_copy(char *dst, unsigned char *dstlen, const char *src, int srclen);
 void string_copy(char *dst, unsigned short *dstlen, const char *src, int srclen);
 void string_copy(char *dst, int *dstlen, const char *src, int srclen);
 bool string_equals(const char *s1, int s1len, const char *s2, int s2len);
+uint4 fnv1a(const char *data, int length, uint4 h = 2166136261U);
+#define FNV1A64_BASIS 14695981039346656037ULL
+uint8 fnv1a64(const void *data, size_t length, uint8 h = FNV1A64_BASIS);
 int string_pos(const char *ntext, int nlen, const vartype *hs, int startpos);
 bool vartype_equals(const vartype *v1, const vartype *v2);
 int generic_comparison(const vartype *x, const vartype *y, char which);
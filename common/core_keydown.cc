@@ -1375,6 +1375,7 @@ void keydown_command_entry(int shift, int key) {
                     case 0: name = "LLIM"; length = 4; break;
                     case 1: name = "ULIM"; length = 4; break;
                     case 2: name = "ACC";  length = 3; break;
+                    case 3: name = "METH"; length = 4; break;
                     default: squeak(); return;
                 }
             } else {
@@ -3338,13 +3339,14 @@ void keydown_normal_mode(int shift, int key) {
                 }
                 return;
             } else if (menu == MENU_INTEG_PARAMS) {
-                if (menukey <= 2) {
+                if (menukey <= 3) {
                     const char *name;
                     int length;
                     switch (menukey) {
                         case 0: name = "LLIM"; length = 4; break;
                         case 1: name = "ULIM"; length = 4; break;
                         case 2: name = "ACC";  length = 3; break;
+                        case 3: name = "METH"; length = 4; break;
                     }
                     if (shift && !flags.f.prgm_mode)
                         view(name, length);
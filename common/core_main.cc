@@ -79,6 +79,62 @@ bool force_redisplay = false;
 
 core_settings_struct core_settings;
 
+/* Checkpoint journal of the currently loaded state; see journal_write() */
+#define JOURNAL_MAX_SIZE 262144
+static char *journal_state_file_name = NULL;
+static char *journal_file_name = NULL;
+static bool journal_started = false;
+static bool journal_compact = false;
+
+static void journal_set_file(const char *state_file_name) {
+    free(journal_state_file_name);
+    free(journal_file_name);
+    journal_state_file_name = NULL;
+    journal_file_name = NULL;
+    journal_started = false;
+    journal_compact = false;
+    if (state_file_name == NULL)
+        return;
+    journal_state_file_name = (char *) malloc(strlen(state_file_name) + 1);
+    journal_file_name = (char *) malloc(strlen(state_file_name) + 5);
+    if (journal_state_file_name == NULL || journal_file_name == NULL) {
+        free(journal_state_file_name);
+        free(journal_file_name);
+        journal_state_file_name = NULL;
+        journal_file_name = NULL;
+        return;
+    }
+    strcpy(journal_state_file_name, state_file_name);
+    sprintf(journal_file_name, "%s.jnl", state_file_name);
+}
+
+static bool is_journaled_state(const char *state_file_name) {
+    return journal_state_file_name != NULL
+            && strcmp(state_file_name, journal_state_file_name) == 0;
+}
+
+static int8 next_state_generation() {
+    uint4 date, time;
+    int weekday;
+    shell_get_time_date(&time, &date, &weekday);
+    int8 gen = (int8) date * 100000000 + time;
+    if (gen <= state_generation)
+        gen = state_generation + 1;
+    return gen;
+}
+
+static void replay_journal() {
+    if (journal_file_name == NULL || state_generation == 0)
+        return;
+    FILE *saved_gfile = gfile;
+    gfile = my_fopen(journal_file_name, "rb");
+    if (gfile != NULL) {
+        journal_started = journal_replay(&journal_compact);
+        fclose(gfile);
+    }
+    gfile = saved_gfile;
+}
+
 void core_init(int *rows, int *cols, int read_saved_state, const char *state_file_name) {
 
     /* Possible values for read_saved_state:
@@ -110,9 +166,13 @@ void core_init(int *rows, int *cols, int read_saved_state, const char *state_fil
     } else
         gfile = NULL;
 
+    journal_set_file(state_file_name);
+
     bool clear, too_new = false;
     int reason = 0;
-    if (read_saved_state != 1 || !load_state(&clear, &too_new)) {
+    if (read_saved_state == 1 && load_state(&clear, &too_new)) {
+        replay_journal();
+    } else {
         reason = too_new ? 2 : (read_saved_state != 0 && !clear) ? 1 : 0;
         requested_disp_r = 8;
         requested_disp_c = 22;
@@ -121,6 +181,7 @@ void core_init(int *rows, int *cols, int read_saved_state, const char *state_fil
         hard_reset(reason);
         force_redisplay = true;
     }
+    journal_rebase();
     if (gfile != NULL)
         fclose(gfile);
     if (state_file_name_crash != NULL) {
@@ -155,15 +216,112 @@ void core_save_state(const char *state_file_name) {
     shell_get_time_date(&time, &date, &weekday);
     sprintf(state_file_name_crash, "%s.%08u%08u.crash", state_file_name, date, time);
 
+    // Only a save of the loaded state starts a new journal; copies get no
+    // generation, so that no journal is ever applied to them.
+    bool base = is_journaled_state(state_file_name);
+    int8 saved_generation = state_generation;
+    state_generation = base ? next_state_generation() : 0;
+
+    bool success = false;
     gfile = my_fopen(state_file_name_crash, "wb");
     if (gfile != NULL) {
-        bool success = save_state();
+        success = save_state();
         fclose(gfile);
         if (success) {
             my_remove(state_file_name);
             my_rename(state_file_name_crash, state_file_name);
         }
     }
+    free(state_file_name_crash);
+
+    if (base && success) {
+        my_remove(journal_file_name);
+        journal_started = false;
+        journal_compact = false;
+        journal_rebase();
+    } else
+        state_generation = saved_generation;
+}
+
+bool core_snapshot_state(char **buf, size_t *size) {
+    if (mode_interruptible != NULL)
+        stop_interruptible();
+    set_running(false);
+
+    *buf = NULL;
+    *size = 0;
+#if defined(WINDOWS) || defined(IPHONE) || defined(ANDROID)
+    // No open_memstream() on all supported versions of these platforms;
+    // serialize to an anonymous temporary file and read it back instead.
+    gfile = tmpfile();
+#else
+    gfile = open_memstream(buf, size);
+#endif
+    if (gfile == NULL)
+        return false;
+    int8 saved_generation = state_generation;
+    state_generation = next_state_generation();
+    bool success = save_state();
+#if defined(WINDOWS) || defined(IPHONE) || defined(ANDROID)
+    if (success) {
+        long n = ftell(gfile);
+        *buf = (char *) malloc(n);
+        success = *buf != NULL;
+        if (success) {
+            rewind(gfile);
+            success = fread(*buf, 1, n, gfile) == n;
+            *size = n;
+        }
+    }
+    fclose(gfile);
+#else
+    fclose(gfile);
+#endif
+    gfile = NULL;
+    if (success) {
+        // The journal of the previous base is obsolete; the next checkpoint
+        // replaces it.
+        journal_started = false;
+        journal_compact = false;
+        journal_rebase();
+    } else {
+        state_generation = saved_generation;
+        free(*buf);
+        *buf = NULL;
+        *size = 0;
+    }
+    return success;
+}
+
+void core_checkpoint_state(const char *state_file_name) {
+    if (!is_journaled_state(state_file_name) || state_generation == 0 || journal_compact) {
+        core_save_state(state_file_name);
+        return;
+    }
+    bool success = false;
+    gfile = my_fopen(journal_file_name, journal_started ? "r+b" : "w+b");
+    if (gfile != NULL) {
+        if (!journal_started
+                || (fseek(gfile, 0, SEEK_END) == 0 && ftell(gfile) <= JOURNAL_MAX_SIZE))
+            success = journal_write(!journal_started);
+        if (fclose(gfile) != 0)
+            success = false;
+        gfile = NULL;
+    }
+    if (success)
+        journal_started = true;
+    else
+        // The journal may end in a partial record now, so don't append to
+        // it again; the next checkpoint replaces it with a full save.
+        journal_compact = true;
+}
+
+void core_rename_state(const char *state_file_name) {
+    bool started = journal_started;
+    bool compact = journal_compact;
+    journal_set_file(state_file_name);
+    journal_started = started;
+    journal_compact = compact;
 }
 
 void core_cleanup() {
@@ -182,6 +340,9 @@ void core_cleanup() {
     free_vartype(lastx);
     lastx = NULL;
     clear_rtns_vars_and_prgms();
+#ifdef FREE42_POOLSTATS
+    log_vartype_pool_stats();
+#endif
     clean_vartype_pools();
 }
 
@@ -210,9 +371,10 @@ void core_repaint_display(int rows, int cols, int sflags) {
         force_redisplay = true;
     }
 
-    if (display_alloc(rows, cols) || force_redisplay)
+    if (display_alloc(rows, cols) || force_redisplay) {
+        forget_shell_display();
         redisplay();
-    else
+    } else
         repaint_display();
     force_redisplay = false;
 }
@@ -674,7 +836,8 @@ bool core_keyup() {
         get_next_command(&pc, &cmd, &arg, 1, NULL);
         if (pending_command == CMD_SST_RT
                 && (cmd == CMD_XEQ || cmd == CMD_XEQL || cmd == CMD_EVAL
-                    || cmd == CMD_EVALN || cmd == CMD_SOLVE || cmd == CMD_INTEG)) {
+                    || cmd == CMD_EVALN || cmd == CMD_SOLVE || cmd == CMD_INTEG
+                    || cmd == CMD_VSOLVE || cmd == CMD_VINTEG || cmd == CMD_ROOTS)) {
             pc = oldpc;
             step_over();
             goto do_run;
@@ -1864,9 +2027,9 @@ static int hp42ext[] = {
     CMD_XAXIS   | 0x2000,
     CMD_YAXIS   | 0x2000,
     CMD_LCLV    | 0x2000,
-    CMD_NULL    | 0x4000,
-    CMD_NULL    | 0x4000,
-    CMD_NULL    | 0x4000,
+    CMD_VSOLVE  | 0x2000,
+    CMD_VINTEG  | 0x2000,
+    CMD_ROOTS   | 0x2000,
     CMD_NULL    | 0x4000,
     CMD_NULL    | 0x4000,
     CMD_NULL    | 0x4000,
@@ -1877,22 +2040,22 @@ static int hp42ext[] = {
     CMD_NULL    | 0x4000,
 
     /* 70-7F */
-    CMD_YAXIS | 0x0000,
-    CMD_LCLV  | 0x0000,
-    CMD_NULL  | 0x4000,
-    CMD_NULL  | 0x4000,
-    CMD_NULL  | 0x4000,
-    CMD_NULL  | 0x4000,
-    CMD_NULL  | 0x4000,
-    CMD_NULL  | 0x4000,
-    CMD_YAXIS | 0x1000,
-    CMD_LCLV  | 0x1000,
-    CMD_NULL  | 0x4000,
-    CMD_NULL  | 0x4000,
-    CMD_NULL  | 0x4000,
-    CMD_NULL  | 0x4000,
-    CMD_NULL  | 0x4000,
-    CMD_NULL  | 0x4000,
+    CMD_YAXIS  | 0x0000,
+    CMD_LCLV   | 0x0000,
+    CMD_VSOLVE | 0x0000,
+    CMD_VINTEG | 0x0000,
+    CMD_ROOTS  | 0x0000,
+    CMD_NULL   | 0x4000,
+    CMD_NULL   | 0x4000,
+    CMD_NULL   | 0x4000,
+    CMD_YAXIS  | 0x1000,
+    CMD_LCLV   | 0x1000,
+    CMD_VSOLVE | 0x1000,
+    CMD_VINTEG | 0x1000,
+    CMD_ROOTS  | 0x1000,
+    CMD_NULL   | 0x4000,
+    CMD_NULL   | 0x4000,
+    CMD_NULL   | 0x4000,
 
     /* 80-8F */
     CMD_VIEW    | 0x0000,
@@ -4914,7 +5077,7 @@ void core_paste(const char *buf) {
             free(hpbuf);
             if (is_string != NULL) {
                 vartype_realmatrix *rm = (vartype_realmatrix *)
-                                malloc(sizeof(vartype_realmatrix));
+                                slab_alloc(sizeof(vartype_realmatrix));
                 if (rm == NULL) {
                     free_long_strings(is_string, data, p);
                     free(data);
@@ -4924,9 +5087,9 @@ void core_paste(const char *buf) {
                     return;
                 }
                 rm->array = (realmatrix_data *)
-                                malloc(sizeof(realmatrix_data));
+                                slab_alloc(sizeof(realmatrix_data));
                 if (rm->array == NULL) {
-                    free(rm);
+                    slab_free(rm, sizeof(vartype_realmatrix));
                     free_long_strings(is_string, data, p);
                     free(data);
                     free(is_string);
@@ -4943,7 +5106,7 @@ void core_paste(const char *buf) {
                 v = (vartype *) rm;
             } else {
                 vartype_complexmatrix *cm = (vartype_complexmatrix *)
-                                malloc(sizeof(vartype_complexmatrix));
+                                slab_alloc(sizeof(vartype_complexmatrix));
                 if (cm == NULL) {
                     free(data);
                     display_error(ERR_INSUFFICIENT_MEMORY, false);
@@ -4951,9 +5114,9 @@ void core_paste(const char *buf) {
                     return;
                 }
                 cm->array = (complexmatrix_data *)
-                                malloc(sizeof(complexmatrix_data));
+                                slab_alloc(sizeof(complexmatrix_data));
                 if (cm->array == NULL) {
-                    free(cm);
+                    slab_free(cm, sizeof(vartype_complexmatrix));
                     free(data);
                     display_error(ERR_INSUFFICIENT_MEMORY, false);
                     redisplay();
@@ -4997,6 +5160,9 @@ void set_running(bool state) {
         input_length = 0;
         mode_goose = -2;
         move_prgm_highlight(1);
+    } else {
+        /* An interrupted plot writes its state back to PPAR */
+        flush_plot_state();
     }
 }
 
@@ -5198,45 +5364,100 @@ static synonym_spec hp41_synonyms[] =
     { "",       true,  0, CMD_NONE    }
 };
 
-int find_builtin(const char *name, int namelen) {
-    int i, j;
+/* Command name lookup
+ * find_builtin() runs for every line of every program that is pasted or
+ * imported as text, so rather than scanning hp41_synonyms and cmd_array,
+ * it probes two open-addressing hash tables, built on first use. The entries
+ * hold indexes into hp41_synonyms or cmd_array plus one, so zero means empty.
+ * Synonyms are matched exactly; command names are matched and hashed with
+ * undefined characters folded to 7 bits and the up-arrow as caret. Where
+ * several entries have the same name, the first one wins, as before.
+ */
+#define SYN_HASH_SIZE 128
+#define CMD_HASH_SIZE 2048
+
+static short syn_hash[SYN_HASH_SIZE];
+static short cmd_hash[CMD_HASH_SIZE];
+static bool builtin_hash_built = false;
+
+static unsigned char builtin_fold(unsigned char c) {
+    if (undefined_char(c))
+        return c & 127;
+    else if (c == 30)
+        return 94;
+    else
+        return c;
+}
 
-    for (i = 0; hp41_synonyms[i].cmd_id != CMD_NONE; i++) {
-        if (namelen != hp41_synonyms[i].namelen)
-            continue;
-        for (j = 0; j < namelen; j++)
-            if (name[j] != hp41_synonyms[i].name[j])
-                goto nomatch1;
-        return hp41_synonyms[i].cmd_id;
-        nomatch1:;
+static uint4 builtin_fold_hash(const char *name, int namelen) {
+    // Command names fit in one buffer; longer names can't match anything,
+    // but still get a hash
+    char buf[16];
+    uint4 h = fnv1a(NULL, 0);
+    for (int i = 0; i < namelen; i += 16) {
+        int n = namelen - i < 16 ? namelen - i : 16;
+        for (int j = 0; j < n; j++)
+            buf[j] = (char) builtin_fold(name[i + j]);
+        h = fnv1a(buf, n, h);
     }
+    return h;
+}
 
-    for (i = 0; true; i++) {
-        if (i == CMD_SENTINEL)
+static int syn_hash_slot(const char *name, int namelen) {
+    int mask = SYN_HASH_SIZE - 1;
+    int i = (int) (fnv1a(name, namelen) & mask);
+    while (syn_hash[i] != 0) {
+        synonym_spec *ss = hp41_synonyms + syn_hash[i] - 1;
+        if (ss->namelen == namelen && memcmp(ss->name, name, namelen) == 0)
             break;
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+static int cmd_hash_slot(const char *name, int namelen) {
+    int mask = CMD_HASH_SIZE - 1;
+    int i = (int) (builtin_fold_hash(name, namelen) & mask);
+    while (cmd_hash[i] != 0) {
+        const command_spec *cs = cmd_array + cmd_hash[i] - 1;
+        if (cs->name_length == namelen) {
+            int j;
+            for (j = 0; j < namelen; j++)
+                if (builtin_fold(name[j]) != builtin_fold(cs->name[j]))
+                    break;
+            if (j == namelen)
+                break;
+        }
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+static void build_builtin_hash() {
+    int i, slot;
+    for (i = 0; hp41_synonyms[i].cmd_id != CMD_NONE; i++) {
+        slot = syn_hash_slot(hp41_synonyms[i].name, hp41_synonyms[i].namelen);
+        if (syn_hash[slot] == 0)
+            syn_hash[slot] = i + 1;
+    }
+    for (i = 0; i < CMD_SENTINEL; i++) {
         if ((cmd_array[i].flags & FLAG_HIDDEN) != 0)
             continue;
-        if (cmd_array[i].name_length != namelen)
-            continue;
-        for (j = 0; j < namelen; j++) {
-            unsigned char c1, c2;
-            c1 = name[j];
-            if (undefined_char(c1))
-                c1 &= 127;
-            else if (c1 == 30)
-                c1 = 94;
-            c2 = cmd_array[i].name[j];
-            if (undefined_char(c2))
-                c2 &= 127;
-            else if (c2 == 30)
-                c2 = 94;
-            if (c1 != c2)
-                goto nomatch2;
-        }
-        return i;
-        nomatch2:;
+        slot = cmd_hash_slot(cmd_array[i].name, cmd_array[i].name_length);
+        if (cmd_hash[slot] == 0)
+            cmd_hash[slot] = i + 1;
     }
-    return CMD_NONE;
+    builtin_hash_built = true;
+}
+
+int find_builtin(const char *name, int namelen) {
+    if (!builtin_hash_built)
+        build_builtin_hash();
+    int i = syn_hash[syn_hash_slot(name, namelen)];
+    if (i != 0)
+        return hp41_synonyms[i - 1].cmd_id;
+    i = cmd_hash[cmd_hash_slot(name, namelen)];
+    return i == 0 ? CMD_NONE : i - 1;
 }
 
 void sst() {
@@ -5646,7 +5867,8 @@ static int handle_error(int error) {
                     error = return_to_plot(true, stop);
                 if (error == ERR_STOP)
                     set_running(false);
-                if (error == ERR_NONE || error == ERR_RUN || error == ERR_STOP)
+                if (error == ERR_NONE || error == ERR_RUN || error == ERR_STOP
+                        || error == ERR_INTERRUPTIBLE)
                     return 0;
             }
             handle_it:
@@ -5723,7 +5945,8 @@ static int handle_error(int error) {
                     error = return_to_solve(true, stop);
                 else
                     error = return_to_plot(true, stop);
-                if (error == ERR_NONE || error == ERR_RUN || error == ERR_STOP)
+                if (error == ERR_NONE || error == ERR_RUN || error == ERR_STOP
+                        || error == ERR_INTERRUPTIBLE)
                     goto noerr;
             }
             handle_it_2:
@@ -18,6 +18,7 @@
 #ifndef CORE_MAIN_H
 #define CORE_MAIN_H 1
 
+#include <stddef.h>
 #include "free42.h"
 
 
@@ -38,6 +39,8 @@
  * If the read_state parameter is 1, the core should read saved state from the
  * file named by the state_file_name parameter; if read_state is 0, or if there
  * is a problem reading the saved state, it should perform a hard reset.
+ * After reading the state, any changes recorded by core_checkpoint_state() in
+ * the journal next to it are applied as well.
  */
 void core_init(int *rows, int *cols, int read_state, const char *state_file_name);
 
@@ -50,6 +53,42 @@ void core_init(int *rows, int *cols, int read_state, const char *state_file_name
  */
 void core_save_state(const char *state_file_name);
 
+/* core_snapshot_state()
+ *
+ * This function serializes the simulator's persistent state, in the same
+ * format written by core_save_state(), into a newly allocated memory buffer,
+ * which the caller must free(). This allows the shell to perform the actual
+ * file I/O in the background. Like core_save_state(), it stops any running
+ * program first.
+ * The snapshot becomes the new base for core_checkpoint_state(), so the shell
+ * should make sure it has been written before the next checkpoint.
+ * Returns 'true' on success; on failure, *buf is set to NULL.
+ */
+bool core_snapshot_state(char **buf, size_t *size);
+
+/* core_checkpoint_state()
+ *
+ * This function makes the current state durable without rewriting all of it:
+ * changes to variables, programs, and directories since the last checkpoint
+ * or full save are appended to a journal, named by appending ".jnl" to
+ * state_file_name. Other state, like the stack and modes, is restored as of
+ * the last full save. When the journal grows too large, this calls
+ * core_save_state() instead, and starts a new journal. When writing the
+ * journal fails, nothing else is saved; the next call does a full save.
+ * This is cheap enough to call after every program run. Unlike
+ * core_save_state(), it does not stop running programs, so it should be
+ * called when the calculator is idle.
+ */
+void core_checkpoint_state(const char *state_file_name);
+
+/* core_rename_state()
+ *
+ * The shell calls this after renaming the file the current state was loaded
+ * from, and its journal along with it, so that core_checkpoint_state() keeps
+ * appending to the journal under its new name.
+ */
+void core_rename_state(const char *state_file_name);
+
 /* core_cleanup()
  *
  * This function deletes the emulator core state from memory. It may be called
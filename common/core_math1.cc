@@ -16,6 +16,13 @@
  *****************************************************************************/
 
 #include <stdlib.h>
+#include <string.h>
+#include <new>
+#include <vector>
+#ifndef BCD_MATH
+#include <atomic>
+#include <thread>
+#endif
 
 #include "core_math1.h"
 #include "core_commands2.h"
@@ -30,6 +37,12 @@
 #include "shell.h"
 
 #define NUM_SHADOWS 10
+// Open-addressing hash table over the shadow slots, keyed by name. The
+// entries hold slot indexes plus one, so zero means empty.
+#define SHADOW_HASH_SIZE 32
+
+static int return_to_sweep(int err, bool stop);
+static int return_to_roots(bool failure);
 
 struct caller_info {
     int keep_running;
@@ -49,6 +62,8 @@ struct caller_info {
             return return_to_plot(err != ERR_NONE, err == ERR_NONE && !keep_running);
         } else if (prev_prgm.idx == -3) {
             return return_to_integ(err == ERR_NONE && !keep_running);
+        } else if (prev_prgm.idx == -6) {
+            return return_to_sweep(err, err == ERR_NONE && !keep_running);
         } else {
             current_prgm = prev_prgm;
             pc = prev_pc;
@@ -84,17 +99,24 @@ struct solve_state {
     char shadow_name[NUM_SHADOWS][7];
     int shadow_length[NUM_SHADOWS];
     vartype *shadow_value[NUM_SHADOWS];
+    signed char shadow_hash[SHADOW_HASH_SIZE];
     uint4 last_disp_time;
     int prev_sp;
     vartype *param_unit;
     phloat f_gap;
     int f_gap_worsening_counter;
-    solve_state() : eq(NULL), active_eq(NULL), saved_t(NULL), param_unit(NULL) {
+    NumericCode *deriv;
+    int deriv_slot;
+    bool deriv_tried;
+    phloat newton_dx;
+    int newton_misses;
+    solve_state() : eq(NULL), active_eq(NULL), saved_t(NULL), param_unit(NULL), deriv(NULL) {
         prgm_length = 0;
         for (int i = 0; i < NUM_SHADOWS; i++) {
             shadow_length[i] = 0;
             shadow_value[i] = NULL;
         }
+        memset(shadow_hash, 0, sizeof(shadow_hash));
     }
 };
 
@@ -104,6 +126,20 @@ static solve_state solve;
 // 1/2 million evals max!
 #define ROMB_MAX 20
 
+/* Integration methods, selected by the METH variable */
+#define INTEG_ROMBERG 0
+#define INTEG_G7K15 1
+#define INTEG_TANH_SINH 2
+
+// Adaptive G7K15: maximum bisection depth, and at most 32768
+// intervals, which is again about 1/2 million evals
+#define GK_DEPTH 30
+#define GK_MAX 32768
+
+// Tanh-sinh: abscissae for |t| <= TS_T, at most TS_MAX halvings of h
+#define TS_T 4
+#define TS_MAX 12
+
 /* Integrator */
 struct integ_state {
     int version;
@@ -132,16 +168,70 @@ struct integ_state {
     int prev_sp;
     vartype *param_unit;
     vartype *result_unit;
+    int method;
+    // G7K15: Gauss sum for the current interval, and the right halves
+    // still waiting to be integrated (left end and bisection depth)
+    phloat gk_g;
+    int gk_top;
+    phloat gk_x[GK_DEPTH];
+    int gk_d[GK_DEPTH];
     integ_state() : eq(NULL), active_eq(NULL), saved_t(NULL), param_unit(NULL), result_unit(NULL) {
         prgm_length = 0;
+        method = INTEG_ROMBERG;
+        gk_g = 0;
+        gk_top = 0;
+        for (int i = 0; i < GK_DEPTH; i++) {
+            gk_x[i] = 0;
+            gk_d[i] = 0;
+        }
     }
 };
 
 static integ_state integ;
 
+/* VSOLVE and VINTEG: SOLVE or INTEG repeated for each row of a matrix of
+ * parameter values. Rows that can't be done natively are done one at a
+ * time by the regular solver or integrator, which report back through
+ * return_to_sweep(); 'todo' lists those rows (for VSOLVE, all rows, since
+ * the native results are checked in order), and 'pos' is the one being
+ * worked on.
+ * ROOTS uses the same state: 'params' holds the function values at the
+ * sample points, 'results' the root found in each sample interval (or NaN),
+ * and 'todo' the intervals that still have to be handed to the solver;
+ * while sampling through the interpreter, 'pos' is the sample point.
+ * ROOTS has no 'names'; in its place in the state file is 'saved_y'.
+ */
+struct sweep_state {
+    int kind;
+    char var_name[7];
+    int var_length;
+    vartype *names;
+    vartype *params;
+    vartype *results;
+    std::vector<int4> todo;
+    int4 pos;
+    caller_info caller;
+    int prev_sp;
+    vartype *saved_y;
+    vartype *saved_z;
+    vartype *saved_t;
+    // ROOTS: the interval, and the number of sample points
+    phloat lo, hi;
+    int4 n;
+    // Whether the last row finished was done natively
+    bool last_native;
+    sweep_state() : kind(0), names(NULL), params(NULL), results(NULL), saved_y(NULL), saved_z(NULL), saved_t(NULL), last_native(false) {}
+};
+
+static sweep_state sweep;
+
 
 static void reset_solve();
 static void reset_integ();
+static void rebuild_shadow_hash();
+static bool sweep_active();
+static void sweep_end();
+static void sweep_batch_finish();
 
 
 bool persist_math() {
@@ -240,6 +330,36 @@ bool persist_math() {
     if (!write_int(integ.prev_sp)) return false;
     if (!persist_vartype(integ.param_unit)) return false;
     if (!persist_vartype(integ.result_unit)) return false;
+    if (!write_int(integ.method)) return false;
+    if (!write_phloat(integ.gk_g)) return false;
+    if (!write_int(integ.gk_top)) return false;
+    for (int i = 0; i < GK_DEPTH; i++) {
+        if (!write_phloat(integ.gk_x[i])) return false;
+        if (!write_int(integ.gk_d[i])) return false;
+    }
+
+    if (!sweep_active())
+        return write_int(0);
+    if (!write_int(sweep.kind)) return false;
+    if (fwrite(sweep.var_name, 1, 7, gfile) != 7) return false;
+    if (!write_int(sweep.var_length)) return false;
+    if (!persist_vartype(sweep.kind == SWEEP_ROOTS ? sweep.saved_y : sweep.names)) return false;
+    if (!persist_vartype(sweep.params)) return false;
+    if (!persist_vartype(sweep.results)) return false;
+    if (!write_int4((int4) sweep.todo.size())) return false;
+    for (size_t i = 0; i < sweep.todo.size(); i++)
+        if (!write_int4(sweep.todo[i])) return false;
+    if (!write_int4(sweep.pos)) return false;
+    if (!write_int(sweep.caller.keep_running)) return false;
+    if (!write_int4(sweep.caller.prev_prgm.dir)) return false;
+    if (!write_int4(sweep.caller.prev_prgm.idx)) return false;
+    if (!write_int4(global_pc2line(sweep.caller.prev_prgm, sweep.caller.prev_pc))) return false;
+    if (!write_int(sweep.prev_sp)) return false;
+    if (!persist_vartype(sweep.saved_z)) return false;
+    if (!persist_vartype(sweep.saved_t)) return false;
+    if (!write_phloat(sweep.lo)) return false;
+    if (!write_phloat(sweep.hi)) return false;
+    if (!write_int4(sweep.n)) return false;
     return true;
 }
 
@@ -304,6 +424,7 @@ bool unpersist_math(int ver) {
             if (!unpersist_vartype(&solve.shadow_value[i])) return false;
         }
     }
+    rebuild_shadow_hash();
     if (!read_int4((int4 *) &solve.last_disp_time)) return false;
     if (!read_int(&solve.prev_sp)) return false;
     if (ver < 8) {
@@ -312,6 +433,11 @@ bool unpersist_math(int ver) {
         if (!unpersist_vartype(&solve.param_unit)) return false;
     }
     solve.f_gap = NAN_PHLOAT;
+    delete solve.deriv;
+    solve.deriv = NULL;
+    solve.deriv_tried = false;
+    solve.newton_dx = NAN_PHLOAT;
+    solve.newton_misses = 0;
 
     if (!read_int(&integ.version)) return false;
     if (!unpersist_vartype(&integ.eq)) return false;
@@ -365,12 +491,69 @@ bool unpersist_math(int ver) {
         if (!unpersist_vartype(&integ.param_unit)) return false;
         if (!unpersist_vartype(&integ.result_unit)) return false;
     }
+    if (ver < 26) {
+        integ.method = INTEG_ROMBERG;
+        integ.gk_g = 0;
+        integ.gk_top = 0;
+    } else {
+        if (!read_int(&integ.method)) return false;
+        if (!read_phloat(&integ.gk_g)) return false;
+        if (!read_int(&integ.gk_top)) return false;
+        for (int i = 0; i < GK_DEPTH; i++) {
+            if (!read_phloat(&integ.gk_x[i])) return false;
+            if (!read_int(&integ.gk_d[i])) return false;
+        }
+    }
+
+    sweep_end();
+    if (ver < 27)
+        return true;
+    if (!read_int(&sweep.kind)) return false;
+    if (sweep.kind == 0)
+        return true;
+    if (fread(sweep.var_name, 1, 7, gfile) != 7) return false;
+    if (!read_int(&sweep.var_length)) return false;
+    if (!unpersist_vartype(sweep.kind == SWEEP_ROOTS ? &sweep.saved_y : &sweep.names)) return false;
+    if (!unpersist_vartype(&sweep.params)) return false;
+    if (!unpersist_vartype(&sweep.results)) return false;
+    if (sweep.params == NULL || sweep.params->type != TYPE_REALMATRIX)
+        return false;
+    int4 rows = ((vartype_realmatrix *) sweep.params)->rows;
+    int4 n;
+    if (!read_int4(&n) || n < 0 || n > rows) return false;
+    try {
+        sweep.todo.reserve(rows);
+        sweep.todo.resize(n);
+    } catch (std::bad_alloc &) {
+        return false;
+    }
+    for (int4 i = 0; i < n; i++)
+        if (!read_int4(&sweep.todo[i]) || sweep.todo[i] < 0 || sweep.todo[i] >= rows)
+            return false;
+    if (!read_int4(&sweep.pos) || sweep.pos < 0 || sweep.pos > rows) return false;
+    if (!read_int(&sweep.caller.keep_running)) return false;
+    if (!read_int4(&dir)) return false;
+    if (!read_int4(&idx)) return false;
+    sweep.caller.prev_prgm.set(dir, idx);
+    if (!read_int4(&sweep.caller.prev_pc)) return false;
+    sweep.caller.prev_pc = global_line2pc(sweep.caller.prev_prgm, sweep.caller.prev_pc);
+    if (!read_int(&sweep.prev_sp)) return false;
+    if (!unpersist_vartype(&sweep.saved_z)) return false;
+    if (!unpersist_vartype(&sweep.saved_t)) return false;
+    if (ver >= 28) {
+        if (!read_phloat(&sweep.lo)) return false;
+        if (!read_phloat(&sweep.hi)) return false;
+        if (!read_int4(&sweep.n)) return false;
+    }
+    if (sweep.kind == SWEEP_ROOTS && sweep.n != rows)
+        return false;
     return true;
 }
 
 void reset_math() {
     reset_solve();
     reset_integ();
+    sweep_end();
 }
 
 void clean_stack(int prev_sp) {
@@ -399,6 +582,7 @@ static void reset_solve() {
     int i;
     for (i = 0; i < NUM_SHADOWS; i++)
         solve.shadow_length[i] = 0;
+    rebuild_shadow_hash();
     free_vartype(solve.eq);
     solve.eq = NULL;
     solve.prgm_length = 0;
@@ -410,18 +594,40 @@ static void reset_solve() {
     solve.state = 0;
     free_vartype(solve.param_unit);
     solve.param_unit = NULL;
+    delete solve.deriv;
+    solve.deriv = NULL;
     if (mode_appmenu == MENU_SOLVE)
         set_menu_return_err(MENULEVEL_APP, MENU_NONE, true);
     solve.caller.prev_prgm.set(root->id, 0);
 }
 
+static int shadow_hash_slot(const char *name, int length) {
+    int mask = SHADOW_HASH_SIZE - 1;
+    int i = (int) (fnv1a(name, length) & mask);
+    while (solve.shadow_hash[i] != 0) {
+        int s = solve.shadow_hash[i] - 1;
+        if (string_equals(solve.shadow_name[s], solve.shadow_length[s], name, length))
+            break;
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+/* The slots are kept in order of age, which is also the order in which they
+ * are persisted, so inserting and removing shift them around; with only
+ * NUM_SHADOWS of them, simply rebuilding the hash table afterwards is
+ * cheaper than keeping it up to date along the way.
+ */
+static void rebuild_shadow_hash() {
+    memset(solve.shadow_hash, 0, sizeof(solve.shadow_hash));
+    for (int i = 0; i < NUM_SHADOWS; i++)
+        if (solve.shadow_length[i] != 0)
+            solve.shadow_hash[shadow_hash_slot(solve.shadow_name[i],
+                                               solve.shadow_length[i])] = i + 1;
+}
+
 static int find_shadow(const char *name, int length) {
-    int i;
-    for (i = 0; i < NUM_SHADOWS; i++)
-        if (string_equals(solve.shadow_name[i], solve.shadow_length[i],
-                          name, length))
-            return i;
-    return -1;
+    return solve.shadow_hash[shadow_hash_slot(name, length)] - 1;
 }
 
 void put_shadow(const char *name, int length, vartype *value) {
@@ -442,6 +648,7 @@ void put_shadow(const char *name, int length, vartype *value) {
     do_insert:
     string_copy(solve.shadow_name[i], &solve.shadow_length[i], name, length);
     solve.shadow_value[i] = dup_vartype(value);
+    rebuild_shadow_hash();
 }
 
 vartype *get_shadow(const char *name, int length) {
@@ -465,6 +672,7 @@ void remove_shadow(const char *name, int length) {
     }
     solve.shadow_value[NUM_SHADOWS - 1] = NULL;
     solve.shadow_length[NUM_SHADOWS - 1] = 0;
+    rebuild_shadow_hash();
 }
 
 void set_solve_prgm(const char *name, int length) {
@@ -701,6 +909,11 @@ static int start_solve_2(vartype *v1, vartype *v2, bool after_direct) {
     solve.toggle = 1;
     solve.secant_impatience = 0;
     solve.f_gap = NAN_PHLOAT;
+    delete solve.deriv;
+    solve.deriv = NULL;
+    solve.deriv_tried = false;
+    solve.newton_dx = NAN_PHLOAT;
+    solve.newton_misses = 0;
     if (!after_direct)
         solve.caller.keep_running = !should_i_stop_at_this_level() && program_running();
     return call_solve_fn(1, 1);
@@ -771,6 +984,8 @@ static int finish_solve(int message) {
     solve.active_eq = NULL;
     free_vartype(solve.saved_t);
     solve.saved_t = NULL;
+    delete solve.deriv;
+    solve.deriv = NULL;
 
     clean_stack(solve.prev_sp);
     if (solve.param_unit == NULL) {
@@ -860,8 +1075,66 @@ static void track_f_gap() {
     solve.f_gap = gap;
 }
 
+/* When the function being solved is an equation with a NumericCode form,
+ * and the equation's variables are all real, the solver takes safeguarded
+ * Newton steps, using the derivative computed from the equation's parse
+ * tree. The function values themselves still come from the interpreter.
+ */
+static bool solve_derivative(phloat x, phloat *d) {
+    if (!solve.deriv_tried) {
+        solve.deriv_tried = true;
+        if (solve.active_eq != NULL && solve.var_length > 0 && solve.param_unit == NULL) {
+            equation_data *eqd = ((vartype_equation *) solve.active_eq)->data;
+            NumericCode *code = new (std::nothrow) NumericCode;
+            if (code != NULL && eqd->ev->generateNumericCode(code))
+                solve.deriv_slot = code->slot(std::string(solve.var_name, solve.var_length));
+            else
+                solve.deriv_slot = -1;
+            if (solve.deriv_slot == -1)
+                delete code;
+            else
+                solve.deriv = code;
+        }
+    }
+    if (solve.deriv == NULL)
+        return false;
+    std::vector<phloat> vals(solve.deriv->vars.size());
+    for (int i = 0; i < (int) vals.size(); i++) {
+        if (i == solve.deriv_slot) {
+            vals[i] = x;
+            continue;
+        }
+        const std::string &name = solve.deriv->vars[i];
+        vartype *v = recall_var(name.c_str(), (int) name.length());
+        if (v == NULL || v->type != TYPE_REAL)
+            return false;
+        vals[i] = ((vartype_real *) v)->x;
+    }
+    phloat f;
+    return solve.deriv->eval(vals.data(), &f, solve.deriv_slot, d) && *d != 0;
+}
+
+/* Newton step from whichever of x1 and x2 has the smaller function value */
+static bool newton_step(phloat *xnew, phloat *step, phloat *xfrom = NULL) {
+    phloat xb, fb, d;
+    if (fabs(solve.fx1) < fabs(solve.fx2)) {
+        xb = solve.x1;
+        fb = solve.fx1;
+    } else {
+        xb = solve.x2;
+        fb = solve.fx2;
+    }
+    if (!solve_derivative(xb, &d))
+        return false;
+    *step = fb / d;
+    *xnew = xb - *step;
+    if (xfrom != NULL)
+        *xfrom = xb;
+    return !p_isnan(*xnew) && p_isinf(*xnew) == 0;
+}
+
 int return_to_solve(bool failure, bool stop) {
-    phloat f, slope, s, xnew, prev_f = solve.curr_f;
+    phloat f, slope, s, xnew, xfrom, prev_f = solve.curr_f;
     uint4 now_time;
 
     if (stop)
@@ -943,6 +1216,9 @@ int return_to_solve(bool failure, bool stop) {
         return solve.caller.ret(ERR_NONE);
     }
 
+    if (solve.state == 9)
+        // Sampling for ROOTS
+        return return_to_roots(failure);
     if (solve.state == 0)
         return ERR_INTERNAL_ERROR;
     if (!failure) {
@@ -1201,6 +1477,14 @@ int return_to_solve(bool failure, bool stop) {
                     || (solve.fx1 < 0 && solve.fx2 > 0))
                 goto do_ridders;
             slope = (solve.fx2 - solve.fx1) / (solve.x2 - solve.x1);
+            /* Prefer the Newton step, unless it disagrees with the secant
+             * about which way is down, which happens near an extremum.
+             */
+            if (newton_step(&xnew, &s, &xfrom) && xnew != solve.x1 && xnew != solve.x2
+                    && ((xnew > xfrom) == (solve.x1 - solve.fx1 / slope > solve.x1))) {
+                solve.x3 = xnew;
+                goto limit_x3;
+            }
             if (p_isinf(slope)) {
                 solve.x3 = (solve.x1 + solve.x2) / 2;
                 if (solve.x3 == solve.x1 || solve.x3 == solve.x2)
@@ -1253,6 +1537,7 @@ int return_to_solve(bool failure, bool stop) {
                     solve.prev_x = solve.x1;
                     return finish_solve(SOLVE_NOT_SURE);
                 }
+                limit_x3:
                 /* If we're extrapolating, make sure we don't race away from
                  * the current interval too quickly */
                 if (solve.x3 < solve.x1) {
@@ -1356,6 +1641,32 @@ int return_to_solve(bool failure, bool stop) {
             }
             track_f_gap();
             do_ridders:
+            /* Take the Newton step if it stays inside the interval and
+             * shrinks at least as fast as bisection would; otherwise, fall
+             * back on Ridders' method.
+             */
+            if (newton_step(&xnew, &s, &xfrom)) {
+                if (p_isnan(solve.newton_dx))
+                    solve.newton_dx = solve.x2 - solve.x1;
+                if (xnew == xfrom) {
+                    // Step too small to change x; can't do any better
+                    solve.which = -1;
+                    return finish_solve(SOLVE_NOT_SURE);
+                }
+                if (xnew > solve.x1 && xnew < solve.x2 && fabs(s) * 2 <= solve.newton_dx) {
+                    solve.newton_dx = fabs(s);
+                    solve.x3 = xnew;
+                    return call_solve_fn(3, 4);
+                }
+                solve.newton_dx = (solve.x2 - solve.x1) / 2;
+                /* Newton converges only linearly near a multiple root;
+                 * when it keeps falling short, stick with Ridders.
+                 */
+                if (++solve.newton_misses == 3) {
+                    delete solve.deriv;
+                    solve.deriv = NULL;
+                }
+            }
             solve.x3 = (solve.x1 + solve.x2) / 2;
             // TODO: The following termination condition should really be
             //
@@ -1519,6 +1830,37 @@ static int call_integ_fn() {
     }
 }
 
+/* Set up the integrator's state for the limits, accuracy, and method
+ * in 'st', leaving it ready for integ_step().
+ */
+static void integ_setup(integ_state *st) {
+    st->a = st->llim;
+    st->b = st->ulim - st->llim;
+    st->prev_int = 0;
+    st->prev_res = 0;
+    if (st->method == INTEG_G7K15) {
+        st->p = st->a;
+        st->t = st->b;
+        st->m = 0;
+        st->h = 0;
+        st->eps = 0;
+        st->nsteps = 0;
+        st->gk_top = 0;
+        st->state = 3;
+    } else if (st->method == INTEG_TANH_SINH) {
+        st->h = 1;
+        st->n = 0;
+        st->state = 5;
+    } else {
+        st->h = 2;
+        st->nsteps = 1;
+        st->n = 1;
+        st->state = 1;
+        st->s[0] = 0;
+        st->k = 1;
+    }
+}
+
 int start_integ(int prev, const char *name, int length, vartype *solve_info) {
     if (integ_active())
         return ERR_INTEG_INTEG;
@@ -1565,6 +1907,20 @@ int start_integ(int prev, const char *name, int length, vartype *solve_info) {
         integ.acc = ((vartype_real *) acc)->x;
     if (integ.acc < 0)
         integ.acc = 0;
+
+    vartype *meth = recall_var("METH", 4);
+    if (meth == NULL)
+        integ.method = INTEG_ROMBERG;
+    else if (meth->type == TYPE_STRING)
+        return ERR_ALPHA_DATA_IS_INVALID;
+    else if (meth->type != TYPE_REAL)
+        return ERR_INVALID_TYPE;
+    else {
+        phloat m = ((vartype_real *) meth)->x;
+        if (m < 0 || m > 2 || m != floor(m))
+            return ERR_INVALID_DATA;
+        integ.method = to_int(m);
+    }
     string_copy(integ.var_name, &integ.var_length, name, length);
     string_copy(integ.active_prgm_name, &integ.active_prgm_length,
                 integ.prgm_name, integ.prgm_length);
@@ -1589,16 +1945,7 @@ int start_integ(int prev, const char *name, int length, vartype *solve_info) {
     integ.caller.set(prev);
     integ.prev_sp = flags.f.big_stack ? sp : -2;
 
-    integ.a = integ.llim;
-    integ.b = integ.ulim - integ.llim;
-    integ.h = 2;
-    integ.prev_int = 0;
-    integ.nsteps = 1;
-    integ.n = 1;
-    integ.state = 1;
-    integ.s[0] = 0;
-    integ.k = 1;
-    integ.prev_res = 0;
+    integ_setup(&integ);
 
     integ.caller.keep_running = !should_i_stop_at_this_level() && program_running();
     if (!integ.caller.keep_running)
@@ -1614,7 +1961,7 @@ static int finish_integ() {
     clean_stack(integ.prev_sp);
     if (integ.param_unit == NULL && (integ.result_unit == NULL || integ.result_unit->type == TYPE_REAL)) {
         real_result:
-        x = new_real(integ.sum * integ.b * 0.75);
+        x = new_real(integ.prev_res);
         y = new_real(integ.eps);
     } else {
         std::string pu("1"), ru("1");
@@ -1629,7 +1976,7 @@ static int finish_integ() {
         normalize_unit(pu + "*" + ru, &ru);
         if (ru == "")
             goto real_result;
-        x = new_unit(integ.sum * integ.b * 0.75, ru.c_str(), ru.length());
+        x = new_unit(integ.prev_res, ru.c_str(), ru.length());
         y = new_unit(integ.eps, ru.c_str(), ru.length());
     }
     if (x == NULL || y == NULL) {
@@ -1666,98 +2013,1349 @@ static int finish_integ() {
 }
 
 
-/* approximate integral of `f' between `a' and `b' subject to a given
- * error. Use Romberg method with refinement substitution, x = (3u-u^3)/2
- * which prevents endpoint evaluation and causes non-uniform sampling.
+/* Fetch the function value left on the stack by call_integ_fn() */
+
+static int integ_result(phloat *pr) {
+    if (sp == -1)
+        return ERR_TOO_FEW_ARGUMENTS;
+    if (stack[sp]->type == TYPE_STRING)
+        return ERR_ALPHA_DATA_IS_INVALID;
+    vartype *r = stack[sp];
+    if (r->type != TYPE_REAL && r->type != TYPE_UNIT)
+        return ERR_INVALID_TYPE;
+    if (integ.result_unit == NULL) {
+        integ.result_unit = dup_vartype(r);
+        if (integ.result_unit == NULL)
+            return ERR_INSUFFICIENT_MEMORY;
+        *pr = ((vartype_real *) r)->x;
+    } else {
+        int err = convert_helper(integ.result_unit, r, pr);
+        if (err != ERR_NONE)
+            return err;
+    }
+    restore_t(integ.saved_t);
+    return ERR_NONE;
+}
+
+/* G7K15 abscissae and weights on [-1, 1]; the Gauss nodes are the
+ * Kronrod nodes with odd index.
  */
 
-int return_to_integ(bool stop) {
-    if (stop)
-        integ.caller.keep_running = 0;
+#ifdef BCD_MATH
+#define GK_NUM(x) Phloat(#x)
+#else
+#define GK_NUM(x) x
+#endif
+
+static const phloat gk_xk[8] = {
+    GK_NUM(0.9914553711208126392068546975263285),
+    GK_NUM(0.9491079123427585245261896840478513),
+    GK_NUM(0.8648644233597690727897127886409262),
+    GK_NUM(0.7415311855993944398638647732807884),
+    GK_NUM(0.5860872354676911302941448382587296),
+    GK_NUM(0.4058451513773971669066064120769615),
+    GK_NUM(0.2077849550078984676006894037732449),
+    GK_NUM(0.0)
+};
 
-    vartype *r;
-    phloat pr;
+static const phloat gk_wk[8] = {
+    GK_NUM(0.02293532201052922496373200805896959),
+    GK_NUM(0.06309209262997855329070066318920429),
+    GK_NUM(0.1047900103222501838398763225415180),
+    GK_NUM(0.1406532597155259187451895905102379),
+    GK_NUM(0.1690047266392679028265834265985503),
+    GK_NUM(0.1903505780647854099132564024210137),
+    GK_NUM(0.2044329400752988924141619992346491),
+    GK_NUM(0.2094821410847278280129991748917143)
+};
 
-    switch (integ.state) {
-    case 0:
-        return ERR_INTERNAL_ERROR;
+static const phloat gk_wg[4] = {
+    GK_NUM(0.1294849661688696932706114326790820),
+    GK_NUM(0.2797053914892766679014677714237796),
+    GK_NUM(0.3818300505051189449503697754889751),
+    GK_NUM(0.4179591836734693877551020408163265)
+};
+
+/* Abscissa number i of the G7K15 rule on the interval of width st->t
+ * starting at st->p
+ */
+
+static phloat gk_node(const integ_state *st, int i) {
+    phloat half = st->t / 2;
+    phloat mid = st->p + half;
+    if (i < 7)
+        return mid - gk_xk[i] * half;
+    else
+        return mid + gk_xk[14 - i] * half;
+}
+
+/* Tanh-sinh abscissa for t = st->p, stored in st->u, with its weight,
+ * pi/2 cosh(t) sech^2(pi/2 sinh(t)), in st->t. The distance to the nearest
+ * endpoint is computed directly, so abscissae crowd the endpoints without
+ * cancellation. Returns false for points that coincide with an endpoint
+ * or have a weight too small to matter.
+ */
 
+static bool ts_node(integ_state *st) {
+    phloat e = exp(-PI * fabs(sinh(st->p)));
+    phloat d = e / (1 + e);
+    st->t = PI / 2 * cosh(st->p) * 4 * d * (1 - d);
+    if (st->t == 0)
+        return false;
+    if (st->p < 0)
+        st->u = st->a + st->b * d;
+    else
+        st->u = st->ulim - st->b * d;
+    return st->u != st->llim && st->u != st->ulim;
+}
+
+/* approximate integral of `f' between `a' and `b' subject to a given
+ * error. Use Romberg method with refinement substitution, x = (3u-u^3)/2
+ * which prevents endpoint evaluation and causes non-uniform sampling.
+ *
+ * Alternatively, with METH=1, use adaptive G7K15 Gauss-Kronrod quadrature,
+ * bisecting depth-first until the Gauss-Kronrod difference in each interval
+ * is within its share of ACC; or with METH=2, tanh-sinh quadrature, halving
+ * the step until two successive estimates agree to within ACC. Neither
+ * evaluates `f' at the endpoints. States 1-2 are Romberg, 3-4 G7K15, and
+ * 5-6 tanh-sinh.
+ *
+ * integ_step() runs the method from where st->state says it left off,
+ * taking pr as the value of `f' at st->u when it was waiting for one. It
+ * returns true when it needs `f' at the new st->u, and false when it is
+ * done, leaving the integral in st->prev_res and its error in st->eps.
+ * return_to_integ() drives it through the interpreter; the sweeps run by
+ * VINTEG can also drive it natively.
+ */
+
+static bool integ_step(integ_state *st, phloat pr) {
+    switch (st->state) {
     case 1:
-        integ.state = 2;
+        st->state = 2;
 
     loop1:
 
-        integ.p = integ.h / 2 - 1;
-        integ.sum = 0.0;
-        integ.i = 0;
+        st->p = st->h / 2 - 1;
+        st->sum = 0.0;
+        st->i = 0;
 
     loop2:
 
-        integ.t = 1 - integ.p * integ.p;
-        integ.u = integ.p + integ.t * integ.p / 2;
-        integ.u = (integ.u * integ.b + integ.b) / 2 + integ.a;
-        return call_integ_fn();
+        st->t = 1 - st->p * st->p;
+        st->u = st->p + st->t * st->p / 2;
+        st->u = (st->u * st->b + st->b) / 2 + st->a;
+        return true;
 
     case 2:
-        if (sp == -1)
-            return ERR_TOO_FEW_ARGUMENTS;
-        if (stack[sp]->type == TYPE_STRING)
-            return ERR_ALPHA_DATA_IS_INVALID;
-        r = stack[sp];
-        if (r->type != TYPE_REAL && r->type != TYPE_UNIT)
-            return ERR_INVALID_TYPE;
-        if (integ.result_unit == NULL) {
-            integ.result_unit = dup_vartype(r);
-            if (integ.result_unit == NULL)
-                return ERR_INSUFFICIENT_MEMORY;
-            pr = ((vartype_real *) r)->x;
-        } else {
-            int err = convert_helper(integ.result_unit, r, &pr);
-            if (err != ERR_NONE)
-                return err;
-        }
-        integ.sum += integ.t * pr;
-        restore_t(integ.saved_t);
-        integ.p += integ.h;
-        if (++integ.i < integ.nsteps)
+        st->sum += st->t * pr;
+        st->p += st->h;
+        if (++st->i < st->nsteps)
             goto loop2;
 
         // update integral moving resuslt
-        integ.prev_int = (integ.prev_int + integ.sum*integ.h)/2;
-        integ.s[integ.k++] = integ.prev_int;
+        st->prev_int = (st->prev_int + st->sum*st->h)/2;
+        st->s[st->k++] = st->prev_int;
 
-        if (integ.n >= ROMB_K-1) {
+        if (st->n >= ROMB_K-1) {
             int i, m;
             int ns = ROMB_K-1;
             phloat dm = 1;
-            for (i = 0; i < ROMB_K; ++i) integ.c[i] = integ.s[i];
-            integ.sum = integ.s[ns];
+            for (i = 0; i < ROMB_K; ++i) st->c[i] = st->s[i];
+            st->sum = st->s[ns];
             for (m = 1; m < ROMB_K; ++m) {
                 dm /= 4;
                 for (i = 0; i < ROMB_K-m; ++i)
-                    integ.c[i] = (integ.c[i+1]-integ.c[i]*dm*4)/(1-dm);
-                integ.sum += integ.c[--ns]*dm;
+                    st->c[i] = (st->c[i+1]-st->c[i]*dm*4)/(1-dm);
+                st->sum += st->c[--ns]*dm;
             }
 
-            phloat res = integ.sum * integ.b * 0.75;
-            integ.eps = fabs(integ.prev_res - res);
-            integ.prev_res = res;
-            if (integ.eps <= integ.acc * fabs(res))
+            phloat res = st->sum * st->b * 0.75;
+            st->eps = fabs(st->prev_res - res);
+            st->prev_res = res;
+            if (st->eps <= st->acc * fabs(res))
                 // done!
-                return finish_integ();
+                return false;
 
-            for (i = 0; i < ROMB_K-1; ++i) integ.s[i] = integ.s[i+1];
-            integ.k = ROMB_K-1;
+            for (i = 0; i < ROMB_K-1; ++i) st->s[i] = st->s[i+1];
+            st->k = ROMB_K-1;
         }
 
-        integ.nsteps <<= 1;
-        integ.h /= 2.0;
+        st->nsteps <<= 1;
+        st->h /= 2.0;
 
-        if (++integ.n >= ROMB_MAX)
-            return finish_integ(); // too many
+        if (++st->n >= ROMB_MAX)
+            return false; // too many
 
         goto loop1;
+
+    case 3:
+        st->state = 4;
+
+    gk_interval:
+
+        st->sum = 0;
+        st->gk_g = 0;
+        st->prev_res = 0;
+        st->i = 0;
+
+    gk_loop:
+
+        st->u = gk_node(st, st->i);
+        return true;
+
+    case 4: {
+        int j = st->i < 7 ? st->i : 14 - st->i;
+        st->sum += gk_wk[j] * pr;
+        st->prev_res += gk_wk[j] * fabs(pr);
+        if ((j & 1) != 0)
+            st->gk_g += gk_wg[j >> 1] * pr;
+        if (++st->i < 15)
+            goto gk_loop;
+
+        phloat kr = st->sum * st->t / 2;
+        phloat e = fabs(kr - st->gk_g * st->t / 2);
+        // The tolerance is relative to the integral of |f| over the
+        // whole interval, estimated from the first pass, and to the
+        // integral so far, so that it is not lost to cancellation
+        if (st->nsteps++ == 0)
+            st->h = fabs(st->prev_res * st->t / 2);
+        // st->h + e == st->h: the error is down to roundoff
+        if (e > st->acc * st->h * fabs(st->t / st->b)
+                && st->h + e != st->h
+                && st->m < GK_DEPTH && st->nsteps < GK_MAX) {
+            // Bisect; do the left half now, the right half later
+            st->t /= 2;
+            st->m++;
+            st->gk_x[st->gk_top] = st->p + st->t;
+            st->gk_d[st->gk_top] = st->m;
+            st->gk_top++;
+            goto gk_interval;
+        }
+        st->prev_int += kr;
+        st->eps += e;
+        if (fabs(st->prev_int) > st->h)
+            st->h = fabs(st->prev_int);
+        if (st->gk_top == 0) {
+            st->prev_res = st->prev_int;
+            return false;
+        }
+        st->gk_top--;
+        st->p = st->gk_x[st->gk_top];
+        st->m = st->gk_d[st->gk_top];
+        st->t = st->b;
+        for (j = 0; j < st->m; j++)
+            st->t /= 2;
+        goto gk_interval;
+    }
+
+    case 5:
+        st->state = 6;
+        st->sum = 0;
+
+    ts_level:
+
+        // Level 0 visits every multiple of h; later levels only the
+        // odd multiples, the others having been summed already
+        st->p = st->n == 0 ? -TS_T : -TS_T + st->h;
+
+    ts_loop:
+
+        while (st->p <= TS_T) {
+            if (ts_node(st))
+                return true;
+            st->p += st->n == 0 ? st->h : st->h * 2;
+        }
+
+        {
+            phloat res = st->sum * st->h * st->b / 2;
+            st->eps = fabs(st->prev_res - res);
+            st->prev_res = res;
+            if (st->n >= 2 && st->eps <= st->acc * fabs(res))
+                // done!
+                return false;
+        }
+
+        if (++st->n > TS_MAX)
+            return false; // too many
+        st->h /= 2;
+        goto ts_level;
+
+    case 6:
+        st->sum += st->t * pr;
+        st->p += st->n == 0 ? st->h : st->h * 2;
+        goto ts_loop;
+
+    default:
+        return false;
+    }
+}
+
+int return_to_integ(bool stop) {
+    if (stop)
+        integ.caller.keep_running = 0;
+
+    phloat pr = 0;
+    switch (integ.state) {
+    case 1:
+    case 3:
+    case 5:
+        break;
+    case 2:
+    case 4:
+    case 6: {
+        int err = integ_result(&pr);
+        if (err != ERR_NONE)
+            return err;
+        break;
+    }
     default:
         return ERR_INTERNAL_ERROR;
     }
+    if (integ_step(&integ, pr))
+        return call_integ_fn();
+    else
+        return finish_integ();
+}
+
+
+/* VSOLVE and VINTEG take a list of parameter names in Y (or a single name
+ * as a string), and a real matrix in X with one column per name and one row
+ * per case. For each row, they store the row's values in the named
+ * variables, and then SOLVE or INTEG for the variable given as the
+ * argument. They return a matrix with one row per case: the root and the
+ * SOLVE result code for VSOLVE (what SOLVE returns in X and T), or the
+ * integral and its error estimate for VINTEG (what INTEG returns in X and
+ * Y). VSOLVE starts the first row from the current value of the unknown,
+ * and each following row from the previous row's root.
+ *
+ * When the function is an equation with a NumericCode form, and every
+ * variable in it is real, the rows are done natively, on several threads
+ * where the build allows it. VINTEG runs the regular integrator's
+ * integ_step() directly; a row it can't do is left to the interpreter.
+ * VSOLVE uses a secant search for a sign change followed by Illinois-style
+ * false position. Since each row starts from the previous row's root, the
+ * blocks of SWEEP_CHUNK rows after the first are solved speculatively,
+ * starting from the first guess, and sweep_next() then goes over the rows in
+ * order: a row whose starting point turns out to have been right keeps its
+ * root, any other row is solved natively again from the right starting
+ * point, and a row for which that doesn't end in a clean root, or in which
+ * the equation can't be evaluated natively, is left to the regular solver.
+ * That way, the roots are the ones a serial sweep would find.
+ *
+ * ROOTS takes an interval in Z and Y, and a number of sample points in X.
+ * It evaluates the SOLVE function at that many equally spaced points, from
+ * Z to Y inclusive, and then finds the root in each interval between two
+ * samples where the function changes sign. Samples where the function is
+ * exactly zero are roots themselves. It returns a list of the roots, in
+ * order from Z to Y; roots of even multiplicity, where the function
+ * touches zero without changing sign, are only found if they happen to be
+ * sampled exactly, and sign changes that turn out to be poles are dropped.
+ * Natively, each block of ROOTS_CHUNK samples is sampled and refined on
+ * its own thread; otherwise, the samples are taken by the solver, in a
+ * state of its own, and the intervals are refined by the regular solver,
+ * with the two ends of the interval as its starting guesses.
+ */
+
+#define SWEEP_CHUNK 16
+#define ROOTS_CHUNK 64
+
+static bool sweep_active() {
+    if (sweep.kind == SWEEP_SOLVE || sweep.kind == SWEEP_ROOTS)
+        return solve_active() && solve.caller.prev_prgm.idx == -6;
+    else if (sweep.kind == SWEEP_INTEG)
+        return integ_active() && integ.caller.prev_prgm.idx == -6;
+    else
+        return false;
+}
+
+static void sweep_end() {
+    sweep_batch_finish();
+    sweep.kind = 0;
+    sweep.last_native = false;
+    free_vartype(sweep.names);
+    sweep.names = NULL;
+    free_vartype(sweep.params);
+    sweep.params = NULL;
+    free_vartype(sweep.results);
+    sweep.results = NULL;
+    free_vartype(sweep.saved_y);
+    sweep.saved_y = NULL;
+    free_vartype(sweep.saved_z);
+    sweep.saved_z = NULL;
+    free_vartype(sweep.saved_t);
+    sweep.saved_t = NULL;
+    sweep.todo.clear();
+}
+
+static bool native_root(const NumericCode *code, phloat *vals, int slot, phloat x1, phloat x2, phloat *root) {
+    // Same starting points as start_solve_2()
+    if (x1 == x2) {
+        if (x1 == 0)
+            x2 = 1;
+        else {
+            x2 = x1 * 1.000001;
+            if (p_isinf(x2))
+                x2 = x1 * 0.999999;
+        }
+    }
+    phloat f1, f2;
+    vals[slot] = x1;
+    if (!code->eval(vals, &f1))
+        return false;
+    if (f1 == 0) {
+        *root = x1;
+        return true;
+    }
+    vals[slot] = x2;
+    if (!code->eval(vals, &f2))
+        return false;
+    if (f2 == 0) {
+        *root = x2;
+        return true;
+    }
+    phloat fstart = fabs(f1) < fabs(f2) ? fabs(f1) : fabs(f2);
+
+    // Secant steps until the function changes sign
+    for (int n = 0; (f1 > 0) == (f2 > 0); n++) {
+        if (n == 50 || f1 == f2)
+            return false;
+        phloat x3 = x2 - f2 * (x2 - x1) / (f2 - f1);
+        if (p_isnan(x3) || p_isinf(x3) != 0)
+            return false;
+        phloat f3;
+        vals[slot] = x3;
+        if (!code->eval(vals, &f3))
+            return false;
+        if (f3 == 0) {
+            *root = x3;
+            return true;
+        }
+        x1 = x2;
+        f1 = f2;
+        x2 = x3;
+        f2 = f3;
+    }
+
+    /* False position, with the retained end's function value halved each
+     * time the same end is retained twice in a row (the Illinois method),
+     * and a bisection step whenever two steps haven't halved the bracket.
+     * The gap between the function values at the ends is tracked the way
+     * track_f_gap() does it, so a sign change that doesn't close in on zero
+     * is rejected, like the solver reports it as a sign reversal.
+     */
+    phloat a = x1, fa = f1, ga = f1;
+    phloat b = x2, fb = f2, gb = f2;
+    phloat lo = a < b ? a : b;
+    phloat hi = a < b ? b : a;
+    phloat prev_w = hi - lo, w = prev_w;
+    phloat f_gap = fb - fa;
+    int f_gap_worsening_counter = 0;
+    int retained = 0;
+    bool bisect = false;
+    for (int n = 0; n < 2000; n++) {
+        phloat m = lo + (hi - lo) / 2;
+        if (m == lo || m == hi)
+            break;
+        phloat x = m;
+        if (!bisect) {
+            x = b - gb * (b - a) / (gb - ga);
+            if (!(x > lo && x < hi))
+                x = m;
+        }
+        phloat fx;
+        vals[slot] = x;
+        if (!code->eval(vals, &fx))
+            return false;
+        if (fx == 0) {
+            *root = x;
+            return true;
+        }
+        if ((fx > 0) == (fb > 0)) {
+            b = x;
+            fb = gb = fx;
+            if (retained == 1)
+                ga /= 2;
+            retained = 1;
+        } else {
+            a = x;
+            fa = ga = fx;
+            if (retained == 2)
+                gb /= 2;
+            retained = 2;
+        }
+        lo = a < b ? a : b;
+        hi = a < b ? b : a;
+        bisect = hi - lo > prev_w / 2;
+        prev_w = w;
+        w = hi - lo;
+        phloat gap = fb - fa;
+        if (fabs(gap) < fabs(f_gap))
+            f_gap_worsening_counter = 0;
+        else
+            f_gap_worsening_counter++;
+        f_gap = gap;
+    }
+
+    phloat fend = fabs(fa) < fabs(fb) ? fabs(fa) : fabs(fb);
+    if (fend > fstart || f_gap_worsening_counter >= 3)
+        // Looks like a pole or a jump, not a root; let the solver sort it out
+        return false;
+    *root = fabs(fa) < fabs(fb) ? a : b;
+    return true;
+}
+
+struct sweep_batch {
+    int kind;
+    NumericCode *code;
+    int slot;
+    std::vector<phloat> vals;
+    std::vector<int> cols;
+    // VINTEG: LLIM, ULIM, ACC, and METH; column, or -1 to use lim_val
+    int lim_col[4];
+    phloat lim_val[4];
+    phloat x1, x2;
+    // ROOTS: the interval
+    phloat lo, hi;
+    int rows, ncols, chunks;
+    phloat *params;
+    phloat *res;
+    char *ok;
+    // VSOLVE: the starting points each row was solved from
+    phloat *seed;
+#ifdef BCD_MATH
+    int next;
+#else
+    std::atomic<int> next;
+    std::atomic<int> finished;
+    std::atomic<bool> cancelled;
+    std::vector<std::thread> threads;
+#endif
+};
+
+static sweep_batch *sweep_nb = NULL;
+
+static phloat roots_x(phloat lo, phloat hi, int4 n, int4 i) {
+    if (i == n - 1)
+        return hi;
+    return lo + (hi - lo) * i / (n - 1);
+}
+
+static bool roots_bracket(phloat f1, phloat f2) {
+    return f1 < 0 && f2 > 0 || f1 > 0 && f2 < 0;
+}
+
+static void roots_chunk(sweep_batch *b, phloat *vals, int c) {
+    int4 n = b->rows;
+    int4 start = c * ROOTS_CHUNK;
+    int4 end = start + ROOTS_CHUNK;
+    if (end > n)
+        end = n;
+    // The first sample of the next block, for the last interval in this one
+    int4 last = end < n ? end : n - 1;
+    phloat f[ROOTS_CHUNK + 1];
+    for (int4 i = start; i <= last; i++) {
+#ifndef BCD_MATH
+        if (b->cancelled)
+            return;
+#endif
+        vals[b->slot] = roots_x(b->lo, b->hi, n, i);
+        if (!b->code->eval(vals, &f[i - start]))
+            f[i - start] = NAN_PHLOAT;
+    }
+    for (int4 i = start; i < end; i++) {
+#ifndef BCD_MATH
+        if (b->cancelled)
+            return;
+#endif
+        phloat f1 = f[i - start];
+        b->res[2 * (size_t) i] = NAN_PHLOAT;
+        b->ok[i] = 1;
+        if (f1 == 0)
+            b->res[2 * (size_t) i] = roots_x(b->lo, b->hi, n, i);
+        else if (i < n - 1 && roots_bracket(f1, f[i + 1 - start])) {
+            phloat root;
+            if (native_root(b->code, vals, b->slot, roots_x(b->lo, b->hi, n, i),
+                                roots_x(b->lo, b->hi, n, i + 1), &root))
+                b->res[2 * (size_t) i] = root;
+            else
+                b->ok[i] = 0;
+        }
+    }
+}
+
+static bool sweep_batch_root(sweep_batch *b, phloat *vals, int r, phloat x1, phloat x2, phloat *root) {
+    const phloat *row = b->params + (size_t) r * b->ncols;
+    for (int j = 0; j < b->ncols; j++)
+        if (b->cols[j] != -1)
+            vals[b->cols[j]] = row[j];
+    return native_root(b->code, vals, b->slot, x1, x2, root);
+}
+
+static void sweep_batch_chunk(sweep_batch *b, int c) {
+    std::vector<phloat> vals = b->vals;
+    if (b->kind == SWEEP_ROOTS) {
+        roots_chunk(b, vals.data(), c);
+        return;
+    }
+    phloat x1 = b->x1, x2 = b->x2;
+    int end = (c + 1) * SWEEP_CHUNK;
+    if (end > b->rows)
+        end = b->rows;
+    for (int r = c * SWEEP_CHUNK; r < end; r++) {
+#ifndef BCD_MATH
+        if (b->cancelled)
+            return;
+#endif
+        if (b->kind == SWEEP_SOLVE) {
+            phloat root;
+            b->seed[2 * (size_t) r] = x1;
+            b->seed[2 * (size_t) r + 1] = x2;
+            if (sweep_batch_root(b, vals.data(), r, x1, x2, &root)) {
+                b->res[2 * (size_t) r] = root;
+                b->res[2 * (size_t) r + 1] = SOLVE_ROOT;
+                b->ok[r] = 1;
+                x1 = x2 = root;
+            }
+        } else {
+            const phloat *row = b->params + (size_t) r * b->ncols;
+            for (int j = 0; j < b->ncols; j++)
+                if (b->cols[j] != -1)
+                    vals[b->cols[j]] = row[j];
+            integ_state st;
+            phloat lim[4];
+            for (int i = 0; i < 4; i++)
+                lim[i] = b->lim_col[i] == -1 ? b->lim_val[i] : row[b->lim_col[i]];
+            if (lim[3] < 0 || lim[3] > 2 || lim[3] != floor(lim[3]))
+                // Let start_integ() report the invalid METH
+                continue;
+            st.llim = lim[0];
+            st.ulim = lim[1];
+            st.acc = lim[2] < 0 ? 0 : lim[2];
+            st.method = to_int(lim[3]);
+            integ_setup(&st);
+            phloat y = 0;
+            bool good = true;
+            while (integ_step(&st, y)) {
+                vals[b->slot] = st.u;
+                if (!b->code->eval(vals.data(), &y)) {
+                    good = false;
+                    break;
+                }
+            }
+            if (good) {
+                b->res[2 * (size_t) r] = st.prev_res;
+                b->res[2 * (size_t) r + 1] = st.eps;
+                b->ok[r] = 1;
+            }
+        }
+    }
+}
+
+#ifndef BCD_MATH
+static void sweep_batch_thread(sweep_batch *b) {
+    while (!b->cancelled) {
+        int c = b->next++;
+        if (c >= b->chunks)
+            break;
+        sweep_batch_chunk(b, c);
+        b->finished++;
+    }
+}
+#endif
+
+static void sweep_batch_finish() {
+    sweep_batch *b = sweep_nb;
+    if (b == NULL)
+        return;
+#ifndef BCD_MATH
+    b->cancelled = true;
+    for (size_t i = 0; i < b->threads.size(); i++)
+        b->threads[i].join();
+#endif
+    delete b->code;
+    free(b->params);
+    free(b->res);
+    free(b->ok);
+    free(b->seed);
+    delete b;
+    sweep_nb = NULL;
+}
+
+/* Returns true if every row is done, one way or the other */
+static bool sweep_batch_poll() {
+    sweep_batch *b = sweep_nb;
+#ifdef BCD_MATH
+    if (b->next < b->chunks)
+        sweep_batch_chunk(b, b->next++);
+    return b->next == b->chunks;
+#else
+    if (b->threads.empty()) {
+        int c = b->next++;
+        if (c < b->chunks) {
+            sweep_batch_chunk(b, c);
+            b->finished++;
+        }
+    }
+    if (b->finished == b->chunks)
+        return true;
+    std::this_thread::yield();
+    return false;
+#endif
+}
+
+static bool sweep_batch_value(const char *name, phloat *x) {
+    vartype *v = recall_var(name, (int) strlen(name));
+    if (v == NULL || v->type != TYPE_REAL)
+        return false;
+    *x = ((vartype_real *) v)->x;
+    return true;
+}
+
+/* Returns ERR_INTERRUPTIBLE if the rows are being done natively, and
+ * ERR_NONE if they have to be done by the interpreter instead.
+ */
+static int sweep_batch_start() {
+    vartype *fn = sweep.kind == SWEEP_INTEG ? integ.eq : solve.eq;
+    if (fn == NULL || fn->type != TYPE_EQUATION)
+        return ERR_NONE;
+    if (sweep.kind == SWEEP_SOLVE && flags.f.direct_solver)
+        return ERR_NONE;
+
+    int err = ERR_NONE;
+    sweep_batch *b = new (std::nothrow) sweep_batch;
+    if (b == NULL)
+        return ERR_INSUFFICIENT_MEMORY;
+    sweep_nb = b;
+    b->kind = sweep.kind;
+    b->params = NULL;
+    b->res = NULL;
+    b->ok = NULL;
+    b->seed = NULL;
+    b->code = new (std::nothrow) NumericCode;
+    equation_data *eqd = ((vartype_equation *) fn)->data;
+    if (b->code == NULL) {
+        err = ERR_INSUFFICIENT_MEMORY;
+        goto fail;
+    }
+    if (!eqd->ev->generateNumericCode(b->code))
+        goto fail;
+    b->slot = b->code->slot(std::string(sweep.var_name, sweep.var_length));
+    if (b->slot == -1)
+        goto fail;
+
+    {
+        vartype_list *names = (vartype_list *) sweep.names;
+        if (b->kind == SWEEP_ROOTS) {
+            b->rows = sweep.n;
+            b->ncols = 0;
+            b->chunks = (b->rows + ROOTS_CHUNK - 1) / ROOTS_CHUNK;
+            b->lo = sweep.lo;
+            b->hi = sweep.hi;
+        } else {
+            vartype_realmatrix *rm = (vartype_realmatrix *) sweep.params;
+            b->rows = rm->rows;
+            b->ncols = rm->columns;
+            b->chunks = (b->rows + SWEEP_CHUNK - 1) / SWEEP_CHUNK;
+            size_t size = (size_t) b->rows * b->ncols * sizeof(phloat);
+            b->params = (phloat *) malloc(size);
+            if (b->params == NULL && size != 0) {
+                err = ERR_INSUFFICIENT_MEMORY;
+                goto fail;
+            }
+            memcpy(b->params, rm->array->data, size);
+        }
+        b->res = (phloat *) malloc(2 * (size_t) b->rows * sizeof(phloat));
+        b->ok = (char *) calloc(b->rows, 1);
+        if (b->res == NULL || b->ok == NULL) {
+            err = ERR_INSUFFICIENT_MEMORY;
+            goto fail;
+        }
+        if (b->kind == SWEEP_SOLVE) {
+            b->seed = (phloat *) malloc(2 * (size_t) b->rows * sizeof(phloat));
+            if (b->seed == NULL) {
+                err = ERR_INSUFFICIENT_MEMORY;
+                goto fail;
+            }
+            // Rows that never get done don't match any starting point
+            for (size_t i = 0; i < 2 * (size_t) b->rows; i++)
+                b->seed[i] = NAN_PHLOAT;
+        }
+
+        int nvars = (int) b->code->vars.size();
+        std::vector<bool> have(nvars, false);
+        have[b->slot] = true;
+        for (int i = 0; i < 4; i++)
+            b->lim_col[i] = -1;
+        for (int j = 0; j < b->ncols; j++) {
+            vartype_string *s = (vartype_string *) names->array->data[j];
+            std::string name(s->txt(), s->length);
+            int k = b->code->slot(name);
+            if (k == b->slot)
+                goto fail;
+            b->cols.push_back(k);
+            if (k != -1)
+                have[k] = true;
+            if (b->kind == SWEEP_INTEG) {
+                const char *lims[] = { "LLIM", "ULIM", "ACC", "METH" };
+                for (int i = 0; i < 4; i++)
+                    if (name == lims[i])
+                        b->lim_col[i] = j;
+            }
+        }
+        b->vals.resize(nvars);
+        for (int i = 0; i < nvars; i++) {
+            if (have[i])
+                continue;
+            const std::string &name = b->code->vars[i];
+            vartype *v = recall_var(name.c_str(), (int) name.length());
+            if (v == NULL || v->type != TYPE_REAL)
+                goto fail;
+            b->vals[i] = ((vartype_real *) v)->x;
+        }
+
+        if (b->kind == SWEEP_ROOTS) {
+            // Nothing else needed
+        } else if (b->kind == SWEEP_SOLVE) {
+            vartype *v = recall_var(sweep.var_name, sweep.var_length);
+            if (v == NULL) {
+                b->x1 = 0;
+                b->x2 = 1;
+            } else if (v->type == TYPE_REAL) {
+                b->x1 = b->x2 = ((vartype_real *) v)->x;
+            } else
+                goto fail;
+        } else {
+            if (b->lim_col[0] == -1 && !sweep_batch_value("LLIM", &b->lim_val[0])
+                    || b->lim_col[1] == -1 && !sweep_batch_value("ULIM", &b->lim_val[1]))
+                goto fail;
+            if (b->lim_col[2] == -1 && !sweep_batch_value("ACC", &b->lim_val[2]))
+                b->lim_val[2] = 0;
+            if (b->lim_col[3] == -1 && !sweep_batch_value("METH", &b->lim_val[3]))
+                b->lim_val[3] = INTEG_ROMBERG;
+        }
+    }
+
+    b->next = 0;
+#ifndef BCD_MATH
+    b->finished = 0;
+    b->cancelled = false;
+    {
+        int nthreads = std::thread::hardware_concurrency();
+        if (nthreads < 1)
+            nthreads = 1;
+        else if (nthreads > 16)
+            nthreads = 16;
+        if (nthreads > b->chunks)
+            nthreads = b->chunks;
+        for (int i = 0; i < nthreads; i++) {
+            try {
+                b->threads.push_back(std::thread(sweep_batch_thread, b));
+            } catch (...) {
+                // Whatever isn't picked up by threads is done by
+                // sweep_batch_poll() on the calling thread
+                break;
+            }
+        }
+    }
+#endif
+    return ERR_INTERRUPTIBLE;
+
+    fail:
+    sweep_batch_finish();
+    return err;
+}
+
+static int sweep_store_row(int4 r) {
+    vartype_list *names = (vartype_list *) sweep.names;
+    vartype_realmatrix *rm = (vartype_realmatrix *) sweep.params;
+    for (int4 j = 0; j < rm->columns; j++) {
+        vartype_string *s = (vartype_string *) names->array->data[j];
+        vartype *v = new_real(rm->array->data[r * rm->columns + j]);
+        if (v == NULL)
+            return ERR_INSUFFICIENT_MEMORY;
+        int err = store_var(s->txt(), s->length, v);
+        if (err != ERR_NONE) {
+            free_vartype(v);
+            return err;
+        }
+    }
+    return ERR_NONE;
+}
+
+static int sweep_finish() {
+    vartype *res;
+    vartype_realmatrix *params = (vartype_realmatrix *) sweep.params;
+    if (sweep.kind != SWEEP_ROOTS && sweep.last_native) {
+        // The last row was done natively; leave the variables the way it
+        // would have, and not the way the last interpreted row left them
+        int4 r = params->rows - 1;
+        int err = sweep_store_row(r);
+        if (err == ERR_NONE && sweep.kind == SWEEP_SOLVE) {
+            vartype *v = new_real(((vartype_realmatrix *) sweep.results)->array->data[2 * r]);
+            if (v == NULL)
+                err = ERR_INSUFFICIENT_MEMORY;
+            else if ((err = store_var(sweep.var_name, sweep.var_length, v)) != ERR_NONE)
+                free_vartype(v);
+        }
+        if (err != ERR_NONE) {
+            sweep_end();
+            return sweep.caller.ret(err);
+        }
+    }
+    if (sweep.kind == SWEEP_ROOTS) {
+        vartype_realmatrix *rm = (vartype_realmatrix *) sweep.results;
+        int4 count = 0;
+        for (int4 i = 0; i < sweep.n; i++)
+            if (!p_isnan(rm->array->data[i]))
+                count++;
+        res = new_list(count);
+        if (res == NULL) {
+            nomem:
+            sweep_end();
+            return sweep.caller.ret(ERR_INSUFFICIENT_MEMORY);
+        }
+        vartype **data = ((vartype_list *) res)->array->data;
+        count = 0;
+        for (int4 i = 0; i < sweep.n; i++) {
+            if (p_isnan(rm->array->data[i]))
+                continue;
+            data[count] = new_real(rm->array->data[i]);
+            if (data[count++] == NULL) {
+                free_vartype(res);
+                goto nomem;
+            }
+        }
+        free_vartype(sweep.params);
+        sweep.params = new_real(sweep.n);
+        if (sweep.params == NULL) {
+            free_vartype(res);
+            goto nomem;
+        }
+    } else {
+        res = sweep.results;
+        sweep.results = NULL;
+    }
+    int err;
+    if (flags.f.big_stack) {
+        clean_stack(sweep.prev_sp);
+        // Only if the function dropped the arguments off the stack
+        if (sp < (sweep.kind == SWEEP_ROOTS ? 2 : 1)) {
+            err = recall_result(res);
+            goto done;
+        }
+    } else {
+        free_vartype(stack[REG_T]);
+        stack[REG_T] = sweep.saved_t;
+        sweep.saved_t = NULL;
+        free_vartype(stack[REG_Z]);
+        stack[REG_Z] = sweep.saved_z;
+        sweep.saved_z = NULL;
+        free_vartype(stack[REG_Y]);
+        if (sweep.kind == SWEEP_ROOTS) {
+            stack[REG_Y] = sweep.saved_y;
+            sweep.saved_y = NULL;
+        } else {
+            stack[REG_Y] = sweep.names;
+            sweep.names = NULL;
+        }
+        free_vartype(stack[REG_X]);
+        stack[REG_X] = sweep.params;
+        sweep.params = NULL;
+    }
+    err = sweep.kind == SWEEP_ROOTS ? ternary_result(res) : binary_result(res);
+    done:
+    sweep_end();
+    return sweep.caller.ret(err);
+}
+
+static int sweep_next() {
+    sweep_batch *b = sweep_nb;
+    while (b != NULL && sweep.pos < (int4) sweep.todo.size()) {
+        // VSOLVE rows, in order, each starting where the one before it ended
+        int4 r = sweep.todo[sweep.pos];
+        phloat *res = ((vartype_realmatrix *) sweep.results)->array->data;
+        phloat x1 = r == 0 ? b->x1 : res[2 * (size_t) (r - 1)];
+        phloat x2 = r == 0 ? b->x2 : x1;
+        phloat root;
+        if (x1 == b->seed[2 * (size_t) r] && x2 == b->seed[2 * (size_t) r + 1]) {
+            if (!b->ok[r])
+                break;
+            root = b->res[2 * (size_t) r];
+        } else if (!sweep_batch_root(b, b->vals.data(), r, x1, x2, &root))
+            break;
+        res[2 * (size_t) r] = root;
+        res[2 * (size_t) r + 1] = SOLVE_ROOT;
+        sweep.last_native = true;
+        sweep.pos++;
+    }
+    if (sweep.pos >= (int4) sweep.todo.size())
+        return sweep_finish();
+    int4 r = sweep.todo[sweep.pos];
+    int err;
+    sweep.last_native = false;
+    if (sweep.kind == SWEEP_ROOTS) {
+        vartype_real v1, v2;
+        v1.type = v2.type = TYPE_REAL;
+        v1.x = roots_x(sweep.lo, sweep.hi, sweep.n, r);
+        v2.x = roots_x(sweep.lo, sweep.hi, sweep.n, r + 1);
+        // The direct solver could find any root, not necessarily this one
+        bool direct = flags.f.direct_solver;
+        flags.f.direct_solver = 0;
+        err = start_solve(-6, sweep.var_name, sweep.var_length, (vartype *) &v1, (vartype *) &v2);
+        flags.f.direct_solver = direct;
+        if (err == ERR_RUN)
+            solve.caller.keep_running = 1;
+        goto started;
+    }
+    err = sweep_store_row(r);
+    if (err != ERR_NONE) {
+        sweep_end();
+        return sweep.caller.ret(err);
+    }
+    if (sweep.kind == SWEEP_SOLVE) {
+        vartype *v1 = recall_var(sweep.var_name, sweep.var_length);
+        vartype_real guess;
+        if (r > 0 && (v1 == NULL || v1->type == TYPE_REAL)) {
+            // A unit unknown holds the last root already, with its unit
+            guess.type = TYPE_REAL;
+            guess.x = ((vartype_realmatrix *) sweep.results)->array->data[2 * (r - 1)];
+            v1 = (vartype *) &guess;
+        }
+        err = start_solve(-6, sweep.var_name, sweep.var_length, v1, NULL);
+        if (err == ERR_RUN)
+            solve.caller.keep_running = 1;
+    } else {
+        err = start_integ(-6, sweep.var_name, sweep.var_length);
+        if (err == ERR_RUN)
+            integ.caller.keep_running = 1;
+    }
+    started:
+    if (err != ERR_RUN && sweep.kind != 0) {
+        // Failed before the solver or integrator got going
+        sweep_end();
+        return sweep.caller.ret(err);
+    }
+    return err;
+}
+
+static int return_to_sweep(int err, bool stop) {
+    if (stop)
+        sweep.caller.keep_running = 0;
+    if (sweep.kind == 0)
+        return ERR_INTERNAL_ERROR;
+    if (err != ERR_NONE) {
+        sweep_end();
+        return sweep.caller.ret(err);
+    }
+    int4 r = sweep.todo[sweep.pos];
+    if (sweep.kind == SWEEP_ROOTS) {
+        if (sp < 3) {
+            sweep_end();
+            return sweep.caller.ret(ERR_TOO_FEW_ARGUMENTS);
+        }
+        phloat root = ((vartype_real *) stack[sp])->x;
+        phloat x1 = roots_x(sweep.lo, sweep.hi, sweep.n, r);
+        phloat x2 = roots_x(sweep.lo, sweep.hi, sweep.n, r + 1);
+        if (((vartype_real *) stack[sp - 3])->x != SOLVE_ROOT
+                || !(root >= x1 && root <= x2 || root >= x2 && root <= x1))
+            root = NAN_PHLOAT;
+        ((vartype_realmatrix *) sweep.results)->array->data[r] = root;
+        clean_stack(sweep.prev_sp);
+        sweep.pos++;
+        return sweep_next();
+    }
+    phloat *res = ((vartype_realmatrix *) sweep.results)->array->data + 2 * r;
+    if (sweep.kind == SWEEP_SOLVE && sp >= 1 && stack[sp - 1]->type == TYPE_STRING) {
+        // Direct solution: the root in X, and "Direct" in Y
+        if (stack[sp]->type != TYPE_REAL && stack[sp]->type != TYPE_UNIT) {
+            sweep_end();
+            return sweep.caller.ret(ERR_INVALID_TYPE);
+        }
+        res[0] = ((vartype_real *) stack[sp])->x;
+        res[1] = SOLVE_ROOT;
+    } else {
+        if (sp < (sweep.kind == SWEEP_SOLVE ? 3 : 1)) {
+            sweep_end();
+            return sweep.caller.ret(ERR_TOO_FEW_ARGUMENTS);
+        }
+        // Both results are real or unit; only the number is kept
+        res[0] = ((vartype_real *) stack[sp])->x;
+        res[1] = ((vartype_real *) stack[sweep.kind == SWEEP_SOLVE ? sp - 3 : sp - 1])->x;
+    }
+    clean_stack(sweep.prev_sp);
+    sweep.pos++;
+    return sweep_next();
+}
+
+static int sweep_worker(bool interrupted) {
+    if (interrupted) {
+        sweep_batch_finish();
+        sweep_end();
+        return ERR_STOP;
+    }
+    if (!sweep_batch_poll())
+        return ERR_INTERRUPTIBLE;
+
+    sweep_batch *b = sweep_nb;
+    if (sweep.kind != SWEEP_SOLVE) {
+        phloat *res = ((vartype_realmatrix *) sweep.results)->array->data;
+        int rows = b->rows;
+        sweep.todo.clear();
+        for (int r = 0; r < rows; r++) {
+            if (!b->ok[r])
+                sweep.todo.push_back(r);
+            else if (sweep.kind == SWEEP_ROOTS)
+                res[r] = b->res[2 * (size_t) r];
+            else {
+                res[2 * (size_t) r] = b->res[2 * (size_t) r];
+                res[2 * (size_t) r + 1] = b->res[2 * (size_t) r + 1];
+            }
+        }
+        sweep.last_native = b->ok[rows - 1] != 0;
+        sweep_batch_finish();
+    }
+    // VSOLVE keeps the batch; sweep_next() goes over its rows in order
+    sweep.pos = 0;
+    int err = sweep_next();
+    if (err == ERR_RUN && !program_running())
+        // Leftovers go to the interpreter; when the sweep was invoked
+        // from the keyboard, it isn't running yet
+        set_running(true);
+    return err;
+}
+
+/* ROOTS sampling through the interpreter: the solver evaluates the function
+ * at each sample point in turn, in state 9, and hands the result to
+ * return_to_roots().
+ */
+static int roots_sample() {
+    solve.x1 = roots_x(sweep.lo, sweep.hi, sweep.n, sweep.pos);
+    return call_solve_fn(1, 9);
+}
+
+static int start_roots_sampling() {
+    string_copy(solve.var_name, &solve.var_length, sweep.var_name, sweep.var_length);
+    string_copy(solve.active_prgm_name, &solve.active_prgm_length,
+                solve.prgm_name, solve.prgm_length);
+    free_vartype(solve.saved_t);
+    if (!flags.f.big_stack && solve.eq != NULL) {
+        solve.saved_t = dup_vartype(stack[REG_T]);
+        if (solve.saved_t == NULL)
+            return ERR_INSUFFICIENT_MEMORY;
+    } else
+        solve.saved_t = NULL;
+    free_vartype(solve.active_eq);
+    solve.active_eq = NULL;
+    if (solve.eq != NULL) {
+        solve.active_eq = dup_vartype(solve.eq);
+        if (solve.active_eq == NULL)
+            return ERR_INSUFFICIENT_MEMORY;
+    }
+    free_vartype(solve.param_unit);
+    solve.param_unit = NULL;
+    solve.caller.set(-6);
+    solve.caller.keep_running = 1;
+    solve.prev_sp = flags.f.big_stack ? sp : -2;
+    sweep.pos = 0;
+    return roots_sample();
+}
+
+static int return_to_roots(bool failure) {
+    if (!solve.caller.keep_running)
+        sweep.caller.keep_running = 0;
+    phloat f = NAN_PHLOAT;
+    if (!failure && sp != -1) {
+        if (stack[sp]->type == TYPE_REAL || stack[sp]->type == TYPE_UNIT)
+            f = ((vartype_real *) stack[sp])->x;
+        restore_t(solve.saved_t);
+    }
+    phloat *fx = ((vartype_realmatrix *) sweep.params)->array->data;
+    fx[sweep.pos] = f;
+    if (++sweep.pos < sweep.n)
+        return roots_sample();
+
+    // Done sampling; this pass of the solver ends without a result
+    solve.state = 0;
+    free_vartype(solve.active_eq);
+    solve.active_eq = NULL;
+    free_vartype(solve.saved_t);
+    solve.saved_t = NULL;
+    clean_stack(solve.prev_sp);
+
+    phloat *res = ((vartype_realmatrix *) sweep.results)->array->data;
+    sweep.todo.clear();
+    for (int4 i = 0; i < sweep.n; i++) {
+        res[i] = NAN_PHLOAT;
+        if (fx[i] == 0)
+            res[i] = roots_x(sweep.lo, sweep.hi, sweep.n, i);
+        else if (i < sweep.n - 1 && roots_bracket(fx[i], fx[i + 1]))
+            sweep.todo.push_back(i);
+    }
+    sweep.pos = 0;
+    return sweep_next();
+}
+
+static int sweep_arg_check(vartype *v) {
+    if (v->type == TYPE_REAL)
+        return ERR_NONE;
+    else if (v->type == TYPE_STRING)
+        return ERR_ALPHA_DATA_IS_INVALID;
+    else
+        return ERR_INVALID_TYPE;
+}
+
+int start_sweep(int kind, const char *name, int length) {
+    if (solve_active() && (kind != SWEEP_INTEG || sweep_active()))
+        return ERR_SOLVE_SOLVE;
+    if (integ_active() && (kind == SWEEP_INTEG || sweep_active()))
+        return ERR_INTEG_INTEG;
+
+    if (kind == SWEEP_ROOTS) {
+        int err;
+        for (int i = 0; i < 3; i++)
+            if ((err = sweep_arg_check(stack[sp - i])) != ERR_NONE)
+                return err;
+        phloat lo = ((vartype_real *) stack[sp - 2])->x;
+        phloat hi = ((vartype_real *) stack[sp - 1])->x;
+        phloat n = ((vartype_real *) stack[sp])->x;
+        if (lo == hi || n < 2 || n >= 2147483648.0 || n != floor(n))
+            return ERR_INVALID_DATA;
+        // The samples are kept in a matrix, which can't be any larger
+        if (n > 2147483647.0 / sizeof(phloat))
+            return ERR_INSUFFICIENT_MEMORY;
+
+        sweep_end();
+        sweep.kind = kind;
+        string_copy(sweep.var_name, &sweep.var_length, name, length);
+        sweep.lo = lo;
+        sweep.hi = hi;
+        sweep.n = to_int4(n);
+        sweep.params = new_realmatrix(sweep.n, 1);
+        sweep.results = new_realmatrix(sweep.n, 1);
+        if (!flags.f.big_stack) {
+            sweep.saved_y = dup_vartype(stack[REG_Y]);
+            sweep.saved_z = dup_vartype(stack[REG_Z]);
+            sweep.saved_t = dup_vartype(stack[REG_T]);
+        }
+        if (sweep.params == NULL || sweep.results == NULL
+                || !flags.f.big_stack && (sweep.saved_y == NULL || sweep.saved_z == NULL || sweep.saved_t == NULL)) {
+            sweep_end();
+            return ERR_INSUFFICIENT_MEMORY;
+        }
+        try {
+            sweep.todo.reserve(sweep.n);
+        } catch (std::bad_alloc &) {
+            sweep_end();
+            return ERR_INSUFFICIENT_MEMORY;
+        }
+        sweep.pos = 0;
+        sweep.caller.set(0);
+        sweep.prev_sp = flags.f.big_stack ? sp : -2;
+        sweep.caller.keep_running = !should_i_stop_at_this_level() && program_running();
+
+        err = sweep_batch_start();
+        if (err == ERR_INTERRUPTIBLE) {
+            mode_interruptible = sweep_worker;
+            mode_stoppable = true;
+            return ERR_INTERRUPTIBLE;
+        } else if (err != ERR_NONE) {
+            sweep_end();
+            return err;
+        }
+        err = start_roots_sampling();
+        if (err != ERR_RUN && sweep.kind != 0)
+            sweep_end();
+        return err;
+    }
+
+
+    vartype *names = stack[sp - 1];
+    vartype *params = stack[sp];
+    int4 n;
+    if (names->type == TYPE_STRING)
+        n = 1;
+    else if (names->type == TYPE_LIST)
+        n = ((vartype_list *) names)->size;
+    else
+        return ERR_INVALID_TYPE;
+    if (params->type == TYPE_STRING)
+        return ERR_ALPHA_DATA_IS_INVALID;
+    if (params->type != TYPE_REALMATRIX)
+        return ERR_INVALID_TYPE;
+    vartype_realmatrix *rm = (vartype_realmatrix *) params;
+    if (rm->columns != n)
+        return ERR_DIMENSION_ERROR;
+    for (int4 i = 0; i < rm->rows * rm->columns; i++)
+        if (rm->array->is_string[i] != 0)
+            return ERR_ALPHA_DATA_IS_INVALID;
+    if (names->type == TYPE_LIST) {
+        vartype_list *list = (vartype_list *) names;
+        for (int4 i = 0; i < n; i++) {
+            vartype *s = list->array->data[i];
+            if (s->type != TYPE_STRING)
+                return ERR_INVALID_TYPE;
+            int len = ((vartype_string *) s)->length;
+            if (len == 0)
+                return ERR_INVALID_DATA;
+            if (len > 7)
+                return ERR_NAME_TOO_LONG;
+        }
+    } else {
+        int len = ((vartype_string *) names)->length;
+        if (len == 0)
+            return ERR_INVALID_DATA;
+        if (len > 7)
+            return ERR_NAME_TOO_LONG;
+    }
+
+    sweep_end();
+    sweep.kind = kind;
+    string_copy(sweep.var_name, &sweep.var_length, name, length);
+    if (names->type == TYPE_LIST) {
+        sweep.names = dup_vartype(names);
+    } else {
+        sweep.names = new_list(1);
+        if (sweep.names != NULL) {
+            vartype *s = dup_vartype(names);
+            if (s == NULL) {
+                free_vartype(sweep.names);
+                sweep.names = NULL;
+            } else
+                ((vartype_list *) sweep.names)->array->data[0] = s;
+        }
+    }
+    sweep.params = dup_vartype(params);
+    sweep.results = new_realmatrix(rm->rows, 2);
+    if (!flags.f.big_stack) {
+        sweep.saved_z = dup_vartype(stack[REG_Z]);
+        sweep.saved_t = dup_vartype(stack[REG_T]);
+    }
+    if (sweep.names == NULL || sweep.params == NULL || sweep.results == NULL
+            || !flags.f.big_stack && (sweep.saved_z == NULL || sweep.saved_t == NULL)) {
+        sweep_end();
+        return ERR_INSUFFICIENT_MEMORY;
+    }
+    try {
+        sweep.todo.resize(rm->rows);
+    } catch (std::bad_alloc &) {
+        sweep_end();
+        return ERR_INSUFFICIENT_MEMORY;
+    }
+    for (int4 i = 0; i < rm->rows; i++)
+        sweep.todo[i] = i;
+    sweep.pos = 0;
+    sweep.caller.set(0);
+    sweep.prev_sp = flags.f.big_stack ? sp : -2;
+    sweep.caller.keep_running = !should_i_stop_at_this_level() && program_running();
+
+    int err = sweep_batch_start();
+    if (err == ERR_INTERRUPTIBLE) {
+        mode_interruptible = sweep_worker;
+        mode_stoppable = true;
+        return ERR_INTERRUPTIBLE;
+    } else if (err != ERR_NONE) {
+        sweep_end();
+        return err;
+    }
+    return sweep_next();
 }
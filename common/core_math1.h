@@ -57,4 +57,10 @@ void get_integ_var(char *name, int *length);
 int start_integ(int prev, const char *name, int length, vartype *solve_info = NULL);
 int return_to_integ(bool stop);
 
+#define SWEEP_SOLVE 1
+#define SWEEP_INTEG 2
+#define SWEEP_ROOTS 3
+
+int start_sweep(int kind, const char *name, int length);
+
 #endif
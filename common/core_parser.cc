@@ -22,6 +22,11 @@
 #include <float.h>
 #include <limits.h>
 #include <sstream>
+#include <new>
+#ifndef BCD_MATH
+#include <atomic>
+#include <thread>
+#endif
 
 #include "core_helpers.h"
 #include "core_parser.h"
@@ -299,6 +304,471 @@ class GeneratorContext {
     }
 };
 
+/////////////////////////
+/////  NumericCode  /////
+/////////////////////////
+
+NumericCode::NumericCode() : depth(0) {
+    angleMode = flags.f.rad ? 1 : flags.f.grad ? 2 : 0;
+    rangeIgnore = flags.f.range_error_ignore;
+}
+
+bool NumericCode::addLiteral(phloat value) {
+    if (++depth > NUMERIC_STACK_MAX)
+        return false;
+    Op op;
+    op.code = LIT;
+    op.slot = 0;
+    op.value = value;
+    ops.push_back(op);
+    return true;
+}
+
+bool NumericCode::addVariable(const std::string &name) {
+    if (++depth > NUMERIC_STACK_MAX)
+        return false;
+    Op op;
+    op.code = VAR;
+    op.slot = slot(name);
+    if (op.slot == -1) {
+        op.slot = (int) vars.size();
+        vars.push_back(name);
+    }
+    op.value = 0;
+    ops.push_back(op);
+    return true;
+}
+
+bool NumericCode::addOp(int code) {
+    if (code >= ADD && code <= POW)
+        depth--;
+    Op op;
+    op.code = code;
+    op.slot = 0;
+    op.value = 0;
+    ops.push_back(op);
+    return true;
+}
+
+bool NumericCode::addFunction(int cmd) {
+    switch (cmd) {
+        case CMD_INV: return addOp(INV);
+        case CMD_SQUARE: return addOp(SQ);
+        case CMD_SQRT: return addOp(SQRT);
+        case CMD_E_POW_X: return addOp(EXP);
+        case CMD_E_POW_X_1: return addOp(EXPM1);
+        case CMD_LN: return addOp(LN);
+        case CMD_LN_1_X: return addOp(LN1P);
+        case CMD_LOG: return addOp(LOG);
+        case CMD_10_POW_X: return addOp(ALOG);
+        case CMD_SIN: return addOp(SIN);
+        case CMD_COS: return addOp(COS);
+        case CMD_TAN: return addOp(TAN);
+        case CMD_ASIN: return addOp(ASIN);
+        case CMD_ACOS: return addOp(ACOS);
+        case CMD_ATAN: return addOp(ATAN);
+        case CMD_SINH: return addOp(SINH);
+        case CMD_COSH: return addOp(COSH);
+        case CMD_TANH: return addOp(TANH);
+        case CMD_ABS: return addOp(ABS);
+        default: return false;
+    }
+}
+
+phloat NumericCode::toAngle(phloat x) const {
+    if (angleMode == 1)
+        return x;
+    else if (angleMode == 2)
+        return x * (200 / PI);
+    else
+        return rad_to_deg(x);
+}
+
+int NumericCode::slot(const std::string &name) const {
+    for (int i = 0; i < (int) vars.size(); i++)
+        if (vars[i] == name)
+            return i;
+    return -1;
+}
+
+/* When dslot is not -1, the derivative with respect to the variable in that
+ * slot is computed alongside the value, by applying the chain rule at every
+ * step; eval() returns false if the derivative doesn't exist or isn't finite.
+ */
+bool NumericCode::eval(const phloat *vals, phloat *result, int dslot, phloat *deriv) const {
+    phloat stk[NUMERIC_STACK_MAX];
+    phloat dstk[NUMERIC_STACK_MAX];
+    bool diff = dslot != -1;
+    int sp = -1;
+    for (size_t i = 0; i < ops.size(); i++) {
+        const Op *op = &ops[i];
+        phloat x, y, r, dx, dy, dr;
+        switch (op->code) {
+            case LIT:
+                stk[++sp] = op->value;
+                dstk[sp] = 0;
+                continue;
+            case VAR:
+                stk[++sp] = vals[op->slot];
+                dstk[sp] = op->slot == dslot ? 1 : 0;
+                continue;
+            case SWAP:
+                x = stk[sp];
+                stk[sp] = stk[sp - 1];
+                stk[sp - 1] = x;
+                dx = dstk[sp];
+                dstk[sp] = dstk[sp - 1];
+                dstk[sp - 1] = dx;
+                continue;
+        }
+        if (op->code <= POW) {
+            dx = dstk[sp];
+            x = stk[sp--];
+            dy = dstk[sp];
+            y = stk[sp];
+        } else {
+            dx = dstk[sp];
+            x = stk[sp];
+            // Not used by unary operations; set for derivative()
+            dy = y = 0;
+        }
+        switch (op->code) {
+            case ADD: r = y + x; break;
+            case SUB: r = y - x; break;
+            case MUL: r = y * x; break;
+            case DIV:
+                if (x == 0)
+                    return false;
+                r = y / x;
+                break;
+            case POW:
+                if (x == floor(x)) {
+                    if (x == 0 && y == 0)
+                        return false;
+                } else if (y < 0) {
+                    return false;
+                }
+                r = pow(y, x);
+                break;
+            case NEG: r = -x; break;
+            case INV:
+                if (x == 0)
+                    return false;
+                r = 1 / x;
+                break;
+            case SQ: r = x * x; break;
+            case SQRT:
+                if (x < 0)
+                    return false;
+                r = sqrt(x);
+                break;
+            case EXP: r = exp(x); break;
+            case EXPM1: r = expm1(x); break;
+            case LN:
+                if (x <= 0)
+                    return false;
+                r = log(x);
+                break;
+            case LN1P:
+                if (x <= -1)
+                    return false;
+                r = log1p(x);
+                break;
+            case LOG:
+                if (x <= 0)
+                    return false;
+                r = log10(x);
+                break;
+            case ALOG: r = pow(phloat(10), x); break;
+            case SIN:
+                r = angleMode == 1 ? sin(x) : angleMode == 2 ? sin_grad(x) : sin_deg(x);
+                break;
+            case COS:
+                r = angleMode == 1 ? cos(x) : angleMode == 2 ? cos_grad(x) : cos_deg(x);
+                break;
+            case TAN:
+                if (angleMode == 1) {
+                    r = tan(x);
+                } else {
+                    phloat c = angleMode == 2 ? cos_grad(x) : cos_deg(x);
+                    if (c == 0)
+                        return false;
+                    r = (angleMode == 2 ? sin_grad(x) : sin_deg(x)) / c;
+                }
+                break;
+            case ASIN:
+                if (x < -1 || x > 1)
+                    return false;
+                if (angleMode != 1 && (x == 1 || x == -1))
+                    r = x * (angleMode == 2 ? 100 : 90);
+                else
+                    r = toAngle(asin(x));
+                break;
+            case ACOS:
+                if (x < -1 || x > 1)
+                    return false;
+                if (angleMode != 1 && x == 0)
+                    r = angleMode == 2 ? 100 : 90;
+                else if (angleMode != 1 && x == -1)
+                    r = angleMode == 2 ? 200 : 180;
+                else
+                    r = toAngle(acos(x));
+                break;
+            case ATAN:
+                if (angleMode != 1 && (x == 1 || x == -1))
+                    r = x * (angleMode == 2 ? 50 : 45);
+                else
+                    r = toAngle(atan(x));
+                break;
+            case SINH: r = sinh(x); break;
+            case COSH: r = cosh(x); break;
+            case TANH: r = tanh(x); break;
+            case ABS: r = fabs(x); break;
+            default: return false;
+        }
+        if (p_isnan(r))
+            return false;
+        int inf = p_isinf(r);
+        if (inf != 0) {
+            if (!rangeIgnore)
+                return false;
+            r = inf < 0 ? NEG_HUGE_PHLOAT : POS_HUGE_PHLOAT;
+        }
+        stk[sp] = r;
+        if (!diff)
+            continue;
+        if (!derivative(op->code, x, y, r, dx, dy, &dr))
+            return false;
+        dstk[sp] = dr;
+    }
+    if (sp != 0)
+        return false;
+    *result = stk[0];
+    if (diff)
+        *deriv = dstk[0];
+    return true;
+}
+
+/* The derivative of one step, given its operands x (and y, for binary
+ * operations), their derivatives dx and dy, and the result r.
+ */
+bool NumericCode::derivative(int code, phloat x, phloat y, phloat r, phloat dx, phloat dy, phloat *dr) const {
+    // Angles in DEG and GRAD mode are scaled radians
+    phloat k = angleMode == 1 ? phloat(1) : angleMode == 2 ? PI / 200 : PI / 180;
+    phloat d;
+    switch (code) {
+        case ADD: d = dy + dx; break;
+        case SUB: d = dy - dx; break;
+        case MUL: d = dy * x + y * dx; break;
+        case DIV: d = (dy - r * dx) / x; break;
+        case POW:
+            if (dx == 0) {
+                // Constant exponent
+                if (dy == 0)
+                    d = 0;
+                else if (y == 0)
+                    return false;
+                else
+                    d = x * r / y * dy;
+            } else {
+                if (y <= 0)
+                    return false;
+                d = r * (dx * log(y) + x * dy / y);
+            }
+            break;
+        case NEG: d = -dx; break;
+        case INV: d = -r * r * dx; break;
+        case SQ: d = 2 * x * dx; break;
+        case SQRT:
+            if (r == 0)
+                return false;
+            d = dx / (2 * r);
+            break;
+        case EXP: d = r * dx; break;
+        case EXPM1: d = (r + 1) * dx; break;
+        case LN: d = dx / x; break;
+        case LN1P: d = dx / (x + 1); break;
+        case LOG: d = dx / (x * log(phloat(10))); break;
+        case ALOG: d = r * log(phloat(10)) * dx; break;
+        case SIN:
+            d = (angleMode == 1 ? cos(x) : angleMode == 2 ? cos_grad(x) : cos_deg(x)) * k * dx;
+            break;
+        case COS:
+            d = -(angleMode == 1 ? sin(x) : angleMode == 2 ? sin_grad(x) : sin_deg(x)) * k * dx;
+            break;
+        case TAN: d = (1 + r * r) * k * dx; break;
+        case ASIN:
+        case ACOS:
+            if (x == 1 || x == -1)
+                return false;
+            d = dx / (sqrt(1 - x * x) * k);
+            if (code == ACOS)
+                d = -d;
+            break;
+        case ATAN: d = dx / ((1 + x * x) * k); break;
+        case SINH: d = cosh(x) * dx; break;
+        case COSH: d = sinh(x) * dx; break;
+        case TANH: d = (1 - r * r) * dx; break;
+        case ABS:
+            /* Newton steps don't help with kinks; returning false makes the
+             * solver stick with the secant method for these
+             */
+            if (dx != 0)
+                return false;
+            d = 0;
+            break;
+        default:
+            return false;
+    }
+    if (p_isnan(d) || p_isinf(d) != 0)
+        return false;
+    *dr = d;
+    return true;
+}
+
+struct numeric_batch {
+    const NumericCode *code;
+    std::vector<phloat> vals;
+    int slot;
+    std::vector<phloat> xs;
+    std::vector<phloat> ys;
+    int n;
+#ifdef BCD_MATH
+    std::vector<char> ok;
+    int done;
+#else
+    std::atomic<char> *state; // 0 = pending, 1 = failed, 2 = done
+    std::atomic<int> next;
+    std::atomic<bool> cancelled;
+    std::vector<std::thread> threads;
+    int done;
+#endif
+};
+
+#ifndef BCD_MATH
+static void numeric_batch_thread(numeric_batch *b) {
+    std::vector<phloat> vals = b->vals;
+    while (!b->cancelled) {
+        int i = b->next++;
+        if (i >= b->n)
+            break;
+        vals[b->slot] = b->xs[i];
+        phloat y;
+        bool ok = b->code->eval(vals.data(), &y);
+        b->ys[i] = y;
+        b->state[i].store(ok ? 2 : 1, std::memory_order_release);
+    }
+}
+#endif
+
+numeric_batch *numeric_batch_start(const NumericCode *code, const phloat *vals, int slot, const phloat *xs, int n) {
+    numeric_batch *b = new (std::nothrow) numeric_batch;
+    if (b == NULL)
+        return NULL;
+    b->code = code;
+    b->vals.assign(vals, vals + code->vars.size());
+    b->slot = slot;
+    b->xs.assign(xs, xs + n);
+    b->ys.resize(n);
+    b->n = n;
+    b->done = 0;
+#ifdef BCD_MATH
+    b->ok.resize(n);
+#else
+    b->state = new (std::nothrow) std::atomic<char>[n];
+    if (b->state == NULL) {
+        delete b;
+        return NULL;
+    }
+    for (int i = 0; i < n; i++)
+        b->state[i].store(0);
+    b->next = 0;
+    b->cancelled = false;
+    int nthreads = std::thread::hardware_concurrency();
+    if (nthreads < 1)
+        nthreads = 1;
+    else if (nthreads > 16)
+        nthreads = 16;
+    if (nthreads > n)
+        nthreads = n;
+    for (int i = 0; i < nthreads; i++) {
+        try {
+            b->threads.push_back(std::thread(numeric_batch_thread, b));
+        } catch (...) {
+            // Whatever isn't picked up by threads is done by
+            // numeric_batch_poll() on the calling thread
+            break;
+        }
+    }
+#endif
+    return b;
+}
+
+int numeric_batch_poll(numeric_batch *b) {
+#ifdef BCD_MATH
+    /* Evaluate a few points per call, so the caller can keep the display
+     * up to date and respond to the keyboard
+     */
+    std::vector<phloat> vals = b->vals;
+    int end = b->done + 16;
+    if (end > b->n)
+        end = b->n;
+    while (b->done < end) {
+        int i = b->done++;
+        vals[b->slot] = b->xs[i];
+        phloat y;
+        b->ok[i] = b->code->eval(vals.data(), &y);
+        b->ys[i] = y;
+    }
+#else
+    if (b->threads.empty()) {
+        // No worker threads; do the work here, a few points at a time
+        std::vector<phloat> vals = b->vals;
+        for (int k = 0; k < 16; k++) {
+            int i = b->next++;
+            if (i >= b->n)
+                break;
+            vals[b->slot] = b->xs[i];
+            phloat y;
+            bool ok = b->code->eval(vals.data(), &y);
+            b->ys[i] = y;
+            b->state[i].store(ok ? 2 : 1, std::memory_order_release);
+        }
+    }
+    int prev = b->done;
+    while (b->done < b->n && b->state[b->done].load(std::memory_order_acquire) != 0)
+        b->done++;
+    if (b->done == prev && b->done < b->n)
+        // Nothing new yet; don't make the caller spin
+        std::this_thread::yield();
+#endif
+    return b->done;
+}
+
+bool numeric_batch_result(numeric_batch *b, int i, phloat *y) {
+#ifdef BCD_MATH
+    if (!b->ok[i])
+        return false;
+#else
+    if (b->state[i].load(std::memory_order_acquire) != 2)
+        return false;
+#endif
+    *y = b->ys[i];
+    return true;
+}
+
+void numeric_batch_finish(numeric_batch *b) {
+    if (b == NULL)
+        return;
+#ifndef BCD_MATH
+    b->cancelled = true;
+    for (size_t i = 0; i < b->threads.size(); i++)
+        b->threads[i].join();
+    delete[] b->state;
+#endif
+    delete b;
+}
+
 //////////////////////////////////////////////
 /////  Boilerplate Evaluator subclasses  /////
 //////////////////////////////////////////////
@@ -346,6 +816,10 @@ class UnaryFunction : public UnaryEvaluator {
         ev->generateCode(ctx);
         ctx->addLine(tpos, cmd);
     }
+
+    bool generateNumericCode(NumericCode *code) {
+        return ev->generateNumericCode(code) && code->addFunction(cmd);
+    }
 };
 
 class InvertibleUnaryFunction : public UnaryEvaluator {
@@ -370,6 +844,10 @@ class InvertibleUnaryFunction : public UnaryEvaluator {
         ev->generateCode(ctx);
         ctx->addLine(tpos, cmd);
     }
+
+    bool generateNumericCode(NumericCode *code) {
+        return ev->generateNumericCode(code) && code->addFunction(cmd);
+    }
 };
 
 class BinaryEvaluator : public Evaluator {
@@ -529,6 +1007,10 @@ class RecallFunction : public Evaluator {
         ctx->addLine(tpos, cmd);
     }
 
+    bool generateNumericCode(NumericCode *code) {
+        return cmd == CMD_PI && code->addLiteral(PI);
+    }
+
     void collectVariables(std::vector<std::string> *vars, std::vector<std::string> *locals) {
         // nope
     }
@@ -1313,6 +1795,13 @@ class Difference : public BinaryEvaluator {
             ctx->addLine(tpos, CMD_SWAP);
         ctx->addLine(tpos, CMD_SUB);
     }
+
+    bool generateNumericCode(NumericCode *code) {
+        return left->generateNumericCode(code)
+            && right->generateNumericCode(code)
+            && (!swapArgs || code->addOp(NumericCode::SWAP))
+            && code->addOp(NumericCode::SUB);
+    }
 };
 
 /////////////////
@@ -1418,6 +1907,12 @@ class Equation : public BinaryEvaluator {
         right->generateCode(ctx);
         ctx->addLine(tpos, CMD_SUB);
     }
+
+    bool generateNumericCode(NumericCode *code) {
+        return left->generateNumericCode(code)
+            && right->generateNumericCode(code)
+            && code->addOp(NumericCode::SUB);
+    }
 };
 
 /////////////////
@@ -1954,6 +2449,10 @@ class Literal : public Evaluator {
         ctx->addLine(tpos, value);
     }
 
+    bool generateNumericCode(NumericCode *code) {
+        return code->addLiteral(value);
+    }
+
     void collectVariables(std::vector<std::string> *vars, std::vector<std::string> *locals) {
         // nope
     }
@@ -2137,6 +2636,10 @@ class NameTag : public UnaryEvaluator {
         ev->generateCode(ctx);
     }
 
+    bool generateNumericCode(NumericCode *code) {
+        return ev->generateNumericCode(code);
+    }
+
     void collectVariables(std::vector<std::string> *vars, std::vector<std::string> *locals) {
         /* Force parameters to be at the head of the list */
         if (params != NULL)
@@ -2169,6 +2672,10 @@ class Negative : public UnaryEvaluator {
         ev->generateCode(ctx);
         ctx->addLine(tpos, CMD_CHS);
     }
+
+    bool generateNumericCode(NumericCode *code) {
+        return ev->generateNumericCode(code) && code->addOp(NumericCode::NEG);
+    }
 };
 
 ////////////////////
@@ -2304,6 +2811,13 @@ class Power : public BinaryEvaluator {
             ctx->addLine(tpos, CMD_SWAP);
         ctx->addLine(tpos, CMD_Y_POW_X);
     }
+
+    bool generateNumericCode(NumericCode *code) {
+        return left->generateNumericCode(code)
+            && right->generateNumericCode(code)
+            && (!swapArgs || code->addOp(NumericCode::SWAP))
+            && code->addOp(NumericCode::POW);
+    }
 };
 
 /////////////////////
@@ -2327,6 +2841,12 @@ class Product : public BinaryEvaluator {
         right->generateCode(ctx);
         ctx->addLine(tpos, CMD_MUL);
     }
+
+    bool generateNumericCode(NumericCode *code) {
+        return left->generateNumericCode(code)
+            && right->generateNumericCode(code)
+            && code->addOp(NumericCode::MUL);
+    }
 };
 
 //////////////////////
@@ -2353,6 +2873,13 @@ class Quotient : public BinaryEvaluator {
             ctx->addLine(tpos, CMD_SWAP);
         ctx->addLine(tpos, CMD_DIV);
     }
+
+    bool generateNumericCode(NumericCode *code) {
+        return left->generateNumericCode(code)
+            && right->generateNumericCode(code)
+            && (!swapArgs || code->addOp(NumericCode::SWAP))
+            && code->addOp(NumericCode::DIV);
+    }
 };
 
 ////////////////////
@@ -2799,6 +3326,12 @@ class Sum : public BinaryEvaluator {
         right->generateCode(ctx);
         ctx->addLine(tpos, CMD_ADD);
     }
+
+    bool generateNumericCode(NumericCode *code) {
+        return left->generateNumericCode(code)
+            && right->generateNumericCode(code)
+            && code->addOp(NumericCode::ADD);
+    }
 };
 
 /////////////////
@@ -2974,6 +3507,10 @@ class Variable : public Evaluator {
         ctx->addLine(tpos, CMD_RCL, nam);
     }
 
+    bool generateNumericCode(NumericCode *code) {
+        return code->addVariable(nam);
+    }
+
     void collectVariables(std::vector<std::string> *vars, std::vector<std::string> *locals) {
         addIfNew(nam, vars, locals);
     }
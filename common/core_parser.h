@@ -32,6 +32,7 @@
 
 class GeneratorContext;
 class For;
+class NumericCode;
 
 class Evaluator {
 
@@ -56,6 +57,7 @@ class Evaluator {
 
     virtual Evaluator *invert(const std::string &name, Evaluator *rhs);
     virtual void generateCode(GeneratorContext *ctx) = 0;
+    virtual bool generateNumericCode(NumericCode *code) { return false; }
     virtual void generateAssignmentCode(GeneratorContext *ctx) {} /* For lvalues */
     virtual void collectVariables(std::vector<std::string> *vars, std::vector<std::string> *locals) = 0;
     virtual int howMany(const std::string &name) = 0;
@@ -85,6 +87,70 @@ class CodeMap {
     int getSize() { return size; }
 };
 
+/* NumericCode is a side-effect-free form of an equation, that can be
+ * evaluated without going through the interpreter, and by several threads
+ * at once. Only real-valued expressions made of literals, variables,
+ * arithmetic, powers, and the elementary functions have this form;
+ * generateNumericCode() returns false for everything else. The variables
+ * are numbered in order of first appearance, and eval() takes their values
+ * in that order. eval() returns false where the interpreter would return
+ * an error or a complex result. It can also return the derivative with
+ * respect to one of the variables, which the solver uses for Newton steps.
+ */
+
+#define NUMERIC_STACK_MAX 32
+
+class NumericCode {
+
+    public:
+
+    enum {
+        LIT, VAR, SWAP, ADD, SUB, MUL, DIV, POW, NEG, INV, SQ, SQRT,
+        EXP, EXPM1, LN, LN1P, LOG, ALOG, SIN, COS, TAN, ASIN, ACOS, ATAN,
+        SINH, COSH, TANH, ABS
+    };
+
+    struct Op {
+        int code;
+        int slot;
+        phloat value;
+    };
+
+    std::vector<Op> ops;
+    std::vector<std::string> vars;
+
+    NumericCode();
+    bool addLiteral(phloat value);
+    bool addVariable(const std::string &name);
+    bool addOp(int code);
+    bool addFunction(int cmd);
+    int slot(const std::string &name) const;
+    bool eval(const phloat *vals, phloat *result, int dslot = -1, phloat *deriv = NULL) const;
+
+    private:
+
+    int depth;
+    int angleMode; // 0 = DEG, 1 = RAD, 2 = GRAD
+    bool rangeIgnore;
+
+    phloat toAngle(phloat x) const;
+    bool derivative(int code, phloat x, phloat y, phloat r, phloat dx, phloat dy, phloat *dr) const;
+};
+
+/* Evaluates a NumericCode at n points, varying the variable in the given
+ * slot, with the other variables taking their values from 'vals'. In
+ * binary builds, the points are evaluated by a pool of worker threads;
+ * in decimal builds, the BID library's global status flags rule that
+ * out, and numeric_batch_poll() evaluates a few points at a time on the
+ * calling thread instead. numeric_batch_poll() returns the number of
+ * leading points that have been evaluated so far.
+ */
+struct numeric_batch;
+numeric_batch *numeric_batch_start(const NumericCode *code, const phloat *vals, int slot, const phloat *xs, int n);
+int numeric_batch_poll(numeric_batch *b);
+bool numeric_batch_result(numeric_batch *b, int i, phloat *y);
+void numeric_batch_finish(numeric_batch *b);
+
 class Lexer;
 struct prgm_struct;
 
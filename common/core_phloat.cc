@@ -42,6 +42,19 @@ phloat NAN_1_PHLOAT;
 phloat NAN_2_PHLOAT;
 
 
+/* 64 x 64 -> 128 bit unsigned multiply, used by the fast decimal
+ * conversions below. Portable, i.e. no __int128 or compiler intrinsics.
+ */
+static void mul64(uint8 a, uint8 b, uint8 *hi, uint8 *lo) {
+    uint8 a0 = a & 0xffffffffULL, a1 = a >> 32;
+    uint8 b0 = b & 0xffffffffULL, b1 = b >> 32;
+    uint8 p00 = a0 * b0, p01 = a0 * b1, p10 = a1 * b0, p11 = a1 * b1;
+    uint8 mid = (p00 >> 32) + (p01 & 0xffffffffULL) + (p10 & 0xffffffffULL);
+    *lo = (mid << 32) | (p00 & 0xffffffffULL);
+    *hi = p11 + (p01 >> 32) + (p10 >> 32) + (mid >> 32);
+}
+
+
 #ifdef BCD_MATH
 
 
@@ -65,6 +78,116 @@ void phloat_init() {
     bid128_nan(&NAN_2_PHLOAT.val, "2");
 }
 
+/* Fast path for string2phloat(): parses [-]digits[.digits][E[-]digits],
+ * with at most 34 mantissa digits, and encodes the result directly, as long
+ * as it is exactly representable. The coefficient and exponent are the same
+ * ones bid128_from_string() would produce, so the result is bit-identical.
+ * Returns false for anything else, letting the library deal with it.
+ */
+static bool decimal_from_string(const char *s, BID_UINT128 *b) {
+    bool neg = false;
+    if (*s == '-') {
+        neg = true;
+        s++;
+    }
+    uint8 hi = 0, lo = 0;
+    int digits = 0, exp = 0;
+    bool seen_dot = false;
+    while (true) {
+        char c = *s;
+        if (c >= '0' && c <= '9') {
+            if (++digits > 34)
+                return false;
+            uint8 h;
+            mul64(lo, 10, &h, &lo);
+            hi = hi * 10 + h;
+            uint8 l = lo + (c - '0');
+            if (l < lo)
+                hi++;
+            lo = l;
+            if (seen_dot)
+                exp--;
+        } else if (c == '.' && !seen_dot) {
+            seen_dot = true;
+        } else
+            break;
+        s++;
+    }
+    if (digits == 0)
+        return false;
+    if (*s == 'E') {
+        s++;
+        bool eneg = false;
+        if (*s == '-' || *s == '+')
+            eneg = *s++ == '-';
+        int e = 0, edigits = 0;
+        while (*s >= '0' && *s <= '9') {
+            if (++edigits > 5)
+                return false;
+            e = e * 10 + (*s++ - '0');
+        }
+        if (edigits == 0)
+            return false;
+        exp += eneg ? -e : e;
+    }
+    if (*s != 0)
+        return false;
+    exp += 6176;
+    if (exp < 0 || exp > 12287)
+        return false;
+    b->w[BID_HIGH_128W] = (neg ? 0x8000000000000000ULL : 0)
+                            | (uint8) exp << 49 | hi;
+    b->w[BID_LOW_128W] = lo;
+    return true;
+}
+
+/* Fast path for phloat2string(): extracts the decimal digits of a finite
+ * number straight from the BID128 coefficient, instead of going through
+ * bid128_to_string() and parsing the result. Returns false for Inf, NaN,
+ * and non-canonical encodings.
+ */
+static bool phloat_digits(phloat pd, char *mantissa, int *exponent, int *sign) {
+    uint8 hi = pd.val.w[BID_HIGH_128W];
+    uint8 lo = pd.val.w[BID_LOW_128W];
+    if ((hi & 0x6000000000000000ULL) == 0x6000000000000000ULL)
+        return false;
+    int exp = (int) ((hi >> 49) & 0x3fff) - 6176;
+    int neg = (int) (hi >> 63);
+    hi &= 0x1ffffffffffffULL;
+    // Coefficients >= 10^34 are non-canonical
+    if (hi > 0x1ed09bead87c0ULL || hi == 0x1ed09bead87c0ULL
+                                    && lo >= 0x378d8e6400000000ULL)
+        return false;
+
+    // Peel off 9 digits at a time, dividing 32-bit limbs by 10^9
+    uint4 limb[4] = { (uint4) (hi >> 32), (uint4) hi,
+                      (uint4) (lo >> 32), (uint4) lo };
+    char digits[36];
+    for (int chunk = 3; chunk >= 0; chunk--) {
+        uint8 rem = 0;
+        for (int i = 0; i < 4; i++) {
+            uint8 n = rem << 32 | limb[i];
+            limb[i] = (uint4) (n / 1000000000);
+            rem = n % 1000000000;
+        }
+        for (int i = 8; i >= 0; i--) {
+            digits[chunk * 9 + i] = (char) (rem % 10);
+            rem /= 10;
+        }
+    }
+    int start = 0;
+    while (start < 36 && digits[start] == 0)
+        start++;
+    if (start == 36)
+        // Zero; leave everything at its defaults
+        return true;
+    int n = 36 - start;
+    memcpy(mantissa, digits + start, n);
+    *exponent = exp + n - 1;
+    *sign = neg;
+    return true;
+}
+
 int string2phloat(const char *buf, int buflen, phloat *d) {
     /* Convert string to phloat.
      * Return values:
@@ -133,7 +256,8 @@ int string2phloat(const char *buf, int buflen, phloat *d) {
 
     buf2[buflen2] = 0;
     BID_UINT128 b;
-    bid128_from_string(&b, buf2);
+    if (!decimal_from_string(buf2, &b))
+        bid128_from_string(&b, buf2);
     int r;
     if (bid128_isInf(&r, &b), r)
         return (bid128_isSigned(&r, &b), r) ? 2 : 1;
@@ -814,6 +938,165 @@ void phloat_init() {
     NAN_PHLOAT = nan("");
 }
 
+/* Powers of ten as 64-bit normalized mantissas: 10^n ~= m * 2^e.
+ * pow10_big holds 10^(16*i - 304), rounded to nearest; pow10_small holds
+ * 10^i, exactly. Between them they cover everything phloat_digits() needs.
+ */
+struct pow10_entry {
+    uint8 m;
+    int e;
+};
+
+static const pow10_entry pow10_big[41] = {
+    { 0x8c71dcd9ba0b4926ULL, -1073 }, // 1e-304
+    { 0x9becce62836ac577ULL, -1020 }, // 1e-288
+    { 0xad1c8eab5ee43b67ULL, -967 }, // 1e-272
+    { 0xc0314325637a193aULL, -914 }, // 1e-256
+    { 0xd5605fcdcf32e1d7ULL, -861 }, // 1e-240
+    { 0xece53cec4a314ebeULL, -808 }, // 1e-224
+    { 0x8380dea93da4bc60ULL, -754 }, // 1e-208
+    { 0x91ff83775423cc06ULL, -701 }, // 1e-192
+    { 0xa21727db38cb0030ULL, -648 }, // 1e-176
+    { 0xb3f4e093db73a093ULL, -595 }, // 1e-160
+    { 0xc7caba6e7c5382c9ULL, -542 }, // 1e-144
+    { 0xddd0467c64bce4a1ULL, -489 }, // 1e-128
+    { 0xf64335bcf065d37dULL, -436 }, // 1e-112
+    { 0x88b402f7fd75539bULL, -382 }, // 1e-96
+    { 0x97c560ba6b0919a6ULL, -329 }, // 1e-80
+    { 0xa87fea27a539e9a5ULL, -276 }, // 1e-64
+    { 0xbb127c53b17ec159ULL, -223 }, // 1e-48
+    { 0xcfb11ead453994baULL, -170 }, // 1e-32
+    { 0xe69594bec44de15bULL, -117 }, // 1e-16
+    { 0x8000000000000000ULL, -63 }, // 1e0
+    { 0x8e1bc9bf04000000ULL, -10 }, // 1e16
+    { 0x9dc5ada82b70b59eULL, 43 }, // 1e32
+    { 0xaf298d050e4395d7ULL, 96 }, // 1e48
+    { 0xc2781f49ffcfa6d5ULL, 149 }, // 1e64
+    { 0xd7e77a8f87daf7fcULL, 202 }, // 1e80
+    { 0xefb3ab16c59b14a3ULL, 255 }, // 1e96
+    { 0x850fadc09923329eULL, 309 }, // 1e112
+    { 0x93ba47c980e98ce0ULL, 362 }, // 1e128
+    { 0xa402b9c5a8d3a6e7ULL, 415 }, // 1e144
+    { 0xb616a12b7fe617aaULL, 468 }, // 1e160
+    { 0xca28a291859bbf93ULL, 521 }, // 1e176
+    { 0xe070f78d3927556bULL, 574 }, // 1e192
+    { 0xf92e0c3537826146ULL, 627 }, // 1e208
+    { 0x8a5296ffe33cc930ULL, 681 }, // 1e224
+    { 0x9991a6f3d6bf1766ULL, 734 }, // 1e240
+    { 0xaa7eebfb9df9de8eULL, 787 }, // 1e256
+    { 0xbd49d14aa79dbc82ULL, 840 }, // 1e272
+    { 0xd226fc195c6a2f8cULL, 893 }, // 1e288
+    { 0xe950df20247c83fdULL, 946 }, // 1e304
+    { 0x81842f29f2cce376ULL, 1000 }, // 1e320
+    { 0x8fcac257558ee4e6ULL, 1053 }, // 1e336
+};
+
+static const pow10_entry pow10_small[16] = {
+    { 0x8000000000000000ULL, -63 }, // 1e0
+    { 0xa000000000000000ULL, -60 }, // 1e1
+    { 0xc800000000000000ULL, -57 }, // 1e2
+    { 0xfa00000000000000ULL, -54 }, // 1e3
+    { 0x9c40000000000000ULL, -50 }, // 1e4
+    { 0xc350000000000000ULL, -47 }, // 1e5
+    { 0xf424000000000000ULL, -44 }, // 1e6
+    { 0x9896800000000000ULL, -40 }, // 1e7
+    { 0xbebc200000000000ULL, -37 }, // 1e8
+    { 0xee6b280000000000ULL, -34 }, // 1e9
+    { 0x9502f90000000000ULL, -30 }, // 1e10
+    { 0xba43b74000000000ULL, -27 }, // 1e11
+    { 0xe8d4a51000000000ULL, -24 }, // 1e12
+    { 0x9184e72a00000000ULL, -20 }, // 1e13
+    { 0xb5e620f480000000ULL, -17 }, // 1e14
+    { 0xe35fa931a0000000ULL, -14 }, // 1e15
+};
+
+/* Fast path for phloat2string(): produces the same 16 correctly rounded
+ * significant digits as sprintf("%.15e"), using a 64-bit approximation of
+ * the appropriate power of ten, in the manner of Grisu. The scaled value is
+ * accurate to better than 2^-9 units, so the rounding decision is only
+ * ambiguous when the discarded fraction is very close to one half; in those
+ * cases, and for Inf and NaN, this returns false and the caller falls back
+ * on sprintf().
+ */
+static bool phloat_digits(phloat pd, char *mantissa, int *exponent, int *sign) {
+    double d = pd;
+    if (d == 0)
+        // Leave everything at its defaults
+        return true;
+    uint8 bits;
+    memcpy(&bits, &d, 8);
+    int be = (int) ((bits >> 52) & 0x7ff);
+    uint8 f = bits & 0xfffffffffffffULL;
+    int e;
+    if (be == 0x7ff)
+        return false;
+    if (be == 0) {
+        e = -1074;
+        while ((f & 0x10000000000000ULL) == 0) {
+            f <<= 1;
+            e--;
+        }
+    } else {
+        f |= 0x10000000000000ULL;
+        e = be - 1075;
+    }
+
+    /* |d| = f * 2^e, with 2^52 <= f < 2^53. The decimal exponent is either
+     * this estimate or one more; if the scaled value comes out with 17
+     * digits, we bump it and try again.
+     */
+    int e10 = (int) floor((e + 52) * 0.30102999566398120);
+    for (int pass = 0; pass < 2; pass++) {
+        int p = 15 - e10 + 304;
+        const pow10_entry *pb = pow10_big + (p >> 4);
+        const pow10_entry *ps = pow10_small + (p & 15);
+        uint8 hi, lo;
+        mul64(pb->m, ps->m, &hi, &lo);
+        int pe = pb->e + ps->e + 64;
+        if ((hi >> 63) == 0) {
+            hi = hi << 1 | lo >> 63;
+            pe--;
+        }
+        mul64(f, hi, &hi, &lo);
+        int sh = -(e + pe);
+        uint8 n, frac;
+        if (sh > 64 && sh < 128) {
+            n = hi >> (sh - 64);
+            frac = hi << (128 - sh) | lo >> (sh - 64);
+        } else if (sh == 64) {
+            n = hi;
+            frac = lo;
+        } else if (sh > 0 && sh < 64 && (hi >> sh) == 0) {
+            n = hi << (64 - sh) | lo >> sh;
+            frac = lo << (64 - sh);
+        } else
+            return false;
+        if (n >= 10000000000000000ULL) {
+            e10++;
+            continue;
+        }
+        uint8 half = 0x8000000000000000ULL;
+        uint8 dist = frac > half ? frac - half : half - frac;
+        if (dist < 0x100000000000000ULL)
+            return false;
+        if (frac > half)
+            n++;
+        if (n == 10000000000000000ULL) {
+            n = 1000000000000000ULL;
+            e10++;
+        } else if (n < 1000000000000000ULL)
+            return false;
+        for (int i = 15; i >= 0; i--) {
+            mantissa[i] = (char) (n % 10);
+            n /= 10;
+        }
+        *exponent = e10;
+        *sign = (int) (bits >> 63);
+        return true;
+    }
+    return false;
+}
+
 int string2phloat(const char *buf, int buflen, phloat *d) {
     /* Convert string to phloat.
      * Return values:
@@ -913,6 +1196,30 @@ int string2phloat(const char *buf, int buflen, phloat *d) {
      * 'exp' contains the normalized signed exponent,
      * and 'mant_sign' contains the mantissa's sign.
      */
+
+#if !defined(FLT_EVAL_METHOD) || FLT_EVAL_METHOD == 0
+    /* Fast path: if the mantissa, stripped of trailing zeroes, fits in 53
+     * bits, and the power of ten is exact in a double as well, a single
+     * multiplication or division gives the correctly rounded result.
+     */
+    static const double exact_pow10[23] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+    uint8 m = 0;
+    int mlen = 16;
+    while (mantissa[mlen - 1] == 0)
+        mlen--;
+    for (i = 0; i < mlen; i++)
+        m = m * 10 + mantissa[i];
+    int p = exp - (mlen - 1);
+    if (m < 0x20000000000000ULL && p >= -22 && p <= 22) {
+        res = p < 0 ? (double) m / exact_pow10[-p] : (double) m * exact_pow10[p];
+        *d = mant_sign ? -res : res;
+        return 0;
+    }
+#endif
+
     char decstr[35];
     char *cp = decstr;
     if (mant_sign)
@@ -955,8 +1262,62 @@ double decimal2double(void *data, bool pin_magnitude /* = false */) {
 #endif // BCD_MATH
 
 
-int phloat2string(phloat pd, char *buf, int buflen, int base_mode, int digits,
-                         int dispmode, int thousandssep, int max_mant_digits,
+/* The general way of getting the digits for phloat2string(): have the
+ * library format the number, and parse the result.
+ */
+static void phloat_digits_slow(phloat pd, char *mantissa, int *exponent,
+                                                                int *sign) {
+    char decstr[50];
+
+#ifndef BCD_MATH
+    double d = to_double(pd);
+    sprintf(decstr, "%.15e", d);
+#else
+    bid128_to_string(decstr, &pd.val);
+#endif
+
+    char *p = decstr;
+    int mant_index = 0;
+    *sign = 0;
+    bool seen_dot = false;
+    bool in_leading_zeroes = true;
+    int exp_offset = -1;
+
+    while (*p != 0) {
+        char c = *p++;
+        if (c == '-') {
+            *sign = 1;
+            continue;
+        }
+        if (c == '+')
+            continue;
+        if (c == '.') {
+            seen_dot = true;
+            continue;
+        }
+        if (c == 'e' || c == 'E') {
+            if (!in_leading_zeroes) {
+                sscanf(p, "%d", exponent);
+                *exponent += exp_offset;
+            }
+            break;
+        }
+        // Can only be decimal digit at this point
+        if (c == '0') {
+            if (in_leading_zeroes)
+                continue;
+        } else
+            in_leading_zeroes = false;
+        if (!seen_dot)
+            exp_offset++;
+        if (mant_index < MAX_MANT_DIGITS)
+            mantissa[mant_index++] = c - '0';
+    }
+}
+
+static int phloat2string_uncached(phloat pd, char *buf, int buflen,
+                         int base_mode, int digits, int dispmode,
+                         int thousandssep, int max_mant_digits,
                          const char *format) {
     int group1, group2;
     char dec, sep;
@@ -1094,52 +1455,8 @@ int phloat2string(phloat pd, char *buf, int buflen, int base_mode, int digits,
     int bcd_exponent = 0;
     int bcd_mantissa_sign = 0;
 
-    char decstr[50];
-
-#ifndef BCD_MATH
-    double d = to_double(pd);
-    sprintf(decstr, "%.15e", d);
-#else
-    bid128_to_string(decstr, &pd.val);
-#endif
-
-    char *p = decstr;
-    int mant_index = 0;
-    bcd_mantissa_sign = 0;
-    bool seen_dot = false;
-    bool in_leading_zeroes = true;
-    int exp_offset = -1;
-
-    while (*p != 0) {
-        char c = *p++;
-        if (c == '-') {
-            bcd_mantissa_sign = 1;
-            continue;
-        }
-        if (c == '+')
-            continue;
-        if (c == '.') {
-            seen_dot = true;
-            continue;
-        }
-        if (c == 'e' || c == 'E') {
-            if (!in_leading_zeroes) {
-                sscanf(p, "%d", &bcd_exponent);
-                bcd_exponent += exp_offset;
-            }
-            break;
-        }
-        // Can only be decimal digit at this point
-        if (c == '0') {
-            if (in_leading_zeroes)
-                continue;
-        } else
-            in_leading_zeroes = false;
-        if (!seen_dot)
-            exp_offset++;
-        if (mant_index < MAX_MANT_DIGITS)
-            bcd_mantissa[mant_index++] = c - '0';
-    }
+    if (!phloat_digits(pd, bcd_mantissa, &bcd_exponent, &bcd_mantissa_sign))
+        phloat_digits_slow(pd, bcd_mantissa, &bcd_exponent, &bcd_mantissa_sign);
 
     int max_int_digits = max_mant_digits;
     int max_frac_digits = MAX_MANT_DIGITS + max_int_digits - 1;
@@ -1443,3 +1760,307 @@ int phloat2string(phloat pd, char *buf, int buflen, int base_mode, int digits,
         return chars_so_far;
     }
 }
+
+/* Formatted-number cache
+ * The same handful of numbers gets formatted over and over: every redraw of
+ * the stack, every SHOW, every program listing line with a constant. This is
+ * a small set-associative LRU in front of phloat2string_uncached(), keyed by
+ * the exact bits of the number and all the formatting arguments. The global
+ * settings that the formatter reads on its own (radix mark, base mode, word
+ * size, display geometry) are kept as a snapshot; when any of them changes,
+ * the whole cache is dropped. Calls with an explicit format are not cached.
+ */
+
+#define P2S_SETS 16
+#define P2S_WAYS 4
+#define P2S_TEXT 48
+
+struct p2s_settings {
+    int decimal_point;
+    int base;
+    int wsize;
+    int base_signed;
+    int base_wrap;
+    int disp_r;
+    int disp_c;
+};
+
+struct p2s_entry {
+    unsigned char bits[sizeof(phloat)];
+    int buflen, base_mode, digits, dispmode, thousandssep, max_mant_digits;
+    unsigned int last_used;
+    int len;
+    char text[P2S_TEXT];
+};
+
+static p2s_entry p2s_cache[P2S_SETS][P2S_WAYS];
+static p2s_settings p2s_current;
+static unsigned int p2s_clock = 0;
+
+static void p2s_snapshot(p2s_settings *s) {
+    memset(s, 0, sizeof(p2s_settings));
+    s->decimal_point = flags.f.decimal_point;
+    s->base = get_base();
+    s->wsize = effective_wsize();
+    s->base_signed = flags.f.base_signed;
+    s->base_wrap = flags.f.base_wrap;
+    s->disp_r = disp_r;
+    s->disp_c = disp_c;
+}
+
+static void p2s_clear() {
+    for (int i = 0; i < P2S_SETS; i++)
+        for (int j = 0; j < P2S_WAYS; j++)
+            p2s_cache[i][j].last_used = 0;
+    p2s_clock = 0;
+}
+
+int phloat2string(phloat pd, char *buf, int buflen, int base_mode, int digits,
+                         int dispmode, int thousandssep, int max_mant_digits,
+                         const char *format) {
+    if (format != NULL || buflen > P2S_TEXT)
+        return phloat2string_uncached(pd, buf, buflen, base_mode, digits,
+                        dispmode, thousandssep, max_mant_digits, format);
+
+    p2s_settings s;
+    p2s_snapshot(&s);
+    if (memcmp(&s, &p2s_current, sizeof(p2s_settings)) != 0) {
+        p2s_clear();
+        p2s_current = s;
+    }
+
+    unsigned char bits[sizeof(phloat)];
+    memcpy(bits, &pd, sizeof(phloat));
+    uint4 h = fnv1a((const char *) bits, sizeof(phloat));
+    h ^= (uint4) (dispmode * 31 + digits);
+    h ^= h >> 16;
+    p2s_entry *set = p2s_cache[h % P2S_SETS];
+
+    p2s_entry *victim = set;
+    for (int i = 0; i < P2S_WAYS; i++) {
+        p2s_entry *e = set + i;
+        if (e->last_used != 0
+                && e->buflen == buflen
+                && e->base_mode == base_mode
+                && e->digits == digits
+                && e->dispmode == dispmode
+                && e->thousandssep == thousandssep
+                && e->max_mant_digits == max_mant_digits
+                && memcmp(e->bits, bits, sizeof(phloat)) == 0) {
+            e->last_used = ++p2s_clock;
+            memcpy(buf, e->text, e->len);
+            return e->len;
+        }
+        if (e->last_used < victim->last_used)
+            victim = e;
+    }
+
+    int len = phloat2string_uncached(pd, buf, buflen, base_mode, digits,
+                        dispmode, thousandssep, max_mant_digits, NULL);
+    if (p2s_clock == 0xffffffffu)
+        p2s_clear();
+    memcpy(victim->bits, bits, sizeof(phloat));
+    victim->buflen = buflen;
+    victim->base_mode = base_mode;
+    victim->digits = digits;
+    victim->dispmode = dispmode;
+    victim->thousandssep = thousandssep;
+    victim->max_mant_digits = max_mant_digits;
+    victim->len = len;
+    memcpy(victim->text, buf, len);
+    victim->last_used = ++p2s_clock;
+    return len;
+}
+
+#ifdef FREE42_FPTEST
+
+/* Conversion self-test, run by FPTEST: checks the fast paths in
+ * phloat2string() and string2phloat() against the general conversions they
+ * stand in for, on a large sample of numbers, both random and chosen near
+ * the edges (powers of ten and their neighbours, subnormals, extremes).
+ * Returns the number of mismatches; the first few are logged.
+ */
+
+static uint8 fptest_seed = 0x9e3779b97f4a7c15ULL;
+
+static uint8 fptest_rand() {
+    fptest_seed ^= fptest_seed >> 12;
+    fptest_seed ^= fptest_seed << 25;
+    fptest_seed ^= fptest_seed >> 27;
+    return fptest_seed * 0x2545f4914f6cdd1dULL;
+}
+
+static int fptest_failures;
+
+static void fptest_fail(const char *what, const char *text) {
+    if (fptest_failures++ < 20) {
+        char buf[200];
+        snprintf(buf, 200, "phloat conversion mismatch (%s): %s", what, text);
+        shell_log(buf);
+    }
+}
+
+static void fptest_digits(phloat pd, const char *text) {
+    char m1[MAX_MANT_DIGITS], m2[MAX_MANT_DIGITS];
+    memset(m1, 0, MAX_MANT_DIGITS);
+    memset(m2, 0, MAX_MANT_DIGITS);
+    int e1 = 0, e2 = 0, s1 = 0, s2 = 0;
+    if (!phloat_digits(pd, m1, &e1, &s1))
+        return;
+    phloat_digits_slow(pd, m2, &e2, &s2);
+    if (memcmp(m1, m2, MAX_MANT_DIGITS) != 0 || e1 != e2 || s1 != s2)
+        fptest_fail("digits", text);
+}
+
+#ifndef BCD_MATH
+
+static void fptest_double(double d) {
+    if (d == 0 || isnan(d) || isinf(d))
+        return;
+    char text[50];
+    snprintf(text, 50, "%.17g", d);
+    fptest_digits(d, text);
+
+    /* Round trip: write the 16 digits phloat2string() would use in
+     * HP-42S notation, read them back, and compare with the C library's
+     * reading of the same digits.
+     */
+    char mant[MAX_MANT_DIGITS];
+    memset(mant, 0, MAX_MANT_DIGITS);
+    int exp = 0, sign = 0;
+    if (!phloat_digits(d, mant, &exp, &sign))
+        phloat_digits_slow(d, mant, &exp, &sign);
+    char hp[50], c[50];
+    int hplen = 0, clen = 0;
+    if (sign) {
+        hp[hplen++] = '-';
+        c[clen++] = '-';
+    }
+    for (int i = 0; i < MAX_MANT_DIGITS; i++) {
+        hp[hplen++] = c[clen++] = mant[i] + '0';
+        if (i == 0) {
+            hp[hplen++] = flags.f.decimal_point ? '.' : ',';
+            c[clen++] = '.';
+        }
+    }
+    hplen += snprintf(hp + hplen, 50 - hplen, "\030%d", exp);
+    snprintf(c + clen, 50 - clen, "e%d", exp);
+    double ref = strtod(c, NULL);
+    phloat res = 0;
+    int err = string2phloat(hp, hplen, &res);
+    int ref_err = isinf(ref) ? (sign ? 2 : 1) : ref == 0 ? (sign ? 4 : 3) : 0;
+    if (err != ref_err || err == 0 && memcmp(&res, &ref, sizeof(double)) != 0)
+        fptest_fail("string2phloat", c);
+}
+
+int phloat_conversion_test() {
+    fptest_failures = 0;
+    const int n = 300000;
+    for (int i = 0; i < n; i++) {
+        // Random bit patterns
+        uint8 bits = fptest_rand();
+        double d;
+        memcpy(&d, &bits, 8);
+        fptest_double(d);
+        // Short decimal mantissas, the kind people actually type
+        int len = (int) (fptest_rand() % 16) + 1;
+        uint8 m = fptest_rand() % 10000000000000000ULL;
+        for (int j = len; j < 16; j++)
+            m /= 10;
+        int e = (int) (fptest_rand() % 600) - 300;
+        char c[50];
+        snprintf(c, 50, "%llue%d", (unsigned long long) m, e);
+        fptest_double(strtod(c, NULL));
+    }
+    for (int e = -330; e <= 310; e++) {
+        char c[50];
+        snprintf(c, 50, "1e%d", e);
+        double d = strtod(c, NULL);
+        fptest_double(d);
+        fptest_double(nextafter(d, 0));
+        fptest_double(nextafter(d, DBL_MAX));
+        fptest_double(-d);
+    }
+    fptest_double(DBL_MAX);
+    fptest_double(DBL_MIN);
+    fptest_double(nextafter(0, 1));
+    for (int i = 0; i < 10000; i++) {
+        uint8 bits = fptest_rand() & 0xfffffffffffffULL;
+        double d;
+        memcpy(&d, &bits, 8);
+        fptest_double(d);
+    }
+    return fptest_failures;
+}
+
+#else // BCD_MATH
+
+static void fptest_decimal(const char *s) {
+    BID_UINT128 b1, b2;
+    bid128_from_string(&b2, (char *) s);
+    if (decimal_from_string(s, &b1)
+            && memcmp(&b1, &b2, sizeof(BID_UINT128)) != 0)
+        fptest_fail("string2phloat", s);
+    phloat pd(b2);
+    fptest_digits(pd, s);
+
+    /* Round trip: the digits phloat2string() would use, read back through
+     * the fast path, must give the same number.
+     */
+    char mant[MAX_MANT_DIGITS];
+    memset(mant, 0, MAX_MANT_DIGITS);
+    int exp = 0, sign = 0;
+    if (!phloat_digits(pd, mant, &exp, &sign))
+        return;
+    char buf[60];
+    int len = 0;
+    if (sign)
+        buf[len++] = '-';
+    for (int i = 0; i < MAX_MANT_DIGITS; i++) {
+        buf[len++] = mant[i] + '0';
+        if (i == 0)
+            buf[len++] = '.';
+    }
+    snprintf(buf + len, 60 - len, "E%d", exp);
+    BID_UINT128 b3;
+    if (!decimal_from_string(buf, &b3))
+        bid128_from_string(&b3, buf);
+    int eq;
+    bid128_quiet_equal(&eq, &b2, &b3);
+    if (!eq)
+        fptest_fail("round trip", s);
+}
+
+int phloat_conversion_test() {
+    fptest_failures = 0;
+    const int n = 300000;
+    for (int i = 0; i < n; i++) {
+        char s[80];
+        int len = 0;
+        if (fptest_rand() & 1)
+            s[len++] = '-';
+        int digits = (int) (fptest_rand() % 36) + 1;
+        int dot = (int) (fptest_rand() % (digits + 2));
+        for (int j = 0; j < digits; j++) {
+            if (j == dot)
+                s[len++] = '.';
+            s[len++] = (char) ('0' + fptest_rand() % 10);
+        }
+        if (fptest_rand() & 1)
+            len += snprintf(s + len, 80 - len, "E%d", (int) (fptest_rand() % 13000) - 6500);
+        s[len] = 0;
+        fptest_decimal(s);
+    }
+    for (int e = -6200; e <= 6200; e += 7) {
+        char s[80];
+        snprintf(s, 80, "1E%d", e);
+        fptest_decimal(s);
+        snprintf(s, 80, "9999999999999999999999999999999999E%d", e);
+        fptest_decimal(s);
+    }
+    return fptest_failures;
+}
+
+#endif // BCD_MATH
+
+#endif // FREE42_FPTEST
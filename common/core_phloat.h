@@ -179,6 +179,9 @@ int phloat2string(phloat d, char *buf, int buflen,
                   int thousandssep, int max_mant_digits = 12,
                   const char *format = NULL);
 int string2phloat(const char *buf, int buflen, phloat *d);
+#ifdef FREE42_FPTEST
+int phloat_conversion_test();
+#endif
 
 
 #endif
@@ -676,6 +676,11 @@ const command_spec cmd_array[] =
     { /* PLOT */       docmd_plot,        "PLOT",                0x00, 0x00, 0xa7, 0x1a,  4, ARG_NONE,   0, NA_T },
     { /* LINE */       docmd_line,        "LINE",                0x00, 0x00, 0xa7, 0x23,  4, ARG_NONE,   2, FUNC },
     { /* LIFE */       docmd_life,        "LIFE",                0x00, 0x00, 0xa7, 0x24,  4, ARG_NONE,   0, NA_T },
+
+    /* Parameter sweeps */
+    { /* VSOLVE */     docmd_vsolve,      "VSOLVE",              0x00, 0x72, 0xf2, 0x65,  6, ARG_RVAR,   2, FUNC },
+    { /* VINTEG */     docmd_vinteg,      "VINTEG",              0x00, 0x73, 0xf2, 0x66,  6, ARG_RVAR,   2, FUNC },
+    { /* ROOTS */      docmd_roots,       "ROOTS",               0x00, 0x74, 0xf2, 0x67,  5, ARG_RVAR,   3, FUNC },
 };
 
 /*
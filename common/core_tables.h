@@ -624,8 +624,11 @@
 #define CMD_PLOT        569
 #define CMD_LINE        570
 #define CMD_LIFE        571
+#define CMD_VSOLVE      572
+#define CMD_VINTEG      573
+#define CMD_ROOTS       574
 
-#define CMD_SENTINEL    572
+#define CMD_SENTINEL    575
 
 
 /* command_spec.argtype */
@@ -23,6 +23,7 @@
 #include "core_display.h"
 #include "core_parser.h"
 #include "core_variables.h"
+#include "shell.h"
 
 
 equation_data::~equation_data() {
@@ -35,41 +36,112 @@ bool pgm_index::is_editable() {
     return dir == cwd->id;
 }
 
-// We cache vartype_real, vartype_complex, and vartype_string instances, to
-// cut down on the malloc/free overhead.
+// vartype headers, and the fixed-size realmatrix_data, complexmatrix_data,
+// and list_data blocks, are carved out of slabs, to cut down on the
+// malloc/free overhead. There is one set of slabs per size class; freed cells
+// go onto the free list for their class and are handed out again by the next
+// allocation of that class. Slabs are only returned to the system by
+// clean_vartype_pools(), and only for classes that have no cells in use.
+// Anything bigger than the largest size class goes straight to malloc().
 
-#define POOLSIZE 10
-static vartype_real *realpool[POOLSIZE];
-static vartype_complex *complexpool[POOLSIZE];
-static vartype_string *stringpool[POOLSIZE];
-static int realpool_size = 0;
-static int complexpool_size = 0;
-static int stringpool_size = 0;
+#define SLAB_QUANTUM 16
+#define SLAB_CLASSES 4
+#define SLAB_CELLS 128
 
-vartype *new_real(phloat value) {
-    vartype_real *r;
-    if (realpool_size > 0) {
-        r = realpool[--realpool_size];
-    } else {
-        r = (vartype_real *) malloc(sizeof(vartype_real));
-        if (r == NULL)
-            return NULL;
-        r->type = TYPE_REAL;
+union slab_header {
+    union slab_header *next;
+    char pad[SLAB_QUANTUM];
+};
+
+struct slab_cell {
+    slab_cell *next;
+};
+
+struct slab_class {
+    slab_header *slabs;
+    slab_cell *free_list;
+    int4 slab_count;
+    int4 in_use;
+    int4 peak;
+    uint8 allocs;
+    uint8 frees;
+};
+
+static slab_class slab_classes[SLAB_CLASSES];
+static uint8 slab_large_allocs = 0;
+static uint8 slab_large_frees = 0;
+
+static int slab_class_index(size_t size) {
+    return (int) ((size + SLAB_QUANTUM - 1) / SLAB_QUANTUM) - 1;
+}
+
+static bool slab_grow(int c) {
+    size_t cellsize = (c + 1) * SLAB_QUANTUM;
+    slab_header *h = (slab_header *) malloc(sizeof(slab_header) + SLAB_CELLS * cellsize);
+    if (h == NULL)
+        return false;
+    slab_class *sc = slab_classes + c;
+    h->next = sc->slabs;
+    sc->slabs = h;
+    sc->slab_count++;
+    char *p = (char *) (h + 1);
+    for (int i = 0; i < SLAB_CELLS; i++) {
+        slab_cell *cell = (slab_cell *) p;
+        cell->next = sc->free_list;
+        sc->free_list = cell;
+        p += cellsize;
+    }
+    return true;
+}
+
+void *slab_alloc(size_t size) {
+    int c = slab_class_index(size);
+    if (c >= SLAB_CLASSES) {
+        slab_large_allocs++;
+        return malloc(size);
     }
+    slab_class *sc = slab_classes + c;
+    if (sc->free_list == NULL && !slab_grow(c))
+        return NULL;
+    slab_cell *cell = sc->free_list;
+    sc->free_list = cell->next;
+    sc->allocs++;
+    if (++sc->in_use > sc->peak)
+        sc->peak = sc->in_use;
+    return cell;
+}
+
+void slab_free(void *p, size_t size) {
+    if (p == NULL)
+        return;
+    int c = slab_class_index(size);
+    if (c >= SLAB_CLASSES) {
+        slab_large_frees++;
+        free(p);
+        return;
+    }
+    slab_class *sc = slab_classes + c;
+    slab_cell *cell = (slab_cell *) p;
+    cell->next = sc->free_list;
+    sc->free_list = cell;
+    sc->frees++;
+    sc->in_use--;
+}
+
+vartype *new_real(phloat value) {
+    vartype_real *r = (vartype_real *) slab_alloc(sizeof(vartype_real));
+    if (r == NULL)
+        return NULL;
+    r->type = TYPE_REAL;
     r->x = value;
     return (vartype *) r;
 }
 
 vartype *new_complex(phloat re, phloat im) {
-    vartype_complex *c;
-    if (complexpool_size > 0) {
-        c = complexpool[--complexpool_size];
-    } else {
-        c = (vartype_complex *) malloc(sizeof(vartype_complex));
-        if (c == NULL)
-            return NULL;
-        c->type = TYPE_COMPLEX;
-    }
+    vartype_complex *c = (vartype_complex *) slab_alloc(sizeof(vartype_complex));
+    if (c == NULL)
+        return NULL;
+    c->type = TYPE_COMPLEX;
     c->re = re;
     c->im = im;
     return (vartype *) c;
@@ -82,18 +154,13 @@ vartype *new_string(const char *text, int length) {
         if (dbuf == NULL)
             return NULL;
     }
-    vartype_string *s;
-    if (stringpool_size > 0) {
-        s = stringpool[--stringpool_size];
-    } else {
-        s = (vartype_string *) malloc(sizeof(vartype_string));
-        if (s == NULL) {
-            if (length > SSLENV)
-                free(dbuf);
-            return NULL;
-        }
-        s->type = TYPE_STRING;
+    vartype_string *s = (vartype_string *) slab_alloc(sizeof(vartype_string));
+    if (s == NULL) {
+        if (length > SSLENV)
+            free(dbuf);
+        return NULL;
     }
+    s->type = TYPE_STRING;
     s->length = length;
     if (length > SSLENV)
         s->t.ptr = dbuf;
@@ -108,7 +175,7 @@ vartype *new_realmatrix(int4 rows, int4 columns) {
         return NULL;
 
     vartype_realmatrix *rm = (vartype_realmatrix *)
-                                        malloc(sizeof(vartype_realmatrix));
+                                        slab_alloc(sizeof(vartype_realmatrix));
     if (rm == NULL)
         return NULL;
     int4 i, sz;
@@ -116,22 +183,22 @@ vartype *new_realmatrix(int4 rows, int4 columns) {
     rm->rows = rows;
     rm->columns = columns;
     sz = rows * columns;
-    rm->array = (realmatrix_data *) malloc(sizeof(realmatrix_data));
+    rm->array = (realmatrix_data *) slab_alloc(sizeof(realmatrix_data));
     if (rm->array == NULL) {
-        free(rm);
+        slab_free(rm, sizeof(vartype_realmatrix));
         return NULL;
     }
     rm->array->data = (phloat *) malloc(sz * sizeof(phloat));
     if (rm->array->data == NULL) {
-        free(rm->array);
-        free(rm);
+        slab_free(rm->array, sizeof(realmatrix_data));
+        slab_free(rm, sizeof(vartype_realmatrix));
         return NULL;
     }
     rm->array->is_string = (char *) malloc(sz);
     if (rm->array->is_string == NULL) {
         free(rm->array->data);
-        free(rm->array);
-        free(rm);
+        slab_free(rm->array, sizeof(realmatrix_data));
+        slab_free(rm, sizeof(vartype_realmatrix));
         return NULL;
     }
     for (i = 0; i < sz; i++)
@@ -147,7 +214,7 @@ vartype *new_complexmatrix(int4 rows, int4 columns) {
         return NULL;
 
     vartype_complexmatrix *cm = (vartype_complexmatrix *)
-                                        malloc(sizeof(vartype_complexmatrix));
+                                        slab_alloc(sizeof(vartype_complexmatrix));
     if (cm == NULL)
         return NULL;
     int4 i, sz;
@@ -155,15 +222,15 @@ vartype *new_complexmatrix(int4 rows, int4 columns) {
     cm->rows = rows;
     cm->columns = columns;
     sz = rows * columns * 2;
-    cm->array = (complexmatrix_data *) malloc(sizeof(complexmatrix_data));
+    cm->array = (complexmatrix_data *) slab_alloc(sizeof(complexmatrix_data));
     if (cm->array == NULL) {
-        free(cm);
+        slab_free(cm, sizeof(vartype_complexmatrix));
         return NULL;
     }
     cm->array->data = (phloat *) malloc(sz * sizeof(phloat));
     if (cm->array->data == NULL) {
-        free(cm->array);
-        free(cm);
+        slab_free(cm->array, sizeof(complexmatrix_data));
+        slab_free(cm, sizeof(vartype_complexmatrix));
         return NULL;
     }
     for (i = 0; i < sz; i++)
@@ -173,20 +240,20 @@ vartype *new_complexmatrix(int4 rows, int4 columns) {
 }
 
 vartype *new_list(int4 size) {
-    vartype_list *list = (vartype_list *) malloc(sizeof(vartype_list));
+    vartype_list *list = (vartype_list *) slab_alloc(sizeof(vartype_list));
     if (list == NULL)
         return NULL;
     list->type = TYPE_LIST;
     list->size = size;
-    list->array = (list_data *) malloc(sizeof(list_data));
+    list->array = (list_data *) slab_alloc(sizeof(list_data));
     if (list->array == NULL) {
-        free(list);
+        slab_free(list, sizeof(vartype_list));
         return NULL;
     }
     list->array->data = (vartype **) malloc(size * sizeof(vartype *));
     if (list->array->data == NULL && size != 0) {
-        free(list->array);
-        free(list);
+        slab_free(list->array, sizeof(list_data));
+        slab_free(list, sizeof(vartype_list));
         return NULL;
     }
     memset(list->array->data, 0, size * sizeof(vartype *));
@@ -217,7 +284,7 @@ vartype *new_equation(const char *text, int4 len, bool compat_mode, int *errpos)
     eqd->eqn_index = eqn_index;
     eqd->compatMode = compat_mode;
 
-    vartype_equation *eq = (vartype_equation *) malloc(sizeof(vartype_equation));
+    vartype_equation *eq = (vartype_equation *) slab_alloc(sizeof(vartype_equation));
     if (eq == NULL) {
         delete eqd;
         return NULL;
@@ -243,7 +310,7 @@ vartype *new_equation(const char *text, int4 len, bool compat_mode, int *errpos)
 }
 
 vartype *new_equation(equation_data *eqd) {
-    vartype_equation *eq = (vartype_equation *) malloc(sizeof(vartype_equation));
+    vartype_equation *eq = (vartype_equation *) slab_alloc(sizeof(vartype_equation));
     if (eq == NULL)
         return NULL;
     eq->type = TYPE_EQUATION;
@@ -255,12 +322,12 @@ vartype *new_equation(equation_data *eqd) {
 vartype *new_unit(phloat value, const char *text, int4 length) {
     if (length == 0)
         return new_real(value);
-    vartype_unit *u = (vartype_unit *) malloc(sizeof(vartype_unit));
+    vartype_unit *u = (vartype_unit *) slab_alloc(sizeof(vartype_unit));
     if (u == NULL)
         return NULL;
     u->text = (char *) malloc(length);
     if (u->text == NULL && length != 0) {
-        free(u);
+        slab_free(u, sizeof(vartype_unit));
         return NULL;
     }
     u->type = TYPE_UNIT;
@@ -281,7 +348,7 @@ vartype *new_unit(phloat value, const char *text, int4 length) {
 }
 
 vartype *new_dir_ref(int4 dir) {
-    vartype_dir_ref *r = (vartype_dir_ref *) malloc(sizeof(vartype_dir_ref));
+    vartype_dir_ref *r = (vartype_dir_ref *) slab_alloc(sizeof(vartype_dir_ref));
     if (r == NULL)
         return NULL;
     r->type = TYPE_DIR_REF;
@@ -290,7 +357,7 @@ vartype *new_dir_ref(int4 dir) {
 }
 
 vartype *new_pgm_ref(int4 dir, int4 pgm) {
-    vartype_pgm_ref *r = (vartype_pgm_ref *) malloc(sizeof(vartype_pgm_ref));
+    vartype_pgm_ref *r = (vartype_pgm_ref *) slab_alloc(sizeof(vartype_pgm_ref));
     if (r == NULL)
         return NULL;
     r->type = TYPE_PGM_REF;
@@ -302,7 +369,7 @@ vartype *new_pgm_ref(int4 dir, int4 pgm) {
 vartype *new_var_ref(int4 dir, const char *name, int length) {
     if (length < 1 || length > 7)
         return NULL;
-    vartype_var_ref *r = (vartype_var_ref *) malloc(sizeof(vartype_var_ref));
+    vartype_var_ref *r = (vartype_var_ref *) slab_alloc(sizeof(vartype_var_ref));
     if (r == NULL)
         return NULL;
     r->type = TYPE_VAR_REF;
@@ -318,27 +385,18 @@ void free_vartype(vartype *v) {
         return;
     switch (v->type) {
         case TYPE_REAL: {
-            if (realpool_size < POOLSIZE)
-                realpool[realpool_size++] = (vartype_real *) v;
-            else
-                free(v);
+            slab_free(v, sizeof(vartype_real));
             break;
         }
         case TYPE_COMPLEX: {
-            if (complexpool_size < POOLSIZE)
-                complexpool[complexpool_size++] = (vartype_complex *) v;
-            else
-                free(v);
+            slab_free(v, sizeof(vartype_complex));
             break;
         }
         case TYPE_STRING: {
             vartype_string *s = (vartype_string *) v;
             if (s->length > SSLENV)
                 free(s->t.ptr);
-            if (stringpool_size < POOLSIZE)
-                stringpool[stringpool_size++] = s;
-            else
-                free(s);
+            slab_free(s, sizeof(vartype_string));
             break;
         }
         case TYPE_REALMATRIX: {
@@ -348,18 +406,18 @@ void free_vartype(vartype *v) {
                 free_long_strings(rm->array->is_string, rm->array->data, sz);
                 free(rm->array->data);
                 free(rm->array->is_string);
-                free(rm->array);
+                slab_free(rm->array, sizeof(realmatrix_data));
             }
-            free(rm);
+            slab_free(rm, sizeof(vartype_realmatrix));
             break;
         }
         case TYPE_COMPLEXMATRIX: {
             vartype_complexmatrix *cm = (vartype_complexmatrix *) v;
             if (--(cm->array->refcount) == 0) {
                 free(cm->array->data);
-                free(cm->array);
+                slab_free(cm->array, sizeof(complexmatrix_data));
             }
-            free(cm);
+            slab_free(cm, sizeof(vartype_complexmatrix));
             break;
         }
         case TYPE_LIST: {
@@ -368,9 +426,9 @@ void free_vartype(vartype *v) {
                 for (int4 i = 0; i < list->size; i++)
                     free_vartype(list->array->data[i]);
                 free(list->array->data);
-                free(list->array);
+                slab_free(list->array, sizeof(list_data));
             }
-            free(list);
+            slab_free(list, sizeof(vartype_list));
             break;
         }
         case TYPE_EQUATION: {
@@ -390,31 +448,57 @@ void free_vartype(vartype *v) {
                 eq_dir->prgms[eqn_index].eq_data = NULL;
                 delete eq->data;
             }
-            free(eq);
+            slab_free(eq, sizeof(vartype_equation));
             break;
         }
         case TYPE_UNIT: {
             vartype_unit *u = (vartype_unit *) v;
             free(u->text);
-            free(u);
+            slab_free(u, sizeof(vartype_unit));
+            break;
+        }
+        case TYPE_DIR_REF: {
+            slab_free(v, sizeof(vartype_dir_ref));
+            break;
+        }
+        case TYPE_PGM_REF: {
+            slab_free(v, sizeof(vartype_pgm_ref));
             break;
         }
-        case TYPE_DIR_REF:
-        case TYPE_PGM_REF:
         case TYPE_VAR_REF: {
-            free(v);
+            slab_free(v, sizeof(vartype_var_ref));
             break;
         }
     }
 }
 
 void clean_vartype_pools() {
-    while (realpool_size > 0)
-        free(realpool[--realpool_size]);
-    while (complexpool_size > 0)
-        free(complexpool[--complexpool_size]);
-    while (stringpool_size > 0)
-        free(stringpool[--stringpool_size]);
+    for (int c = 0; c < SLAB_CLASSES; c++) {
+        slab_class *sc = slab_classes + c;
+        if (sc->in_use != 0)
+            continue;
+        while (sc->slabs != NULL) {
+            slab_header *h = sc->slabs;
+            sc->slabs = h->next;
+            free(h);
+        }
+        sc->free_list = NULL;
+        sc->slab_count = 0;
+    }
+}
+
+void log_vartype_pool_stats() {
+    char buf[200];
+    for (int c = 0; c < SLAB_CLASSES; c++) {
+        slab_class *sc = slab_classes + c;
+        snprintf(buf, 200, "slab %3d bytes: %d slabs, %d in use, %d peak, %llu allocs, %llu frees",
+                 (c + 1) * SLAB_QUANTUM, sc->slab_count, sc->in_use, sc->peak,
+                 sc->allocs, sc->frees);
+        shell_log(buf);
+    }
+    snprintf(buf, 200, "large: %llu allocs, %llu frees",
+             slab_large_allocs, slab_large_frees);
+    shell_log(buf);
 }
 
 void free_long_strings(char *is_string, phloat *data, int4 n) {
@@ -493,7 +577,7 @@ vartype *dup_vartype(const vartype *v) {
         case TYPE_REALMATRIX: {
             vartype_realmatrix *rm = (vartype_realmatrix *) v;
             vartype_realmatrix *rm2 = (vartype_realmatrix *)
-                                        malloc(sizeof(vartype_realmatrix));
+                                        slab_alloc(sizeof(vartype_realmatrix));
             if (rm2 == NULL)
                 return NULL;
             *rm2 = *rm;
@@ -503,7 +587,7 @@ vartype *dup_vartype(const vartype *v) {
         case TYPE_COMPLEXMATRIX: {
             vartype_complexmatrix *cm = (vartype_complexmatrix *) v;
             vartype_complexmatrix *cm2 = (vartype_complexmatrix *)
-                                        malloc(sizeof(vartype_complexmatrix));
+                                        slab_alloc(sizeof(vartype_complexmatrix));
             if (cm2 == NULL)
                 return NULL;
             *cm2 = *cm;
@@ -516,7 +600,7 @@ vartype *dup_vartype(const vartype *v) {
         }
         case TYPE_LIST: {
             vartype_list *list = (vartype_list *) v;
-            vartype_list *list2 = (vartype_list *) malloc(sizeof(vartype_list));
+            vartype_list *list2 = (vartype_list *) slab_alloc(sizeof(vartype_list));
             if (list2 == NULL)
                 return NULL;
             *list2 = *list;
@@ -525,7 +609,7 @@ vartype *dup_vartype(const vartype *v) {
         }
         case TYPE_EQUATION: {
             vartype_equation *eq = (vartype_equation *) v;
-            vartype_equation *eq2 = (vartype_equation *) malloc(sizeof(vartype_equation));
+            vartype_equation *eq2 = (vartype_equation *) slab_alloc(sizeof(vartype_equation));
             if (eq2 == NULL)
                 return NULL;
             *eq2 = *eq;
@@ -534,13 +618,13 @@ vartype *dup_vartype(const vartype *v) {
         }
         case TYPE_UNIT: {
             vartype_unit *u = (vartype_unit *) v;
-            vartype_unit *u2 = (vartype_unit *) malloc(sizeof(vartype_unit));
+            vartype_unit *u2 = (vartype_unit *) slab_alloc(sizeof(vartype_unit));
             if (u2 == NULL)
                 return NULL;
             *u2 = *u;
             u2->text = (char *) malloc(u->length);
             if (u2->text == NULL && u->length != 0) {
-                free(u2);
+                slab_free(u2, sizeof(vartype_unit));
                 return NULL;
             }
             memcpy(u2->text, u->text, u->length);
@@ -548,7 +632,7 @@ vartype *dup_vartype(const vartype *v) {
         }
         case TYPE_DIR_REF: {
             vartype_dir_ref *r = (vartype_dir_ref *) v;
-            vartype_dir_ref *r2 = (vartype_dir_ref *) malloc(sizeof(vartype_dir_ref));
+            vartype_dir_ref *r2 = (vartype_dir_ref *) slab_alloc(sizeof(vartype_dir_ref));
             if (r2 == NULL)
                 return NULL;
             *r2 = *r;
@@ -556,7 +640,7 @@ vartype *dup_vartype(const vartype *v) {
         }
         case TYPE_PGM_REF: {
             vartype_pgm_ref *r = (vartype_pgm_ref *) v;
-            vartype_pgm_ref *r2 = (vartype_pgm_ref *) malloc(sizeof(vartype_pgm_ref));
+            vartype_pgm_ref *r2 = (vartype_pgm_ref *) slab_alloc(sizeof(vartype_pgm_ref));
             if (r2 == NULL)
                 return NULL;
             *r2 = *r;
@@ -564,7 +648,7 @@ vartype *dup_vartype(const vartype *v) {
         }
         case TYPE_VAR_REF: {
             vartype_var_ref *r = (vartype_var_ref *) v;
-            vartype_var_ref *r2 = (vartype_var_ref *) malloc(sizeof(vartype_var_ref));
+            vartype_var_ref *r2 = (vartype_var_ref *) slab_alloc(sizeof(vartype_var_ref));
             if (r2 == NULL)
                 return NULL;
             *r2 = *r;
@@ -583,20 +667,20 @@ bool disentangle(vartype *v) {
                 return true;
             else {
                 realmatrix_data *md = (realmatrix_data *)
-                                        malloc(sizeof(realmatrix_data));
+                                        slab_alloc(sizeof(realmatrix_data));
                 if (md == NULL)
                     return false;
                 int4 sz = rm->rows * rm->columns;
                 int4 i;
                 md->data = (phloat *) malloc(sz * sizeof(phloat));
                 if (md->data == NULL) {
-                    free(md);
+                    slab_free(md, sizeof(realmatrix_data));
                     return false;
                 }
                 md->is_string = (char *) malloc(sz);
                 if (md->is_string == NULL) {
                     free(md->data);
-                    free(md);
+                    slab_free(md, sizeof(realmatrix_data));
                     return false;
                 }
                 for (i = 0; i < sz; i++) {
@@ -609,7 +693,7 @@ bool disentangle(vartype *v) {
                             free_long_strings(md->is_string, md->data, i);
                             free(md->is_string);
                             free(md->data);
-                            free(md);
+                            slab_free(md, sizeof(realmatrix_data));
                             return false;
                         }
                         memcpy(dp, sp, len);
@@ -630,14 +714,14 @@ bool disentangle(vartype *v) {
                 return true;
             else {
                 complexmatrix_data *md = (complexmatrix_data *)
-                                            malloc(sizeof(complexmatrix_data));
+                                            slab_alloc(sizeof(complexmatrix_data));
                 if (md == NULL)
                     return false;
                 int4 sz = cm->rows * cm->columns * 2;
                 int4 i;
                 md->data = (phloat *) malloc(sz * sizeof(phloat));
                 if (md->data == NULL) {
-                    free(md);
+                    slab_free(md, sizeof(complexmatrix_data));
                     return false;
                 }
                 for (i = 0; i < sz; i++)
@@ -653,12 +737,12 @@ bool disentangle(vartype *v) {
             if (list->array->refcount == 1)
                 return true;
             else {
-                list_data *ld = (list_data *) malloc(sizeof(list_data));
+                list_data *ld = (list_data *) slab_alloc(sizeof(list_data));
                 if (ld == NULL)
                     return false;
                 ld->data = (vartype **) malloc(list->size * sizeof(vartype *));
                 if (ld->data == NULL && list->size != 0) {
-                    free(ld);
+                    slab_free(ld, sizeof(list_data));
                     return false;
                 }
                 for (int4 i = 0; i < list->size; i++) {
@@ -669,7 +753,7 @@ bool disentangle(vartype *v) {
                             for (int4 j = 0; j < i; j++)
                                 free_vartype(ld->data[j]);
                             free(ld->data);
-                            free(ld);
+                            slab_free(ld, sizeof(list_data));
                             return false;
                         }
                     }
@@ -710,6 +794,15 @@ bool vloc::writable() {
     return idx != -1 && (dir <= 0 || dir == cwd->id);
 }
 
+/* The caller may change a global it has looked up in place, so it is flagged
+ * for the next checkpoint; see journal_write().
+ */
+static vloc global_vloc(directory *dir, int idx) {
+    dir->vars[idx].flags |= VAR_DIRTY;
+    dir->dirty |= DIR_DIRTY_VARS;
+    return vloc(dir->id, idx);
+}
+
 vloc lookup_var(const char *name, int namelength, bool no_locals, bool no_ancestors) {
     if (!no_locals) {
         for (int i = local_vars_count - 1; i >= 0; i--) {
@@ -731,7 +824,7 @@ vloc lookup_var(const char *name, int namelength, bool no_locals, bool no_ancest
                 for (int j = 0; j < namelength; j++)
                     if (dir->vars[i].name[j] != name[j])
                         goto nomatch2;
-                return vloc(dir->id, i);
+                return global_vloc(dir, i);
             }
             nomatch2:;
         }
@@ -754,7 +847,7 @@ vloc lookup_var(const char *name, int namelength, bool no_locals, bool no_ancest
                 for (int k = 0; k < namelength; k++)
                     if (dir->vars[j].name[k] != name[k])
                         goto nomatch3;
-                return vloc(dir->id, j);
+                return global_vloc(dir, j);
             }
             nomatch3:;
         }
@@ -934,7 +1027,9 @@ int store_var(const char *name, int namelength, vartype *value, bool local /* =
         int idx = cwd->vars_count++;
         var_struct *gv = cwd->vars + idx;
         string_copy(gv->name, &gv->length, name, namelength);
+        gv->flags = VAR_DIRTY;
         gv->value = value;
+        cwd->dirty |= DIR_DIRTY_VARS;
     } else if (local && varindex.level() < get_rtn_level()) {
         do_local:
         /* Create new local */
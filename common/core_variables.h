@@ -200,6 +200,8 @@ struct vloc {
 };
 
 
+void *slab_alloc(size_t size);
+void slab_free(void *p, size_t size);
 vartype *new_real(phloat value);
 vartype *new_complex(phloat re, phloat im);
 vartype *new_string(const char *s, int slen);
@@ -214,6 +216,7 @@ vartype *new_pgm_ref(int4 dir, int4 pgm);
 vartype *new_var_ref(int4 dir, const char *name, int length);
 void free_vartype(vartype *v);
 void clean_vartype_pools();
+void log_vartype_pool_stats();
 void free_long_strings(char *is_string, phloat *data, int4 n);
 void get_matrix_string(vartype_realmatrix *rm, int4 i, char **text, int4 *length);
 void get_matrix_string(const vartype_realmatrix *rm, int4 i, const char **text, int4 *length);
@@ -18,6 +18,7 @@
 #ifndef ANDROID
 
 #include <stdlib.h>
+#include <string.h>
 
 #include "shell_spool.h"
 #include "core_main.h"
@@ -141,15 +142,22 @@ void shell_spool_bitmap_to_txt(const char *bits, int bytesperline,
     }
 }
 
+/* The LZW string table is looked up through an open-addressing hash table,
+ * keyed by (prefix code, pixel). With at most 4096 codes in the table,
+ * GIF_HASH_SIZE slots keep the load factor below one half, so probe
+ * sequences stay short. Output is collected in out_buf and handed to the
+ * file_writer in large chunks.
+ */
+#define GIF_HASH_SIZE 8192
+#define GIF_OUT_SIZE 4096
+
 struct gif_data {
     int codesize;
     int bytecount;
     char buf[255];
 
-    short prefix_table[4096];
-    short code_table[4096];
-    short hash_next[4096];
-    short hash_head[256];
+    int4 hash_key[GIF_HASH_SIZE];
+    short hash_code[GIF_HASH_SIZE];
 
     int maxcode;
     int clear_code;
@@ -157,23 +165,57 @@ struct gif_data {
 
     int curr_code_size;
     int prefix;
-    int currbyte;
-    int bits_needed;
+    uint4 bitbuf;
+    int bitcount;
     int initial_clear;
     int really_done;
 
     int width;
     int height;
+
+    int out_count;
+    char out_buf[GIF_OUT_SIZE];
 };
 
 static gif_data *g;
 
 
+static void gif_clear_hash() {
+    memset(g->hash_key, 0, sizeof(g->hash_key));
+}
+
+static int gif_hash(int4 key) {
+    return (int) (((uint4) key * 2654435761u) >> 19) & (GIF_HASH_SIZE - 1);
+}
+
+static void gif_flush(file_writer writer) {
+    if (g->out_count > 0) {
+        writer(g->out_buf, g->out_count);
+        g->out_count = 0;
+    }
+}
+
+static void gif_write(const char *data, int length, file_writer writer) {
+    if (g->out_count + length > GIF_OUT_SIZE)
+        gif_flush(writer);
+    memcpy(g->out_buf + g->out_count, data, length);
+    g->out_count += length;
+}
+
+static void gif_put_byte(char c, file_writer writer) {
+    g->buf[g->bytecount++] = c;
+    if (g->bytecount == 255) {
+        char n = (char) g->bytecount;
+        gif_write(&n, 1, writer);
+        gif_write(g->buf, g->bytecount, writer);
+        g->bytecount = 0;
+    }
+}
+
 int shell_start_gif(file_writer writer, int width, int provisional_height) {
     char buf[29];
     char *p = buf, c;
     int height = provisional_height;
-    int i;
 
     /* NOTE: the height will be set to the *actual* height once we know
      * what that is, i.e., when shell_finish_gif() is called. We populate
@@ -224,11 +266,6 @@ int shell_start_gif(file_writer writer, int width, int provisional_height) {
     *p++ = height >> 8;
     *p++ = 0x00;
 
-    /* Write GIF header & descriptors */
-
-    writer(buf, 29);
-
-
     /* Initialize GIF encoder */
 
     if (g == NULL) {
@@ -237,24 +274,24 @@ int shell_start_gif(file_writer writer, int width, int provisional_height) {
             return 0;
     }
 
+    g->out_count = 0;
+
+    /* Write GIF header & descriptors */
+
+    gif_write(buf, 29, writer);
+
     g->codesize = 2;
     g->bytecount = 0;
     g->maxcode = 1 << g->codesize;
-    for (i = 0; i < g->maxcode; i++) {
-        g->prefix_table[i] = -1;
-        g->code_table[i] = i;
-        g->hash_next[i] = -1;
-    }
-    for (i = 0; i < 256; i++)
-        g->hash_head[i] = -1;
+    gif_clear_hash();
 
     g->clear_code = g->maxcode++;
     g->end_code = g->maxcode++;
 
     g->curr_code_size = g->codesize + 1;
     g->prefix = -1;
-    g->currbyte = 0;
-    g->bits_needed = 8;
+    g->bitbuf = 0;
+    g->bitcount = 0;
     g->initial_clear = 1;
     g->really_done = 0;
 
@@ -262,7 +299,7 @@ int shell_start_gif(file_writer writer, int width, int provisional_height) {
     g->height = 0;
 
     c = g->codesize;
-    writer(&c, 1);
+    gif_write(&c, 1, writer);
 
     return 1;
 }
@@ -279,8 +316,8 @@ void shell_spool_gif(const char *bits, int bytesperline,
         int done = v == y && height == 0;
         for (h = 0; h < g->width; h++) {
             int new_code;
-            unsigned char hash_code;
-            int hash_index;
+            int4 key;
+            int slot;
             int pixel;
 
             if (g->really_done) {
@@ -302,37 +339,21 @@ void shell_spool_gif(const char *bits, int bytesperline,
                 goto no_emit;
             }
 
-            /* Compute hash code
-             * TODO: There's a lot of room for improvement here!
-             * I'm getting search percentages of over 30%; looking for
-             * something in single digits.
-             */
-            {
-                unsigned long x = (((long) g->prefix) << 20)
-                                        + (((long) pixel) << 12);
-                unsigned char b1, b2, b3;
-                x /= 997;
-                b1 = (unsigned char) (x >> 16);
-                b2 = (unsigned char) (x >> 8);
-                b3 = (unsigned char) x;
-                hash_code = b1 ^ b2 ^ b3;
-            }
-            hash_index = g->hash_head[hash_code];
-            while (hash_index != -1) {
-                if (g->prefix_table[hash_index] == g->prefix
-                         && g->code_table[hash_index] == pixel) {
-                    g->prefix = hash_index;
+            /* Keys are stored plus one, so that zero marks an empty slot */
+            key = (((int4) g->prefix << 8) | pixel) + 1;
+            slot = gif_hash(key);
+            while (g->hash_key[slot] != 0) {
+                if (g->hash_key[slot] == key) {
+                    g->prefix = g->hash_code[slot];
                     goto no_emit;
                 }
-                hash_index = g->hash_next[hash_index];
+                slot = (slot + 1) & (GIF_HASH_SIZE - 1);
             }
 
             /* Not found: */
             if (g->maxcode < 4096) {
-                g->prefix_table[g->maxcode] = g->prefix;
-                g->code_table[g->maxcode] = pixel;
-                g->hash_next[g->maxcode] = g->hash_head[hash_code];
-                g->hash_head[hash_code] = g->maxcode;
+                g->hash_key[slot] = key;
+                g->hash_code[slot] = (short) g->maxcode;
                 g->maxcode++;
             }
             new_code = g->prefix;
@@ -341,29 +362,17 @@ void shell_spool_gif(const char *bits, int bytesperline,
             emit: {
                 int outcode = g->initial_clear ? g->clear_code
                                     : g->really_done ? g->end_code : new_code;
-                int bits_available = g->curr_code_size;
-                while (bits_available != 0) {
-                    int bits_copied = g->bits_needed < bits_available ?
-                                g->bits_needed : bits_available;
-                    int bits = outcode >> (g->curr_code_size - bits_available);
-                    bits &= 255 >> (8 - bits_copied);
-                    g->currbyte |= bits << (8 - g->bits_needed);
-                    bits_available -= bits_copied;
-                    g->bits_needed -= bits_copied;
-                    if (g->bits_needed == 0 ||
-                                    (bits_available == 0 && g->really_done)) {
-                        g->buf[g->bytecount++] = g->currbyte;
-                        if (g->bytecount == 255) {
-                            char c = g->bytecount;
-                            writer(&c, 1);
-                            writer(g->buf, g->bytecount);
-                            g->bytecount = 0;
-                        }
-                        if (bits_available == 0 && g->really_done)
-                            goto data_done;
-                        g->currbyte = 0;
-                        g->bits_needed = 8;
-                    }
+                g->bitbuf |= (uint4) outcode << g->bitcount;
+                g->bitcount += g->curr_code_size;
+                while (g->bitcount >= 8) {
+                    gif_put_byte((char) g->bitbuf, writer);
+                    g->bitbuf >>= 8;
+                    g->bitcount -= 8;
+                }
+                if (g->really_done) {
+                    if (g->bitcount > 0)
+                        gif_put_byte((char) g->bitbuf, writer);
+                    goto data_done;
                 }
 
                 if (done) {
@@ -378,11 +387,9 @@ void shell_spool_gif(const char *bits, int bytesperline,
                     if (g->maxcode > (1 << g->curr_code_size)) {
                         g->curr_code_size++;
                     } else if (new_code == g->clear_code) {
-                        int i;
                         g->maxcode = (1 << g->codesize) + 2;
                         g->curr_code_size = g->codesize + 1;
-                        for (i = 0; i < 256; i++)
-                            g->hash_head[i] = -1;
+                        gif_clear_hash();
                     } else if (g->maxcode == 4096) {
                         new_code = g->clear_code;
                         goto emit;
@@ -407,16 +414,17 @@ void shell_finish_gif(file_seeker seeker, file_writer writer) {
 
     if (g->bytecount > 0) {
         c = g->bytecount;
-        writer(&c, 1);
-        writer(g->buf, g->bytecount);
+        gif_write(&c, 1, writer);
+        gif_write(g->buf, g->bytecount, writer);
     }
     c = 0;
-    writer(&c, 1);
+    gif_write(&c, 1, writer);
 
     /* GIF Trailer */
 
     c = ';';
-    writer(&c, 1);
+    gif_write(&c, 1, writer);
+    gif_flush(writer);
 
     /* Update the 'height' fields in the header, now that at last
      * we know what the final height is */
@@ -24,10 +24,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <time.h>
 
@@ -63,24 +66,52 @@ state_type state;
 char free42dirname[FILENAMELEN];
 
 
-/* PRINT_LINES is limited to an even lower value than in the Motif version.
- * It appears that GTK does not allow the SUM of a widget's height and its
- * container's height to exceed 32k, which means that as the print widget's
- * height approaches that magical number, the top-level window is forced to
- * become shorter and shorter. So, I set the limit at 30000 instead of
- * 32768; if we're reading a print-out file from Plus42/Motif which has more
- * than 30000 pixels, we chop off the excess from the top.
+/* The print-out is kept in a memory-mapped file, "print.map", consisting of
+ * a header, the bitmap ring buffer, and the text ring buffer; lines are
+ * written straight into the mapping, so there is nothing to load at startup
+ * or save at exit. The size of the bitmap buffer, print_lines, comes from
+ * state.printLines; when that changes, the print-out is moved into a new
+ * file of the right size at startup.
+ * GTK does not allow widgets taller than 32k pixels, so the print-out window
+ * does its own scrolling: the drawing area is only as tall as the window,
+ * and print_adj tells repaint_printout() which part of the print-out to draw.
  */
-#define PRINT_LINES 30000
 #define PRINT_BYTESPERLINE 36
-#define PRINT_SIZE 1080000
-// Room for PRINT_LINES / 18 lines, plus two, plus one byte
-#define PRINT_TEXT_SIZE 41726
+#define PRINT_MAP_MAGIC 0x7034324c
+#define PRINT_MAP_VERSION 1
+#define PRINT_MAP_HEADER_SIZE 64
+#define PRINT_LINES_DEFAULT 30000
+#define PRINT_LINES_MIN 1000
+#define PRINT_LINES_MAX 1000000
+/* The print-out is drawn from fixed-height tiles, each covering a range of
+ * lines in print_bitmap, i.e. they are aligned with the ring buffer, not with
+ * the widget, so wrapping the buffer does not invalidate them. print_lines
+ * is always a multiple of PRINT_TILE_LINES, and PRINT_TILE_LINES must be
+ * even, since shell_print() writes line pairs.
+ */
+#define PRINT_TILE_LINES 200
 
+struct print_map_header {
+    int4 magic;
+    int4 version;
+    int4 lines;
+    int4 text_size;
+    int4 top;
+    int4 bottom;
+    int4 text_top;
+    int4 text_bottom;
+    int4 text_pixel_height;
+};
 
+static unsigned char *print_map = NULL;
+static size_t print_map_size;
+static int print_lines;
+static int print_text_size;
 static unsigned char *print_bitmap;
 static int printout_top;
 static int printout_bottom;
+static cairo_surface_t **print_tiles;
+static bool *print_tile_valid;
 static unsigned char *print_text;
 static int print_text_top;
 static int print_text_bottom;
@@ -125,6 +156,7 @@ static guint reminder_id = 0;
 static FILE *statefile = NULL;
 static char statefilename[FILENAMELEN];
 static char printfilename[FILENAMELEN];
+static char printmapfilename[FILENAMELEN];
 
 static int ann_updown = 0;
 static int ann_shift = 0;
@@ -135,6 +167,24 @@ static int ann_g = 0;
 static int ann_rad = 0;
 static guint ann_print_timeout_id = 0;
 
+/* State saving: the core serializes its state into a memory buffer on the
+ * main thread, and a worker thread writes that buffer to a temporary file,
+ * fsyncs it, and renames it over the actual state file. At most one save is
+ * in flight at any time. When a save fails, the previous state file is left
+ * alone, the main loop reports the failure, and the next checkpoint is a
+ * full save again, since the core's journal is relative to the lost one.
+ */
+#define AUTOSAVE_INTERVAL 60
+struct state_save_request {
+    char *buf;
+    size_t size;
+    char path[FILENAMELEN];
+};
+static pthread_t state_save_thread;
+static bool state_save_active = false;
+static bool state_save_failed = false;
+static bool state_changed = false;
+
 
 /* Private functions */
 
@@ -172,6 +222,9 @@ static gboolean delete_print_cb(GtkWidget *w, GdkEventAny *ev);
 static gboolean draw_cb(GtkWidget *w, cairo_t *cr, gpointer cd);
 static gboolean print_draw_cb(GtkWidget *w, cairo_t *cr, gpointer cd);
 static gboolean print_key_cb(GtkWidget *w, GdkEventKey *event, gpointer cd);
+static void print_adj_cb(GtkAdjustment *adj, gpointer cd);
+static void print_size_cb(GtkWidget *w, GdkRectangle *alloc, gpointer cd);
+static gboolean print_scroll_cb(GtkWidget *w, GdkEventScroll *event, gpointer cd);
 static gboolean button_cb(GtkWidget *w, GdkEventButton *event, gpointer cd);
 static gboolean key_cb(GtkWidget *w, GdkEventKey *event, gpointer cd);
 static void enable_reminder();
@@ -181,6 +234,14 @@ static gboolean timeout1(gpointer cd);
 static gboolean timeout2(gpointer cd);
 static gboolean timeout3(gpointer cd);
 static gboolean battery_checker(gpointer cd);
+static gboolean autosave(gpointer cd);
+static void save_state_in_background(const char *path);
+static void wait_for_state_save();
+static void show_state_save_failure(const char *path);
+static void init_printout();
+static int printout_length();
+static void sync_print_header();
+static void trim_print_text(int max_pixel_height);
 static void repaint_printout(cairo_t *cr);
 static gboolean reminder(gpointer cd);
 static void txt_writer(const char *text, int length);
@@ -471,6 +532,7 @@ static void activate(GtkApplication *theApp, gpointer userData) {
 
     snprintf(statefilename, FILENAMELEN, "%s/state", free42dirname);
     snprintf(printfilename, FILENAMELEN, "%s/print", free42dirname);
+    snprintf(printmapfilename, FILENAMELEN, "%s/print.map", free42dirname);
     snprintf(keymapfilename, FILENAMELEN, "%s/keymap", free42dirname);
 
 
@@ -618,57 +680,7 @@ static void activate(GtkApplication *theApp, gpointer userData) {
     /***** Build the print-out window *****/
     /**************************************/
 
-    // In the Motif version, I create an XImage and read the bitmap data into
-    // it; in the GTK version, that approach is not practical, since pixbuf
-    // only comes in 24-bit and 32-bit flavors -- which would mean wasting
-    // 25 megabytes for a 286x32768 pixbuf. So, instead, I use a 1 bpp buffer,
-    // and simply create pixbufs on the fly whenever I have to repaint.
-    print_bitmap = (unsigned char *) malloc(PRINT_SIZE);
-    print_text = (unsigned char *) malloc(PRINT_TEXT_SIZE);
-    // TODO - handle memory allocation failure
-
-    FILE *printfile = fopen(printfilename, "r");
-    if (printfile != NULL) {
-        int n = fread(&printout_bottom, 1, sizeof(int), printfile);
-        if (n == sizeof(int)) {
-            if (printout_bottom > PRINT_LINES) {
-                int excess = (printout_bottom - PRINT_LINES) * PRINT_BYTESPERLINE;
-                fseek(printfile, excess, SEEK_CUR);
-                printout_bottom = PRINT_LINES;
-            }
-            int bytes = printout_bottom * PRINT_BYTESPERLINE;
-            n = fread(print_bitmap, 1, bytes, printfile);
-            if (n == bytes) {
-                n = fread(&print_text_bottom, 1, sizeof(int), printfile);
-                int n2 = fread(&print_text_pixel_height, 1, sizeof(int), printfile);
-                if (n == sizeof(int) && n2 == sizeof(int)) {
-                    n = fread(print_text, 1, print_text_bottom, printfile);
-                    if (n != print_text_bottom) {
-                        print_text_bottom = 0;
-                        print_text_pixel_height = 0;
-                    }
-                } else {
-                    print_text_bottom = 0;
-                    print_text_pixel_height = 0;
-                }
-            } else {
-                printout_bottom = 0;
-                print_text_bottom = 0;
-                print_text_pixel_height = 0;
-            }
-        } else {
-            printout_bottom = 0;
-            print_text_bottom = 0;
-            print_text_pixel_height = 0;
-        }
-        fclose(printfile);
-    } else {
-        printout_bottom = 0;
-        print_text_bottom = 0;
-        print_text_pixel_height = 0;
-    }
-    printout_top = 0;
-    print_text_top = 0;
+    init_printout();
 
     printwindow = gtk_application_window_new(GTK_APPLICATION(app));
     gtk_window_set_icon(GTK_WINDOW(printwindow), icon_128);
@@ -677,22 +689,27 @@ static void activate(GtkApplication *theApp, gpointer userData) {
     g_signal_connect(G_OBJECT(printwindow), "delete_event",
                      G_CALLBACK(delete_print_cb), NULL);
 
-    GtkWidget *scroll = gtk_scrolled_window_new(NULL, NULL);
-    gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(scroll), GTK_POLICY_NEVER, GTK_POLICY_ALWAYS);
-    gtk_container_add(GTK_CONTAINER(printwindow), scroll);
-    GtkWidget *view = gtk_viewport_new(NULL, NULL);
-    gtk_container_add(GTK_CONTAINER(scroll), view);
+    GtkWidget *overlay = gtk_overlay_new();
+    gtk_container_add(GTK_CONTAINER(printwindow), overlay);
     print_widget = gtk_drawing_area_new();
-    gtk_widget_set_size_request(print_widget, 358, printout_bottom);
-    gtk_container_add(GTK_CONTAINER(view), print_widget);
-    print_adj = gtk_scrolled_window_get_vadjustment(GTK_SCROLLED_WINDOW(scroll));
+    gtk_widget_set_size_request(print_widget, 358, 1);
+    gtk_container_add(GTK_CONTAINER(overlay), print_widget);
+    int length = printout_length();
+    print_adj = gtk_adjustment_new(0, 0, length, 18, length, length);
+    GtkWidget *scrollbar = gtk_scrollbar_new(GTK_ORIENTATION_VERTICAL, print_adj);
+    gtk_widget_set_halign(scrollbar, GTK_ALIGN_END);
+    gtk_overlay_add_overlay(GTK_OVERLAY(overlay), scrollbar);
+    g_signal_connect(G_OBJECT(print_adj), "value-changed", G_CALLBACK(print_adj_cb), NULL);
     g_signal_connect(G_OBJECT(print_widget), "draw", G_CALLBACK(print_draw_cb), NULL);
+    g_signal_connect(G_OBJECT(print_widget), "size-allocate", G_CALLBACK(print_size_cb), NULL);
+    gtk_widget_add_events(print_widget, GDK_SCROLL_MASK | GDK_SMOOTH_SCROLL_MASK);
+    g_signal_connect(G_OBJECT(print_widget), "scroll-event", G_CALLBACK(print_scroll_cb), NULL);
     gtk_widget_set_can_focus(print_widget, TRUE);
     g_signal_connect(G_OBJECT(print_widget), "key-press-event", G_CALLBACK(print_key_cb), NULL);
 
     gtk_widget_show(print_widget);
-    gtk_widget_show(view);
-    gtk_widget_show(scroll);
+    gtk_widget_show(scrollbar);
+    gtk_widget_show(overlay);
 
     GdkGeometry geom;
     geom.min_width = 358;
@@ -746,6 +763,8 @@ static void activate(GtkApplication *theApp, gpointer userData) {
         }
     }
 
+    g_timeout_add_seconds(AUTOSAVE_INTERVAL, autosave, NULL);
+
     if (pipe(pype) != 0)
         fprintf(stderr, "Could not create pipe for signal handler; not catching signals.\n");
     else {
@@ -936,7 +955,10 @@ static void init_shell_state(int4 version) {
             core_settings.localized_copy_paste = true;
             /* fall through */
         case 9:
-            /* current version (SHELL_VERSION = 9),
+            state.printLines = PRINT_LINES_DEFAULT;
+            /* fall through */
+        case 10:
+            /* current version (SHELL_VERSION = 10),
              * so nothing to do here since everything
              * was initialized from the state file.
              */
@@ -944,6 +966,14 @@ static void init_shell_state(int4 version) {
     }
 }
 
+static int valid_print_lines(int lines) {
+    if (lines < PRINT_LINES_MIN)
+        lines = PRINT_LINES_MIN;
+    else if (lines > PRINT_LINES_MAX)
+        lines = PRINT_LINES_MAX;
+    return lines - lines % PRINT_TILE_LINES;
+}
+
 static int read_shell_state() {
     int4 magic;
     int4 state_size;
@@ -976,6 +1006,7 @@ static int read_shell_state() {
         core_settings.localized_copy_paste = state.localized_copy_paste;
 
     init_shell_state(state_version);
+    state.printLines = valid_print_lines(state.printLines);
     return 1;
 }
 
@@ -1014,67 +1045,7 @@ static gboolean gt_signal_handler(GIOChannel *source, GIOCondition condition,
 }
 
 static void quit() {
-    FILE *printfile;
-    int n, length;
-
-    printfile = fopen(printfilename, "w");
-    if (printfile != NULL) {
-        // Write bitmap
-        length = printout_bottom - printout_top;
-        if (length < 0)
-            length += PRINT_LINES;
-        n = fwrite(&length, 1, sizeof(int), printfile);
-        if (n != sizeof(int))
-            goto failed;
-        if (printout_bottom >= printout_top) {
-            n = fwrite(print_bitmap + PRINT_BYTESPERLINE * printout_top,
-                       1, PRINT_BYTESPERLINE * length, printfile);
-            if (n != PRINT_BYTESPERLINE * length)
-                goto failed;
-        } else {
-            n = fwrite(print_bitmap + PRINT_BYTESPERLINE * printout_top,
-                       1, PRINT_SIZE - PRINT_BYTESPERLINE * printout_top,
-                       printfile);
-            if (n != PRINT_SIZE - PRINT_BYTESPERLINE * printout_top)
-                goto failed;
-            n = fwrite(print_bitmap, 1,
-                       PRINT_BYTESPERLINE * printout_bottom, printfile);
-            if (n != PRINT_BYTESPERLINE * printout_bottom)
-                goto failed;
-        }
-        // Write text
-        length = print_text_bottom - print_text_top;
-        if (length < 0)
-            length += PRINT_TEXT_SIZE;
-        n = fwrite(&length, 1, sizeof(int), printfile);
-        if (n != sizeof(int))
-            goto failed;
-        n = fwrite(&print_text_pixel_height, 1, sizeof(int), printfile);
-        if (n != sizeof(int))
-            goto failed;
-        if (print_text_bottom >= print_text_top) {
-            n = fwrite(print_text + print_text_top, 1, length, printfile);
-            if (n != length)
-                goto failed;
-        } else {
-            n = fwrite(print_text + print_text_top, 1, PRINT_TEXT_SIZE - print_text_top, printfile);
-            if (n != PRINT_TEXT_SIZE - print_text_top)
-                goto failed;
-            n = fwrite(print_text, 1, print_text_bottom, printfile);
-            if (n != print_text_bottom)
-                goto failed;
-        }
-
-        fclose(printfile);
-        goto done;
-
-        failed:
-        fclose(printfile);
-        remove(printfilename);
-
-        done:
-        ;
-    }
+    sync_print_header();
 
     if (print_txt != NULL)
         fclose(print_txt);
@@ -1107,8 +1078,12 @@ static void quit() {
     }
     char corefilename[FILENAMELEN];
     snprintf(corefilename, FILENAMELEN, "%s/%s.p42", free42dirname, state.coreName);
-    core_save_state(corefilename);
+    save_state_in_background(corefilename);
     core_cleanup();
+    wait_for_state_save();
+    // Too late for the main loop to report it
+    if (state_save_failed)
+        show_state_save_failure(corefilename);
 
     shell_spool_exit();
 
@@ -1167,6 +1142,42 @@ static void scroll_printout_to_bottom() {
     gtk_adjustment_set_value(print_adj, upper - page_size);
 }
 
+static void print_adj_cb(GtkAdjustment *adj, gpointer cd) {
+    gtk_widget_queue_draw(print_widget);
+}
+
+static void print_size_cb(GtkWidget *w, GdkRectangle *alloc, gpointer cd) {
+    gdouble value = gtk_adjustment_get_value(print_adj);
+    gdouble upper = gtk_adjustment_get_upper(print_adj);
+    gdouble page_size = gtk_adjustment_get_page_size(print_adj);
+    bool at_bottom = value + page_size >= upper;
+    gtk_adjustment_configure(print_adj, value, 0, upper, 18,
+                             alloc->height, alloc->height);
+    if (at_bottom)
+        scroll_printout_to_bottom();
+}
+
+static gboolean print_scroll_cb(GtkWidget *w, GdkEventScroll *event, gpointer cd) {
+    // Three lines of text per notch
+    gdouble delta;
+    switch (event->direction) {
+        case GDK_SCROLL_UP:
+            delta = -54;
+            break;
+        case GDK_SCROLL_DOWN:
+            delta = 54;
+            break;
+        case GDK_SCROLL_SMOOTH:
+            delta = event->delta_y * 54;
+            break;
+        default:
+            return FALSE;
+    }
+    gtk_adjustment_set_value(print_adj,
+                             gtk_adjustment_get_value(print_adj) + delta);
+    return TRUE;
+}
+
 static void quitCB() {
     quit();
 }
@@ -1289,7 +1300,8 @@ static bool switchTo(const char *selectedStateName) {
             return false;
     } else {
         snprintf(path, FILENAMELEN, "%s/%s.p42", free42dirname, state.coreName);
-        core_save_state(path);
+        // The new state is loaded while the old one is being written out.
+        save_state_in_background(path);
     }
     core_cleanup();
     strncpy(state.coreName, selectedStateName, FILENAMELEN);
@@ -1410,6 +1422,18 @@ static void states_menu_duplicate() {
             show_message("Message", "State duplication failed.", dlg);
             return;
         }
+        // Changes checkpointed since the state was last saved in full
+        char origJournal[FILENAMELEN + 4];
+        snprintf(origJournal, FILENAMELEN + 4, "%s.jnl", origName);
+        if (file_exists(origJournal)) {
+            char finalJournal[FILENAMELEN + 4];
+            snprintf(finalJournal, FILENAMELEN + 4, "%s.jnl", finalName);
+            if (!copy_state(origJournal, finalJournal)) {
+                remove(finalName);
+                show_message("Message", "State duplication failed.", dlg);
+                return;
+            }
+        }
     }
     gtk_dialog_response(GTK_DIALOG(dlg), 4);
 }
@@ -1426,9 +1450,19 @@ static void states_menu_rename() {
     snprintf(oldpath, FILENAMELEN, "%s/%s.p42", free42dirname, state_names[selectedStateIndex]);
     char newpath[FILENAMELEN];
     snprintf(newpath, FILENAMELEN, "%s/%s.p42", free42dirname, newname);
-    rename(oldpath, newpath);
-    if (strcmp(state_names[selectedStateIndex], state.coreName) == 0)
-        strncpy(state.coreName, newname, FILENAMELEN);
+    if (rename(oldpath, newpath) == 0) {
+        // The checkpoint journal, if any, goes with it
+        char oldjnl[FILENAMELEN + 4];
+        snprintf(oldjnl, FILENAMELEN + 4, "%s.jnl", oldpath);
+        char newjnl[FILENAMELEN + 4];
+        snprintf(newjnl, FILENAMELEN + 4, "%s.jnl", newpath);
+        remove(newjnl);
+        rename(oldjnl, newjnl);
+        if (strcmp(state_names[selectedStateIndex], state.coreName) == 0) {
+            strncpy(state.coreName, newname, FILENAMELEN);
+            core_rename_state(newpath);
+        }
+    }
     gtk_dialog_response(GTK_DIALOG(dlg), 4);
 }
 
@@ -1453,6 +1487,9 @@ static void states_menu_delete() {
     char statePath[FILENAMELEN];
     snprintf(statePath, FILENAMELEN, "%s/%s.p42", free42dirname, stateName);
     remove(statePath);
+    char journalPath[FILENAMELEN + 4];
+    snprintf(journalPath, FILENAMELEN + 4, "%s.jnl", statePath);
+    remove(journalPath);
     gtk_dialog_response(GTK_DIALOG(dlg), 4);
 }
 
@@ -1557,6 +1594,9 @@ static void states_menu_export() {
 }
 
 static void states_menu_cb(GtkWidget *w, gpointer p) {
+    // All of these may read, rename, or delete state files, so make sure
+    // none of them are still being written.
+    wait_for_state_save();
     switch ((size_t) p) {
         case 0:
             states_menu_new();
@@ -2020,13 +2060,13 @@ static void copyPrintAsTextCB() {
 
     int len = print_text_bottom - print_text_top;
     if (len < 0)
-        len += PRINT_TEXT_SIZE;
+        len += print_text_size;
     // Calculate effective top, since printout_top can point
     // at a truncated line, and we want to skip those when
     // copying
     int top = printout_bottom - 2 * print_text_pixel_height;
     if (top < 0)
-        top += PRINT_LINES;
+        top += print_lines;
     int p = print_text_top;
     int pixel_v = 0;
     while (len > 0) {
@@ -2034,10 +2074,10 @@ static void copyPrintAsTextCB() {
         if (z >= 254) {
             int height;
             if (z == 254) {
-                if (p == PRINT_TEXT_SIZE)
+                if (p == print_text_size)
                     p = 0;
                 height = print_text[p++] << 8;
-                if (p == PRINT_TEXT_SIZE)
+                if (p == print_text_size)
                     p = 0;
                 height |= print_text[p++];
                 len -= 2;
@@ -2049,8 +2089,8 @@ static void copyPrintAsTextCB() {
                 int nv = v == height - 1 ? 1 : 2;
                 for (int vv = 0; vv < nv; vv++) {
                     int V = top + (pixel_v + v + vv) * 2;
-                    if (V >= PRINT_LINES)
-                        V -= PRINT_LINES;
+                    if (V >= print_lines)
+                        V -= print_lines;
                     for (int h = 0; h < 18; h++) {
                         unsigned char a = print_bitmap[V * PRINT_BYTESPERLINE + 2 * h + 1];
                         unsigned char b = print_bitmap[V * PRINT_BYTESPERLINE + 2 * h];
@@ -2061,11 +2101,11 @@ static void copyPrintAsTextCB() {
             }
             pixel_v += height;
         } else {
-            if (p + z < PRINT_TEXT_SIZE) {
+            if (p + z < print_text_size) {
                 shell_spool_txt((const char *) (print_text + p), z, tbwriter, tbnewliner);
                 p += z;
             } else {
-                int d = PRINT_TEXT_SIZE - p;
+                int d = print_text_size - p;
                 shell_spool_txt((const char *) (print_text + p), d, tbwriter, tbnonewliner);
                 shell_spool_txt((const char *) print_text, z - d, tbwriter, tbnewliner);
                 p = z - d;
@@ -2085,12 +2125,17 @@ static void copyPrintAsTextCB() {
 }
 
 static void copyPrintAsImageCB() {
-    int length = printout_bottom - printout_top;
-    if (length < 0)
-        length += PRINT_LINES;
+    int length = printout_length();
     bool empty = length == 0;
     if (empty)
         length += 2;
+    // With a large print_lines, the print-out can be too tall for a
+    // reasonable image; copy only the most recent part in that case.
+    int skip = 0;
+    if (length > 32766) {
+        skip = length - 32766;
+        length = 32766;
+    }
 
     GdkPixbuf *buf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE,
                                     8, 358, length);
@@ -2101,9 +2146,9 @@ static void copyPrintAsImageCB() {
         memset(d1, 255, 2148);
     } else {
         for (int v = 0; v < length; v++) {
-            int v2 = printout_top + v;
-            if (v2 >= PRINT_LINES)
-                v2 -= PRINT_LINES;
+            int v2 = printout_top + skip + v;
+            if (v2 >= print_lines)
+                v2 -= print_lines;
             int v3 = v2 * 36;
             guchar *dst = d1;
             for (int h = 0; h < 358; h++) {
@@ -2132,7 +2177,9 @@ static void clearPrintOutCB() {
     print_text_top = 0;
     print_text_bottom = 0;
     print_text_pixel_height = 0;
-    gtk_widget_set_size_request(print_widget, 358, 1);
+    sync_print_header();
+    gtk_adjustment_set_upper(print_adj, 0);
+    gtk_widget_queue_draw(print_widget);
 
     if (print_gif != NULL) {
         shell_finish_gif(gif_seeker, gif_writer);
@@ -2192,6 +2239,7 @@ static void preferencesCB() {
     static GtkWidget *printtogif;
     static GtkWidget *gifpath;
     static GtkWidget *gifheight;
+    static GtkWidget *printlines;
 
     if (dialog == NULL) {
         dialog = gtk_dialog_new_with_buttons(
@@ -2234,6 +2282,11 @@ static void preferencesCB() {
         gifheight = gtk_entry_new();
         gtk_entry_set_max_length(GTK_ENTRY(gifheight), 5);
         gtk_grid_attach(GTK_GRID(grid), gifheight, 2, 7, 1, 1);
+        label = gtk_label_new("Print-out length (pixels, after restart):");
+        gtk_grid_attach(GTK_GRID(grid), label, 0, 8, 2, 1);
+        printlines = gtk_entry_new();
+        gtk_entry_set_max_length(GTK_ENTRY(printlines), 7);
+        gtk_grid_attach(GTK_GRID(grid), printlines, 2, 8, 1, 1);
 
         g_signal_connect(G_OBJECT(browse1), "clicked", G_CALLBACK(browse_file),
                 (gpointer) new browse_file_info("Select Text File Name",
@@ -2258,6 +2311,9 @@ static void preferencesCB() {
     char maxlen[6];
     snprintf(maxlen, 6, "%d", state.printerGifMaxLength);
         gtk_entry_set_text(GTK_ENTRY(gifheight), maxlen);
+    char lines[8];
+    snprintf(lines, 8, "%d", state.printLines);
+    gtk_entry_set_text(GTK_ENTRY(printlines), lines);
     gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(repaintwholedisplay), !state.old_repaint);
 
     gtk_window_set_role(GTK_WINDOW(dialog), "Plus42 Dialog");
@@ -2301,6 +2357,12 @@ static void preferencesCB() {
         } else
             state.printerGifMaxLength = 256;
 
+        s = gtk_entry_get_text(GTK_ENTRY(printlines));
+        if (sscanf(s, "%d", &state.printLines) == 1)
+            state.printLines = valid_print_lines(state.printLines);
+        else
+            state.printLines = PRINT_LINES_DEFAULT;
+
         state.old_repaint = !gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(repaintwholedisplay));
     }
 
@@ -2499,6 +2561,7 @@ static gboolean print_key_cb(GtkWidget *w, GdkEventKey *event, gpointer cd) {
 
 static void shell_keydown() {
     GdkWindow *win = gtk_widget_get_window(calc_widget);
+    state_changed = true;
 
     int repeat;
     bool keep_running;
@@ -2826,50 +2889,453 @@ static gboolean timeout3(gpointer cd) {
     return FALSE;
 }
 
+static void show_state_save_failure(const char *path) {
+    char msg[FILENAMELEN + 64];
+    snprintf(msg, FILENAMELEN + 64, "Could not save state to \"%s\".", path);
+    show_message("Message", msg);
+}
+
+static gboolean state_save_failed_cb(gpointer data) {
+    char *path = (char *) data;
+    // So that the next autosave tries again
+    state_changed = true;
+    show_state_save_failure(path == NULL ? "(unknown)" : path);
+    free(path);
+    return FALSE;
+}
+
+static void *state_saver(void *arg) {
+    state_save_request *req = (state_save_request *) arg;
+    char tmpname[FILENAMELEN + 4];
+    snprintf(tmpname, FILENAMELEN + 4, "%s.tmp", req->path);
+    bool success = false;
+    int fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd != -1) {
+        size_t done = 0;
+        while (done < req->size) {
+            ssize_t n = write(fd, req->buf + done, req->size - done);
+            if (n == -1) {
+                if (errno == EINTR)
+                    continue;
+                break;
+            }
+            done += n;
+        }
+        success = done == req->size && fsync(fd) == 0;
+        if (close(fd) != 0)
+            success = false;
+        if (success)
+            success = rename(tmpname, req->path) == 0;
+        if (!success)
+            remove(tmpname);
+    }
+    if (!success) {
+        // Read by the main thread after joining this one
+        state_save_failed = true;
+        g_idle_add(state_save_failed_cb, strclone(req->path));
+    }
+    free(req->buf);
+    free(req);
+    return NULL;
+}
+
+static void wait_for_state_save() {
+    if (state_save_active) {
+        pthread_join(state_save_thread, NULL);
+        state_save_active = false;
+    }
+}
+
+static void save_state_in_background(const char *path) {
+    wait_for_state_save();
+    state_save_request *req = (state_save_request *) malloc(sizeof(state_save_request));
+    if (req == NULL || !core_snapshot_state(&req->buf, &req->size)) {
+        // Out of memory; fall back on saving directly to the file
+        free(req);
+        core_save_state(path);
+        return;
+    }
+    strncpy(req->path, path, FILENAMELEN);
+    req->path[FILENAMELEN - 1] = 0;
+    state_changed = false;
+    if (pthread_create(&state_save_thread, NULL, state_saver, req) == 0)
+        state_save_active = true;
+    else
+        state_saver(req);
+}
+
+static void checkpoint_state() {
+    // The journal is relative to the last snapshot, so that must be
+    // on disk first.
+    wait_for_state_save();
+    char corefilename[FILENAMELEN];
+    snprintf(corefilename, FILENAMELEN, "%s/%s.p42", free42dirname, state.coreName);
+    if (state_save_failed) {
+        // Try the full save again
+        state_save_failed = false;
+        save_state_in_background(corefilename);
+        return;
+    }
+    core_checkpoint_state(corefilename);
+    state_changed = false;
+}
+
+static gboolean autosave(gpointer cd) {
+    // Only checkpoint while the calculator is idle
+    if (state_changed && reminder_id == 0
+            && timeout3_id == 0 && ckey == 0 && !program_running())
+        checkpoint_state();
+    return TRUE;
+}
+
 static gboolean battery_checker(gpointer cd) {
     shell_low_battery();
     return TRUE;
 }
 
+static int printout_length() {
+    int length = printout_bottom - printout_top;
+    if (length < 0)
+        length += print_lines;
+    return length;
+}
+
+static void sync_print_header() {
+    if (print_map == NULL)
+        return;
+    print_map_header *h = (print_map_header *) print_map;
+    h->top = printout_top;
+    h->bottom = printout_bottom;
+    h->text_top = print_text_top;
+    h->text_bottom = print_text_bottom;
+    h->text_pixel_height = print_text_pixel_height;
+}
+
+static int text_size_for_lines(int lines) {
+    // Room for lines / 18 lines of text, plus two, plus one byte
+    return ((lines + 17) / 18 + 2) * 25 + 1;
+}
+
+static size_t print_map_size_for_lines(int lines) {
+    return PRINT_MAP_HEADER_SIZE + (size_t) lines * PRINT_BYTESPERLINE
+                                            + text_size_for_lines(lines);
+}
+
+/* Creates an empty print-out file with room for the given number of lines,
+ * and maps it. Returns NULL on failure.
+ */
+static unsigned char *create_print_map(const char *name, int lines) {
+    size_t size = print_map_size_for_lines(lines);
+    int fd = open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+        return NULL;
+    void *p = MAP_FAILED;
+    if (ftruncate(fd, size) == 0)
+        p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        remove(name);
+        return NULL;
+    }
+    print_map_header *h = (print_map_header *) p;
+    h->magic = PRINT_MAP_MAGIC;
+    h->version = PRINT_MAP_VERSION;
+    h->lines = lines;
+    h->text_size = text_size_for_lines(lines);
+    return (unsigned char *) p;
+}
+
+/* Maps an existing print-out file, after checking that it is consistent.
+ * Returns NULL if it doesn't exist or isn't usable.
+ */
+static unsigned char *open_print_map(const char *name) {
+    int fd = open(name, O_RDWR);
+    if (fd == -1)
+        return NULL;
+    struct stat st;
+    print_map_header h;
+    void *p = MAP_FAILED;
+    if (fstat(fd, &st) == 0
+            && pread(fd, &h, sizeof(h), 0) == sizeof(h)
+            && h.magic == PRINT_MAP_MAGIC
+            && h.version == PRINT_MAP_VERSION
+            && h.lines >= PRINT_LINES_MIN && h.lines <= PRINT_LINES_MAX
+            && h.lines % PRINT_TILE_LINES == 0
+            && h.text_size == text_size_for_lines(h.lines)
+            && (size_t) st.st_size == print_map_size_for_lines(h.lines)
+            && h.top >= 0 && h.top < h.lines
+            && h.bottom >= 0 && h.bottom < h.lines
+            && h.text_top >= 0 && h.text_top < h.text_size
+            && h.text_bottom >= 0 && h.text_bottom < h.text_size
+            && h.text_pixel_height >= 0)
+        p = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        return NULL;
+    return (unsigned char *) p;
+}
+
+static void use_print_map(unsigned char *map) {
+    print_map_header *h = (print_map_header *) map;
+    print_map = map;
+    print_map_size = print_map_size_for_lines(h->lines);
+    print_lines = h->lines;
+    print_text_size = h->text_size;
+    print_bitmap = map + PRINT_MAP_HEADER_SIZE;
+    print_text = print_bitmap + (size_t) print_lines * PRINT_BYTESPERLINE;
+    printout_top = h->top;
+    printout_bottom = h->bottom;
+    print_text_top = h->text_top;
+    print_text_bottom = h->text_bottom;
+    print_text_pixel_height = h->text_pixel_height;
+}
+
+/* Copies the current print-out into a freshly created map of a different
+ * size, keeping the most recent part if the new one is smaller.
+ */
+static void move_printout(unsigned char *newmap) {
+    print_map_header *h = (print_map_header *) newmap;
+    unsigned char *bitmap = newmap + PRINT_MAP_HEADER_SIZE;
+    unsigned char *text = bitmap + (size_t) h->lines * PRINT_BYTESPERLINE;
+
+    trim_print_text(h->lines / 2 - 1);
+    int len = print_text_bottom - print_text_top;
+    if (len < 0)
+        len += print_text_size;
+    if (len < h->text_size) {
+        for (int i = 0; i < len; i++)
+            text[i] = print_text[(print_text_top + i) % print_text_size];
+        h->text_bottom = len;
+        h->text_pixel_height = print_text_pixel_height;
+    }
+
+    int length = printout_length();
+    if (length > h->lines - 2)
+        length = h->lines - 2;
+    int v = printout_bottom - length;
+    if (v < 0)
+        v += print_lines;
+    for (int i = 0; i < length; i++) {
+        memcpy(bitmap + i * PRINT_BYTESPERLINE,
+               print_bitmap + v * PRINT_BYTESPERLINE, PRINT_BYTESPERLINE);
+        if (++v == print_lines)
+            v = 0;
+    }
+    h->bottom = length;
+}
+
+/* Reads a print-out saved by older versions, which wrote the whole thing to
+ * the "print" file at exit, into the current buffers. The old file is
+ * removed afterwards.
+ */
+static void read_old_printout() {
+    FILE *printfile = fopen(printfilename, "r");
+    if (printfile == NULL)
+        return;
+    int bottom, text_bottom = 0, text_pixel_height = 0;
+    int n = fread(&bottom, 1, sizeof(int), printfile);
+    if (n == sizeof(int) && bottom >= 0) {
+        if (bottom > print_lines - 2) {
+            int excess = (bottom - print_lines + 2) * PRINT_BYTESPERLINE;
+            fseek(printfile, excess, SEEK_CUR);
+            bottom = print_lines - 2;
+        }
+        int bytes = bottom * PRINT_BYTESPERLINE;
+        n = fread(print_bitmap, 1, bytes, printfile);
+        if (n == bytes) {
+            n = fread(&text_bottom, 1, sizeof(int), printfile);
+            int n2 = fread(&text_pixel_height, 1, sizeof(int), printfile);
+            if (n != sizeof(int) || n2 != sizeof(int)
+                    || text_bottom < 0 || text_bottom >= print_text_size
+                    || fread(print_text, 1, text_bottom, printfile)
+                                                    != (size_t) text_bottom) {
+                text_bottom = 0;
+                text_pixel_height = 0;
+            }
+            printout_bottom = bottom;
+            print_text_bottom = text_bottom;
+            print_text_pixel_height = text_pixel_height;
+            trim_print_text(print_lines / 2 - 1);
+        }
+    }
+    fclose(printfile);
+    sync_print_header();
+    remove(printfilename);
+}
+
+static void init_printout() {
+    int lines = state.printLines;
+    unsigned char *map = open_print_map(printmapfilename);
+    if (map != NULL && ((print_map_header *) map)->lines != lines) {
+        char tmpname[FILENAMELEN];
+        snprintf(tmpname, FILENAMELEN, "%s.tmp", printmapfilename);
+        unsigned char *newmap = create_print_map(tmpname, lines);
+        if (newmap != NULL) {
+            use_print_map(map);
+            move_printout(newmap);
+            munmap(map, print_map_size);
+            rename(tmpname, printmapfilename);
+            map = newmap;
+        }
+    }
+    if (map == NULL) {
+        map = create_print_map(printmapfilename, lines);
+        if (map != NULL) {
+            use_print_map(map);
+            read_old_printout();
+        }
+    }
+    if (map != NULL)
+        use_print_map(map);
+    else {
+        int err = errno;
+        fprintf(stderr, "Can't map \"%s\": %s (%d)\nThe print-out will not be saved.\n",
+                        printmapfilename, strerror(err), err);
+        print_lines = lines;
+        print_text_size = text_size_for_lines(lines);
+        print_bitmap = (unsigned char *) malloc((size_t) print_lines * PRINT_BYTESPERLINE);
+        print_text = (unsigned char *) malloc(print_text_size);
+        // TODO - handle memory allocation failure
+        printout_top = printout_bottom = 0;
+        print_text_top = print_text_bottom = 0;
+        print_text_pixel_height = 0;
+    }
+
+    int tiles = print_lines / PRINT_TILE_LINES;
+    print_tiles = (cairo_surface_t **) calloc(tiles, sizeof(cairo_surface_t *));
+    print_tile_valid = (bool *) calloc(tiles, sizeof(bool));
+    if (print_tiles == NULL || print_tile_valid == NULL) {
+        // Do without the tile cache; get_print_tile() will build a new
+        // tile every time.
+        free(print_tiles);
+        free(print_tile_valid);
+        print_tiles = NULL;
+        print_tile_valid = NULL;
+    }
+}
+
+/* Drops the oldest entries from the text ring buffer until the remaining
+ * ones cover no more than max_pixel_height printer pixels.
+ */
+static void trim_print_text(int max_pixel_height) {
+    while (print_text_pixel_height > max_pixel_height) {
+        unsigned char len = print_text[print_text_top];
+        int tll;
+        if (len == 255) {
+            /* Old-style fixed-size PRLCD */
+            tll = 16;
+        } else if (len == 254) {
+            /* New any-size PRLCD; height encoded in next 2 bytes */
+            if (++print_text_top == print_text_size)
+                print_text_top = 0;
+            tll = print_text[print_text_top] << 8;
+            if (++print_text_top == print_text_size)
+                print_text_top = 0;
+            tll |= print_text[print_text_top];
+        } else {
+            /* Text */
+            tll = 9;
+        }
+        print_text_pixel_height -= tll;
+        print_text_top += len >= 254 ? 1 : (print_text[print_text_top] + 1);
+        if (print_text_top >= print_text_size)
+            print_text_top -= print_text_size;
+    }
+}
+
+/* Copies the given range of print_bitmap lines into a tile. The tiles are
+ * 1-bit masks; in Cairo's A1 format, on little-endian machines, the first
+ * pixel is the least significant bit, just like in print_bitmap, so the
+ * lines can be copied as-is.
+ */
+static void fill_print_tile(cairo_surface_t *s, int t) {
+    cairo_surface_flush(s);
+    unsigned char *dst = cairo_image_surface_get_data(s);
+    int stride = cairo_image_surface_get_stride(s);
+    const unsigned char *src = print_bitmap
+                        + t * PRINT_TILE_LINES * PRINT_BYTESPERLINE;
+    for (int v = 0; v < PRINT_TILE_LINES; v++) {
+#if G_BYTE_ORDER == G_LITTLE_ENDIAN
+        memcpy(dst, src, PRINT_BYTESPERLINE);
+#else
+        for (int h = 0; h < PRINT_BYTESPERLINE; h++) {
+            unsigned char b = src[h], r = 0;
+            for (int i = 0; i < 8; i++)
+                if ((b & (1 << i)) != 0)
+                    r |= 128 >> i;
+            dst[h] = r;
+        }
+#endif
+        dst += stride;
+        src += PRINT_BYTESPERLINE;
+    }
+    cairo_surface_mark_dirty(s);
+}
+
+/* Returns the tile for the given range of print_bitmap lines, rebuilding it
+ * first if anything has been printed into it since it was last used. The
+ * caller must release the tile with cairo_surface_destroy().
+ */
+static cairo_surface_t *get_print_tile(int t) {
+    if (print_tiles == NULL) {
+        cairo_surface_t *s = cairo_image_surface_create(CAIRO_FORMAT_A1, 286, PRINT_TILE_LINES);
+        fill_print_tile(s, t);
+        return s;
+    }
+    cairo_surface_t *s = print_tiles[t];
+    if (s == NULL) {
+        s = cairo_image_surface_create(CAIRO_FORMAT_A1, 286, PRINT_TILE_LINES);
+        print_tiles[t] = s;
+        print_tile_valid[t] = false;
+    }
+    if (!print_tile_valid[t]) {
+        fill_print_tile(s, t);
+        print_tile_valid[t] = true;
+    }
+    return cairo_surface_reference(s);
+}
+
 static void repaint_printout(cairo_t *cr) {
     GdkRectangle clip;
     if (!gdk_cairo_get_clip_rectangle(cr, &clip))
         gtk_widget_get_allocation(print_widget, &clip);
 
-    GdkPixbuf *buf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE,
-                                    8, clip.width, clip.height);
-    int d_bpl = gdk_pixbuf_get_rowstride(buf);
-    guchar *d1 = gdk_pixbuf_get_pixels(buf);
-    int length = printout_bottom - printout_top;
-    if (length < 0)
-        length += PRINT_LINES;
-
-    for (int v = clip.y; v < clip.y + clip.height; v++) {
-        int v2 = printout_top + v;
-        if (v2 >= PRINT_LINES)
-            v2 -= PRINT_LINES;
-        int v3 = v2 * 36;
-        guchar *dst = d1;
-        for (int h = clip.x; h < clip.x + clip.width; h++) {
-            unsigned char c;
-            if (v >= length)
-                c = 127;
-            else if (h < 36 || h >= 322)
-                c = 255;
-            else if ((print_bitmap[v3 + ((h - 36) >> 3)] & (1 << ((h - 36) & 7))) == 0)
-                c = 255;
-            else
-                c = 0;
-            *dst++ = c;
-            *dst++ = c;
-            *dst++ = c;
+    // Switch to print-out coordinates
+    int offset = (int) gtk_adjustment_get_value(print_adj);
+    cairo_save(cr);
+    cairo_translate(cr, 0, -offset);
+    clip.y += offset;
+
+    int length = printout_length();
+    int clip_bottom = clip.y + clip.height;
+    int paper_bottom = clip_bottom < length ? clip_bottom : length;
+
+    if (paper_bottom < clip_bottom) {
+        int y = clip.y > length ? clip.y : length;
+        cairo_set_source_rgb(cr, 127 / 255.0, 127 / 255.0, 127 / 255.0);
+        cairo_rectangle(cr, clip.x, y, clip.width, clip_bottom - y);
+        cairo_fill(cr);
+    }
+    if (paper_bottom > clip.y) {
+        cairo_set_source_rgb(cr, 1, 1, 1);
+        cairo_rectangle(cr, clip.x, clip.y, clip.width, paper_bottom - clip.y);
+        cairo_fill(cr);
+
+        cairo_rectangle(cr, 36, clip.y, 286, paper_bottom - clip.y);
+        cairo_clip(cr);
+        cairo_set_source_rgb(cr, 0, 0, 0);
+        int v = clip.y;
+        while (v < paper_bottom) {
+            int p = (printout_top + v) % print_lines;
+            int t = p / PRINT_TILE_LINES;
+            int tile_y = v - (p - t * PRINT_TILE_LINES);
+            cairo_surface_t *tile = get_print_tile(t);
+            cairo_mask_surface(cr, tile, 36, tile_y);
+            cairo_surface_destroy(tile);
+            v = tile_y + PRINT_TILE_LINES;
         }
-        d1 += d_bpl;
     }
-
-    gdk_cairo_set_source_pixbuf(cr, buf, clip.x, clip.y);
-    cairo_paint(cr);
-    g_object_unref(G_OBJECT(buf));
+    cairo_restore(cr);
 }
 
 static gboolean reminder(gpointer cd) {
@@ -2882,6 +3348,9 @@ static gboolean reminder(gpointer cd) {
         return TRUE;
     else {
         reminder_id = 0;
+        // Whatever the program stored is journaled right away
+        if (!program_running())
+            checkpoint_state();
         return FALSE;
     }
 }
@@ -3216,77 +3685,69 @@ bool shell_clk24() {
     return strstr(buf, "A") == NULL;
 }
 
-struct print_growth_info {
-    int y, height;
-    print_growth_info(int yy, int hheight) : y(yy), height(hheight) {}
-};
+/* Doubles the width of a byte: bit n of the index becomes bits 2n and 2n+1
+ * of the entry. Used by shell_print() to scale printer lines up 2x.
+ */
+static uint2 print_expand[256];
 
-static gboolean print_widget_grew(GtkWidget *w, GdkEventConfigure *event,
-                                                                gpointer cd) {
-    print_growth_info *info = (print_growth_info *) cd;
-    scroll_printout_to_bottom();
-    GdkRectangle clip;
-    clip.x = 0;
-    clip.y = info->y;
-    clip.width = 358;
-    clip.height = info->height;
-    GdkWindow *win = gtk_widget_get_window(print_widget);
-    gdk_window_invalidate_rect(win, &clip, FALSE);
-    g_signal_handlers_disconnect_by_func(G_OBJECT(w), (gpointer) print_widget_grew, cd);
-    delete info;
-    return FALSE;
+static void init_print_expand() {
+    for (int i = 0; i < 256; i++) {
+        uint2 e = 0;
+        for (int b = 0; b < 8; b++)
+            if ((i & (1 << b)) != 0)
+                e |= 3 << (2 * b);
+        print_expand[i] = e;
+    }
 }
 
 void shell_print(const char *text, int length,
                  const char *bits, int bytesperline,
                  int x, int y, int width, int height) {
-    int xx, yy;
+    int yy;
     int oldlength, newlength;
 
+    if (print_expand[1] == 0)
+        init_print_expand();
+    int w = width < 143 ? width : 143;
+    int shift = x & 7;
+
     for (yy = 0; yy < height; yy++) {
-        int4 Y = (printout_bottom + 2 * yy) % PRINT_LINES;
-        for (xx = 0; xx < 143; xx++) {
-            int bit, px, py;
-            if (xx < width) {
-                char c = bits[(y + yy) * bytesperline + ((x + xx) >> 3)];
-                bit = (c & (1 << ((x + xx) & 7))) != 0;
-            } else
-                bit = 0;
-            for (px = xx * 2; px < (xx + 1) * 2; px++)
-                for (py = Y; py < Y + 2; py++)
-                    if (bit)
-                        print_bitmap[py * PRINT_BYTESPERLINE + (px >> 3)]
-                            |= 1 << (px & 7);
-                    else
-                        print_bitmap[py * PRINT_BYTESPERLINE + (px >> 3)]
-                            &= ~(1 << (px & 7));
+        int4 Y = (printout_bottom + 2 * yy) % print_lines;
+        if (print_tile_valid != NULL)
+            print_tile_valid[Y / PRINT_TILE_LINES] = false;
+        const unsigned char *src = (const unsigned char *) bits
+                                    + (y + yy) * bytesperline + (x >> 3);
+        unsigned char *dst = print_bitmap + Y * PRINT_BYTESPERLINE;
+        for (int k = 0; k < PRINT_BYTESPERLINE / 2; k++) {
+            int n = w - 8 * k;
+            unsigned char c = 0;
+            if (n > 0) {
+                c = src[k] >> shift;
+                if (shift != 0 && n > 8 - shift)
+                    c |= src[k + 1] << (8 - shift);
+                if (n < 8)
+                    c &= (1 << n) - 1;
+            }
+            uint2 e = print_expand[c];
+            dst[2 * k] = (unsigned char) e;
+            dst[2 * k + 1] = (unsigned char) (e >> 8);
         }
+        memcpy(dst + PRINT_BYTESPERLINE, dst, PRINT_BYTESPERLINE);
     }
 
     oldlength = printout_bottom - printout_top;
     if (oldlength < 0)
-        oldlength += PRINT_LINES;
-    printout_bottom = (printout_bottom + 2 * height) % PRINT_LINES;
+        oldlength += print_lines;
+    printout_bottom = (printout_bottom + 2 * height) % print_lines;
     newlength = oldlength + 2 * height;
 
-    if (newlength >= PRINT_LINES) {
-        printout_top = (printout_bottom + 2) % PRINT_LINES;
-        newlength = PRINT_LINES - 2;
-        if (newlength != oldlength)
-            gtk_widget_set_size_request(print_widget, 358, newlength);
-        scroll_printout_to_bottom();
-        gtk_widget_queue_draw(print_widget);
-    } else {
-        gtk_widget_set_size_request(print_widget, 358, newlength);
-        // The resize request does not take effect immediately;
-        // if I call scroll_printout_to_bottom() now, the scrolling will take
-        // place *before* the resizing, leaving the scroll bar in the wrong
-        // position.
-        // I work around this by using a callback to finish the job.
-        g_signal_connect(G_OBJECT(print_widget), "configure-event",
-                         G_CALLBACK(print_widget_grew),
-                         (gpointer) new print_growth_info(oldlength, 2 * height));
+    if (newlength >= print_lines) {
+        printout_top = (printout_bottom + 2) % print_lines;
+        newlength = print_lines - 2;
     }
+    gtk_adjustment_set_upper(print_adj, newlength);
+    scroll_printout_to_bottom();
+    gtk_widget_queue_draw(print_widget);
 
     if (state.printerToTxtFile) {
         int err;
@@ -3384,50 +3845,29 @@ void shell_print(const char *text, int length,
 
     if (text == NULL) {
         print_text[print_text_bottom] = 254;
-        print_text_bottom = (print_text_bottom + 1) % PRINT_TEXT_SIZE;
+        print_text_bottom = (print_text_bottom + 1) % print_text_size;
         print_text[print_text_bottom] = height >> 8;
-        print_text_bottom = (print_text_bottom + 1) % PRINT_TEXT_SIZE;
+        print_text_bottom = (print_text_bottom + 1) % print_text_size;
         print_text[print_text_bottom] = height;
-        print_text_bottom = (print_text_bottom + 1) % PRINT_TEXT_SIZE;
+        print_text_bottom = (print_text_bottom + 1) % print_text_size;
     } else {
         print_text[print_text_bottom] = length;
-        print_text_bottom = (print_text_bottom + 1) % PRINT_TEXT_SIZE;
+        print_text_bottom = (print_text_bottom + 1) % print_text_size;
     }
     if (text != NULL) {
-        if (print_text_bottom + length < PRINT_TEXT_SIZE) {
+        if (print_text_bottom + length < print_text_size) {
             memcpy(print_text + print_text_bottom, text, length);
             print_text_bottom += length;
         } else {
-            int part = PRINT_TEXT_SIZE - print_text_bottom;
+            int part = print_text_size - print_text_bottom;
             memcpy(print_text + print_text_bottom, text, part);
             memcpy(print_text, text + part, length - part);
             print_text_bottom = length - part;
         }
     }
     print_text_pixel_height += text == NULL ? height : 9;
-    while (print_text_pixel_height > PRINT_LINES / 2 - 1) {
-        unsigned char len = print_text[print_text_top];
-        int tll;
-        if (len == 255) {
-            /* Old-style fixed-size PRLCD */
-            tll = 16;
-        } else if (len == 254) {
-            /* New any-size PRLCD; height encoded in next 2 bytes */
-            if (++print_text_top == PRINT_TEXT_SIZE)
-                print_text_top = 0;
-            tll = print_text[print_text_top] << 8;
-            if (++print_text_top == PRINT_TEXT_SIZE)
-                print_text_top = 0;
-            tll |= print_text[print_text_top];
-        } else {
-            /* Text */
-            tll = 9;
-        }
-        print_text_pixel_height -= tll;
-        print_text_top += len >= 254 ? 1 : (print_text[print_text_top] + 1);
-        if (print_text_top >= PRINT_TEXT_SIZE)
-            print_text_top -= PRINT_TEXT_SIZE;
-    }
+    trim_print_text(print_lines / 2 - 1);
+    sync_print_header();
 }
 
 static FILE *logfile = NULL;
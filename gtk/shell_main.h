@@ -26,7 +26,7 @@ extern GtkWidget *calc_widget;
 extern bool allow_paint;
 extern int disp_rows, disp_cols;
 
-#define SHELL_VERSION 9
+#define SHELL_VERSION 10
 
 struct state_type {
     int extras;
@@ -46,6 +46,7 @@ struct state_type {
     bool auto_repeat;
     bool old_repaint;
     bool localized_copy_paste;
+    int printLines;
 };
 
 extern state_type state;
@@ -20,6 +20,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <dirent.h>
 
@@ -31,6 +32,7 @@
 #include "shell_main.h"
 #include "shell_loadimage.h"
 #include "core_main.h"
+#include "core_helpers.h"
 
 using std::string;
 using std::vector;
@@ -101,6 +103,9 @@ static SkinAnnunciator annunciators[7];
 static int disp_r, disp_c, disp_w, disp_h;
 
 static FILE *external_file;
+static string external_name;
+static unsigned char external_buf[16384];
+static int external_pos, external_len;
 static long builtin_length;
 static long builtin_pos;
 static const unsigned char *builtin_file;
@@ -112,6 +117,11 @@ static const SkinColor *skin_cmap;
 
 static char *disp_bits = NULL;
 static int disp_bpl;
+/* The display rendered at one pixel per LCD pixel, kept up to date by
+ * skin_display_invalidater(), and scaled up by skin_repaint_display().
+ */
+static cairo_surface_t *disp_surface = NULL;
+static void update_disp_surface(int x, int y, int width, int height);
 
 static vector<string> skin_labels;
 
@@ -198,10 +208,13 @@ static bool skin_open(const char *name, bool open_layout, bool force_builtin) {
     if (!force_builtin) {
         const char *suffix = open_layout ? ".layout" : ".gif";
         // Try Plus42 dir first...
+        external_pos = external_len = 0;
         string fname = string(free42dirname) + "/" + name + suffix;
         external_file = fopen(fname.c_str(), "r");
-        if (external_file != NULL)
+        if (external_file != NULL) {
+            external_name = fname;
             return true;
+        }
         // Next, shared dirs...
         const char *xdg_data_dirs = getenv("XDG_DATA_DIRS");
         if (xdg_data_dirs == NULL || xdg_data_dirs[0] == 0)
@@ -214,12 +227,14 @@ static bool skin_open(const char *name, bool open_layout, bool force_builtin) {
             string fname = dirname + "/plus42/" + name + suffix;
             external_file = fopen(fname.c_str(), "r");
             if (external_file != NULL) {
+                external_name = fname;
                 free(buf);
                 return true;
             }
             fname = dirname + "/plus42/skins/" + name + suffix;
             external_file = fopen(fname.c_str(), "r");
             if (external_file != NULL) {
+                external_name = fname;
                 free(buf);
                 return true;
             }
@@ -249,9 +264,18 @@ static bool skin_open(const char *name, bool open_layout, bool force_builtin) {
 }
 
 int skin_getchar() {
-    if (external_file != NULL)
-        return fgetc(external_file);
-    else if (builtin_pos < builtin_length)
+    if (external_file != NULL) {
+        // Read in blocks; shell_loadimage() asks for one byte at a time
+        if (external_pos == external_len) {
+            external_len = fread(external_buf, 1, sizeof(external_buf), external_file);
+            external_pos = 0;
+            if (external_len <= 0) {
+                external_len = 0;
+                return EOF;
+            }
+        }
+        return external_buf[external_pos++];
+    } else if (builtin_pos < builtin_length)
         return builtin_file[builtin_pos++];
     else
         return EOF;
@@ -286,6 +310,131 @@ static void skin_close() {
         fclose(external_file);
 }
 
+/* Decoded skin images are cached in <free42dirname>/skincache, as raw RGB
+ * pixbuf data, so that switching skins or starting up doesn't have to
+ * decode the GIF again. The cache key identifies the image source (path,
+ * size, and modification time for skins on disk; name, size, and the
+ * version of this build for built-in skins) and the parameters passed to
+ * shell_loadimage(). The file name is a hash of the skin name followed by a
+ * hash of the key, so that writing a new entry can remove the skin's stale
+ * ones; the key itself is stored in the file and checked on load.
+ */
+
+#define SKIN_CACHE_MAGIC 0x50343243
+#define SKIN_CACHE_VERSION 2
+
+static string skin_cache_prefix() {
+    char buf[18];
+    snprintf(buf, 18, "%016llx-", fnv1a64(state.skinName, strlen(state.skinName)));
+    return buf;
+}
+
+/* Must be called while the skin bitmap is open, before it is read. */
+static bool skin_cache_key(int extra, int dup_first_y, int dup_last_y,
+                           string *key, string *fname) {
+    char buf[256];
+    if (external_file != NULL) {
+        struct stat st;
+        if (fstat(fileno(external_file), &st) != 0)
+            return false;
+        snprintf(buf, 256, "file:%lld:%lld.%09ld:",
+                 (long long) st.st_size, (long long) st.st_mtim.tv_sec,
+                 (long) st.st_mtim.tv_nsec);
+        *key = buf + external_name;
+    } else {
+        // Built-in skins only change when the application does
+        snprintf(buf, 256, "builtin:" VERSION ":%ld:", builtin_length);
+        *key = buf + string(state.skinName);
+    }
+    snprintf(buf, 256, ":%d:%d:%d", extra, dup_first_y, dup_last_y);
+    *key += buf;
+    snprintf(buf, 256, "/skincache/%s%016llx", skin_cache_prefix().c_str(),
+             fnv1a64(key->c_str(), key->length()));
+    *fname = string(free42dirname) + buf;
+    return true;
+}
+
+static void free_cached_pixels(guchar *pixels, gpointer data) {
+    free(pixels);
+}
+
+static bool read_skin_cache(const string &key, const string &fname) {
+    FILE *f = fopen(fname.c_str(), "r");
+    if (f == NULL)
+        return false;
+    int4 hdr[6];
+    bool ok = false;
+    char *k = NULL;
+    guchar *pixels = NULL;
+    size_t size = 0;
+    if (fread(hdr, sizeof(int4), 6, f) != 6
+            || hdr[0] != SKIN_CACHE_MAGIC || hdr[1] != SKIN_CACHE_VERSION
+            || hdr[2] != (int4) key.length())
+        goto done;
+    k = (char *) malloc(hdr[2]);
+    if (k == NULL || fread(k, 1, hdr[2], f) != (size_t) hdr[2]
+            || memcmp(k, key.c_str(), hdr[2]) != 0)
+        goto done;
+    if (hdr[3] <= 0 || hdr[4] <= 0 || hdr[5] < hdr[3] * 3)
+        goto done;
+    size = (size_t) hdr[5] * hdr[4];
+    pixels = (guchar *) malloc(size);
+    if (pixels == NULL || fread(pixels, 1, size, f) != size)
+        goto done;
+    if (skin_image != NULL)
+        g_object_unref(skin_image);
+    skin_image = gdk_pixbuf_new_from_data(pixels, GDK_COLORSPACE_RGB, FALSE, 8,
+                                          hdr[3], hdr[4], hdr[5],
+                                          free_cached_pixels, NULL);
+    pixels = NULL;
+    ok = true;
+    done:
+    free(k);
+    free(pixels);
+    fclose(f);
+    return ok;
+}
+
+static void write_skin_cache(const string &key, const string &fname) {
+    string dir = string(free42dirname) + "/skincache";
+    mkdir(dir.c_str(), 0755);
+    // Entries for older versions of this skin will never be read again,
+    // and neither will entries from before names had a prefix
+    DIR *d = opendir(dir.c_str());
+    if (d != NULL) {
+        string prefix = skin_cache_prefix();
+        struct dirent *dent;
+        while ((dent = readdir(d)) != NULL)
+            if (strncmp(dent->d_name, prefix.c_str(), prefix.length()) == 0
+                    || (dent->d_name[0] != '.' && strchr(dent->d_name, '-') == NULL))
+                remove((dir + "/" + dent->d_name).c_str());
+        closedir(d);
+    }
+    string tmpname = fname + ".tmp";
+    FILE *f = fopen(tmpname.c_str(), "w");
+    if (f == NULL)
+        return;
+    int width = gdk_pixbuf_get_width(skin_image);
+    int height = gdk_pixbuf_get_height(skin_image);
+    int bpl = gdk_pixbuf_get_rowstride(skin_image);
+    const guchar *pixels = gdk_pixbuf_get_pixels(skin_image);
+    int4 hdr[6] = { SKIN_CACHE_MAGIC, SKIN_CACHE_VERSION, (int4) key.length(),
+                    width, height, bpl };
+    bool ok = fwrite(hdr, sizeof(int4), 6, f) == 6
+            && fwrite(key.c_str(), 1, key.length(), f) == key.length();
+    // The last row of a pixbuf isn't necessarily padded to the full stride
+    static const char pad[4] = { 0, 0, 0, 0 };
+    for (int y = 0; ok && y < height; y++)
+        ok = fwrite(pixels + y * bpl, 1, width * 3, f) == (size_t) (width * 3)
+            && fwrite(pad, 1, bpl - width * 3, f) == (size_t) (bpl - width * 3);
+    if (fclose(f) != 0)
+        ok = false;
+    if (ok)
+        ok = rename(tmpname.c_str(), fname.c_str()) == 0;
+    if (!ok)
+        remove(tmpname.c_str());
+}
+
 static void scan_skin_dir(const char *dirname, set<string> &names) {
     DIR *dir = opendir(dirname);
     if (dir == NULL)
@@ -755,7 +904,15 @@ void skin_load(int *width, int *height, int *rows, int *cols, int *flags) {
      * skin_put_pixels(), and skin_finish_image() to create the in-memory
      * representation.
      */
-    bool success = shell_loadimage(extra, dup_first_y, dup_last_y);
+    string cache_key, cache_name;
+    bool cacheable = skin_cache_key(extra, dup_first_y, dup_last_y,
+                                    &cache_key, &cache_name);
+    bool success = cacheable && read_skin_cache(cache_key, cache_name);
+    if (!success) {
+        success = shell_loadimage(extra, dup_first_y, dup_last_y);
+        if (success && cacheable)
+            write_skin_cache(cache_key, cache_name);
+    }
     skin_close();
 
     if (!success)
@@ -780,6 +937,11 @@ void skin_load(int *width, int *height, int *rows, int *cols, int *flags) {
     disp_bits = (char *) malloc(size);
     memset(disp_bits, 0, size);
 
+    if (disp_surface != NULL)
+        cairo_surface_destroy(disp_surface);
+    disp_surface = cairo_image_surface_create(CAIRO_FORMAT_RGB24, disp_w, disp_h);
+    update_disp_surface(0, 0, disp_w, disp_h);
+
     *rows = disp_rows;
     *cols = disp_cols;
     *flags = fl;
@@ -987,7 +1149,7 @@ void skin_repaint_key(cairo_t *cr, int key, bool state) {
 
         for (int v = y; v < y + height; v++)
             for (int h = x; h < x + width; h++)
-                if (((disp_bits[v * 17 + (h >> 3)] & (1 << (h & 7))) != 0) != state) {
+                if (((disp_bits[v * disp_bpl + (h >> 3)] & (1 << (h & 7))) != 0) != state) {
                     cairo_rectangle(cr, h, v, 1, 1);
                     cairo_fill(cr);
                 }
@@ -1064,14 +1226,46 @@ void skin_invalidate_key(GdkWindow *win, int key) {
     gdk_window_invalidate_rect(win, &clip, FALSE);
 }
 
+static void update_disp_surface(int x, int y, int width, int height) {
+    if (disp_surface == NULL)
+        return;
+    guint32 fg = (display_fg.r << 16) | (display_fg.g << 8) | display_fg.b;
+    guint32 bg = (display_bg.r << 16) | (display_bg.g << 8) | display_bg.b;
+    cairo_surface_flush(disp_surface);
+    unsigned char *data = cairo_image_surface_get_data(disp_surface);
+    int stride = cairo_image_surface_get_stride(disp_surface);
+    for (int v = y; v < y + height; v++) {
+        guint32 *p = (guint32 *) (data + v * stride);
+        const char *b = disp_bits + v * disp_bpl;
+        for (int h = x; h < x + width; h++)
+            p[h] = (b[h >> 3] & (1 << (h & 7))) != 0 ? fg : bg;
+    }
+    cairo_surface_mark_dirty_rectangle(disp_surface, x, y, width, height);
+}
+
 void skin_display_invalidater(GdkWindow *win, const char *bits, int bytesperline,
                                         int x, int y, int width, int height) {
-    for (int v = y; v < y + height; v++)
-        for (int h = x; h < x + width; h++)
-            if ((bits[v * bytesperline + (h >> 3)] & (1 << (h & 7))) != 0)
-                disp_bits[v * disp_bpl + (h >> 3)] |= 1 << (h & 7);
-            else
-                disp_bits[v * disp_bpl + (h >> 3)] &= ~(1 << (h & 7));
+    if (width > 0) {
+        // Both bitmaps use the same layout, so only the partial bytes at the
+        // edges of the rectangle need masking; the rest is copied as is.
+        int first = x >> 3;
+        int last = (x + width - 1) >> 3;
+        unsigned char lmask = (unsigned char) (0xff << (x & 7));
+        unsigned char rmask = (unsigned char) (0xff >> (7 - ((x + width - 1) & 7)));
+        if (first == last)
+            lmask &= rmask;
+        for (int v = y; v < y + height; v++) {
+            const unsigned char *src = (const unsigned char *) bits + v * bytesperline;
+            unsigned char *dst = (unsigned char *) disp_bits + v * disp_bpl;
+            dst[first] = (dst[first] & ~lmask) | (src[first] & lmask);
+            if (first == last)
+                continue;
+            if (last - first > 1)
+                memcpy(dst + first + 1, src + first + 1, last - first - 1);
+            dst[last] = (dst[last] & ~rmask) | (src[last] & rmask);
+        }
+    }
+    update_disp_surface(x, y, width, height);
 
     if (win != NULL) {
         if (allow_paint && display_enabled) {
@@ -1110,15 +1304,10 @@ void skin_repaint_display(cairo_t *cr) {
     cairo_clip(cr);
     cairo_set_source_rgb(cr, display_bg.r / 255.0, display_bg.g / 255.0, display_bg.b / 255.0);
     cairo_paint(cr);
-    cairo_set_source_rgb(cr, display_fg.r / 255.0, display_fg.g / 255.0, display_fg.b / 255.0);
-    for (int v = 0; v < disp_h; v++) {
-        for (int h = 0; h < disp_w; h++) {
-            if ((disp_bits[v * disp_bpl + (h >> 3)] & (1 << (h & 7))) != 0) {
-                cairo_rectangle(cr, h, v, 1, 1);
-                cairo_fill(cr);
-            }
-        }
-    }
+    cairo_set_source_surface(cr, disp_surface, 0, 0);
+    cairo_pattern_set_filter(cairo_get_source(cr), CAIRO_FILTER_NEAREST);
+    cairo_rectangle(cr, 0, 0, disp_w, disp_h);
+    cairo_fill(cr);
     cairo_restore(cr);
 }
 